@@ -0,0 +1,35 @@
+/*
+	File: bench.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: Backend of the benchmark. spi_bench.c reaches the driver only through these calls,
+		implemented for the /dev/spiN files of a board (bench_dev.c) and for the driver running
+		on the FE310 register model of the host simulator (bench_sim.c).
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+int bench_init(const char *module);							// module: name of the driver in /sys/module
+void bench_exit(void);
+const char *bench_name(void);
+
+// Module parameters of the driver
+int bench_get_param(const char *name, unsigned long *value);
+int bench_set_param(const char *name, unsigned long value);
+
+// File operations on /dev/spiN, file_no is N. Errors are returned as -errno
+int bench_open(unsigned int file_no, int flags);
+void bench_close(int fd);
+ssize_t bench_write(int fd, const void *buf, size_t len);
+ssize_t bench_read(int fd, void *buf, size_t len);
+int bench_ioctl(int fd, unsigned long cmd, void *arg);
+
+// Clocks: wall time, and CPU time used by the benchmark and the driver
+uint64_t bench_now_ns(void);
+uint64_t bench_cpu_ns(void);
+
+#endif
@@ -0,0 +1,127 @@
+/*
+	File: bench_dev.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Benchmark backend for a board: the /dev/spiN files and /sys/module parameters of the
+		loaded driver. CPU time is the process time plus the time of the driver's interrupt threads,
+		which run outside the process and are not counted (see the README).
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "bench.h"
+
+static const char *bench_module;
+
+int bench_init(const char *module)
+{
+	bench_module = module;
+	return 0;
+}
+
+void bench_exit(void)
+{
+}
+
+const char *bench_name(void)
+{
+	return "device";
+}
+
+static int bench_param_path(char *path, size_t size, const char *name)
+{
+	return snprintf(path, size, "/sys/module/%s/parameters/%s", bench_module, name) >= (int) size ? -ENAMETOOLONG : 0;
+}
+
+int bench_get_param(const char *name, unsigned long *value)
+{
+	char path[256];
+	FILE *file;
+	int ret;
+
+	if (bench_param_path(path, sizeof(path), name)) {
+		return -ENAMETOOLONG;
+	}
+	file = fopen(path, "r");
+	if (file == NULL) {
+		return -errno;
+	}
+	ret = fscanf(file, "%lu", value) == 1 ? 0 : -EINVAL;
+	fclose(file);
+	return ret;
+}
+
+int bench_set_param(const char *name, unsigned long value)
+{
+	char path[256];
+	FILE *file;
+	int ret;
+
+	if (bench_param_path(path, sizeof(path), name)) {
+		return -ENAMETOOLONG;
+	}
+	file = fopen(path, "w");
+	if (file == NULL) {
+		return -errno;
+	}
+	ret = fprintf(file, "%lu\n", value) > 0 ? 0 : -EIO;
+	if (fclose(file) != 0 && ret == 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+int bench_open(unsigned int file_no, int flags)
+{
+	char path[32];
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/spi%u", file_no);
+	fd = open(path, O_RDWR | flags);
+	return fd < 0 ? -errno : fd;
+}
+
+void bench_close(int fd)
+{
+	close(fd);
+}
+
+ssize_t bench_write(int fd, const void *buf, size_t len)
+{
+	ssize_t ret = write(fd, buf, len);
+	return ret < 0 ? -errno : ret;
+}
+
+ssize_t bench_read(int fd, void *buf, size_t len)
+{
+	ssize_t ret = read(fd, buf, len);
+	return ret < 0 ? -errno : ret;
+}
+
+int bench_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	int ret = ioctl(fd, cmd, arg);
+	return ret < 0 ? -errno : ret;
+}
+
+static uint64_t bench_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t bench_now_ns(void)
+{
+	return bench_clock_ns(CLOCK_MONOTONIC);
+}
+
+uint64_t bench_cpu_ns(void)
+{
+	return bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
@@ -0,0 +1,140 @@
+/*
+	File: bench_sim.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Benchmark backend for the host simulator: the driver is loaded on the FE310 register model
+		(4 CS lines, loopback slave, the costs of sim/spi_sim.c) and its file operations are called directly.
+		Time is virtual, so results are deterministic. CPU time is the virtual time not spent waiting
+		for the hardware: register accesses, interrupt handling and busy waits.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "bench.h"
+
+#define BENCH_SIM_FILES		16
+
+struct bench_sim_file {
+	bool used;
+	struct inode inode;
+	struct file file;
+};
+
+static struct bench_sim_file bench_files[BENCH_SIM_FILES];
+
+int bench_init(const char *module)
+{
+	struct sim_config config = {
+		.spi = {
+			.fifo_depth = 8,
+			.clk_hz = 16000000,
+			.sck_hz = 1000000,
+			.num_cs = 4,
+			.slave = FE310_SLAVE_LOOPBACK,
+		},
+		.mmio_ns = 50,
+		.irq_ns = 2000,
+		.thread_ns = 4000,
+		.has_irq = true,
+	};
+
+	sim_init(&config);
+	if (sim_module_init_fn() != 0 || sim.driver == NULL || sim.cdev == NULL) {
+		fprintf(stderr, "bench: driver failed to load in the simulator\n");
+		return -ENODEV;
+	}
+	return 0;
+}
+
+void bench_exit(void)
+{
+	sim_module_exit_fn();
+	sim_cleanup();
+}
+
+const char *bench_name(void)
+{
+	return "simulator";
+}
+
+int bench_get_param(const char *name, unsigned long *value)
+{
+	// Not readable in the simulator, which starts from the defaults every run
+	return -ENOENT;
+}
+
+int bench_set_param(const char *name, unsigned long value)
+{
+	char assignment[128];
+
+	snprintf(assignment, sizeof(assignment), "%s=%lu", name, value);
+	return sim_param_set(assignment) ? -EINVAL : 0;
+}
+
+int bench_open(unsigned int file_no, int flags)
+{
+	const struct file_operations *fops = sim.cdev->ops;
+
+	for (int fd = 0; fd < BENCH_SIM_FILES; fd++) {
+		struct bench_sim_file *f = &bench_files[fd];
+		int ret;
+
+		if (f->used) {
+			continue;
+		}
+		memset(f, 0, sizeof(*f));
+		f->inode.i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + file_no);
+		f->inode.i_cdev = sim.cdev;
+		f->file.f_op = fops;
+		f->file.f_mode = FMODE_READ | FMODE_WRITE;		// opened O_RDWR, as by bench_dev.c
+		f->file.f_flags = flags;
+		f->file.f_inode = &f->inode;
+		ret = fops->open ? fops->open(&f->inode, &f->file) : 0;
+		if (ret) {
+			return ret;
+		}
+		f->used = true;
+		return fd;
+	}
+	return -EMFILE;
+}
+
+void bench_close(int fd)
+{
+	struct bench_sim_file *f = &bench_files[fd];
+
+	if (sim.cdev->ops->release) {
+		sim.cdev->ops->release(&f->inode, &f->file);
+	}
+	f->used = false;
+}
+
+ssize_t bench_write(int fd, const void *buf, size_t len)
+{
+	struct file *file = &bench_files[fd].file;
+	return file->f_op->write(file, buf, len, &file->f_pos);
+}
+
+ssize_t bench_read(int fd, void *buf, size_t len)
+{
+	struct file *file = &bench_files[fd].file;
+	return file->f_op->read(file, buf, len, &file->f_pos);
+}
+
+int bench_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	struct file *file = &bench_files[fd].file;
+	return file->f_op->unlocked_ioctl(file, cmd, (unsigned long) (uintptr_t) arg);
+}
+
+uint64_t bench_now_ns(void)
+{
+	return sim.now;
+}
+
+uint64_t bench_cpu_ns(void)
+{
+	return sim.now - sim.stats.idle_ns;
+}
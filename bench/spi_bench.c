@@ -0,0 +1,396 @@
+/*
+	File: spi_bench.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Throughput and latency benchmark of the /dev/spiN files. Sweeps message sizes, CS lines
+		and polled vs interrupt driven transfers, and reports for each: throughput, latency percentiles
+		of write(), system calls per KiB and CPU use. Built for a board (bench_dev.c) and for the host
+		simulator (bench_sim.c), see the Benchmark section of the README.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/stz_spi.h"
+#include "bench.h"
+
+#define MAX_LIST			32
+#define MIN_COUNT			4			// writes per row, at least
+#define MAX_COUNT			1000		// and at most
+
+enum bench_mode { MODE_POLL, MODE_IRQ };
+
+static const char *const mode_names[] = { "poll", "irq" };
+
+struct options {
+	unsigned long sizes[MAX_LIST];
+	unsigned int num_sizes;
+	unsigned long cs[MAX_LIST];
+	unsigned int num_cs;
+	enum bench_mode modes[2];
+	unsigned int num_modes;
+	unsigned long budget;				// bytes written per row, split in writes of each size
+	unsigned long speed_hz;				// 0 keeps the rate of the file
+	const char *module;
+	bool csv;
+};
+
+struct row {
+	unsigned long count;				// writes
+	unsigned long bytes;				// bytes written
+	unsigned long received;				// bytes read back
+	unsigned long syscalls;				// write, read and ioctl calls
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t *latency_ns;				// of each write, sorted
+};
+
+static int parse_list(const char *arg, unsigned long *list, unsigned int *num)
+{
+	/*
+		Parses a comma separated list of numbers, with an optional k or M (KiB, MiB) suffix.
+	*/
+	char *end;
+
+	*num = 0;
+	while (*arg) {
+		if (*num == MAX_LIST) {
+			return -1;
+		}
+		list[*num] = strtoul(arg, &end, 0);
+		if (end == arg) {
+			return -1;
+		}
+		if (*end == 'k' || *end == 'K') {
+			list[*num] <<= 10;
+			end++;
+		} else if (*end == 'M') {
+			list[*num] <<= 20;
+			end++;
+		}
+		(*num)++;
+		if (*end == ',') {
+			end++;
+		} else if (*end) {
+			return -1;
+		}
+		arg = end;
+	}
+	return *num ? 0 : -1;
+}
+
+static int parse_modes(const char *arg, struct options *opts)
+{
+	char copy[64];
+	char *saveptr;
+
+	snprintf(copy, sizeof(copy), "%s", arg);
+	opts->num_modes = 0;
+	for (char *name = strtok_r(copy, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		if (opts->num_modes == 2) {
+			return -1;
+		}
+		if (strcmp(name, "poll") == 0) {
+			opts->modes[opts->num_modes++] = MODE_POLL;
+		} else if (strcmp(name, "irq") == 0) {
+			opts->modes[opts->num_modes++] = MODE_IRQ;
+		} else {
+			return -1;
+		}
+	}
+	return opts->num_modes ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --sizes LIST     message sizes in bytes, k/M suffixes allowed (default 1,16,256,4k,64k,1M)\n"
+		"  --cs LIST        /dev/spiN files to use (default 0)\n"
+		"  --modes LIST     poll, irq or both (default poll,irq)\n"
+		"  --bytes N        bytes written per row; rows do %d to %d writes (default 256k)\n"
+		"  --speed HZ       SCK rate set with STZ_SPI_IOC_WR_CONFIG (default: keep the rate of the file)\n"
+		"  --module NAME    driver name in /sys/module (default spi)\n"
+		"  --csv            print comma separated values\n",
+		prog, MIN_COUNT, MAX_COUNT);
+}
+
+static void parse_args(int argc, char **argv, struct options *opts)
+{
+	static const struct option long_options[] = {
+		{ "sizes", required_argument, NULL, 's' },
+		{ "cs", required_argument, NULL, 'c' },
+		{ "modes", required_argument, NULL, 'm' },
+		{ "bytes", required_argument, NULL, 'b' },
+		{ "speed", required_argument, NULL, 'f' },
+		{ "module", required_argument, NULL, 'M' },
+		{ "csv", no_argument, NULL, 'C' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	unsigned long value[MAX_LIST];
+	unsigned int num;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			if (parse_list(optarg, opts->sizes, &opts->num_sizes)) {
+				goto invalid;
+			}
+			break;
+		case 'c':
+			if (parse_list(optarg, opts->cs, &opts->num_cs)) {
+				goto invalid;
+			}
+			break;
+		case 'm':
+			if (parse_modes(optarg, opts)) {
+				goto invalid;
+			}
+			break;
+		case 'b':
+			if (parse_list(optarg, value, &num) || num != 1 || value[0] == 0) {
+				goto invalid;
+			}
+			opts->budget = value[0];
+			break;
+		case 'f':
+			if (parse_list(optarg, value, &num) || num != 1) {
+				goto invalid;
+			}
+			opts->speed_hz = value[0];
+			break;
+		case 'M':
+			opts->module = optarg;
+			break;
+		case 'C':
+			opts->csv = true;
+			break;
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 2);
+		}
+	}
+	if (optind < argc) {
+		goto invalid;
+	}
+	for (unsigned int i = 0; i < opts->num_sizes; i++) {
+		if (opts->sizes[i] == 0) {
+			goto invalid;
+		}
+	}
+	return;
+
+invalid:
+	usage(argv[0]);
+	exit(2);
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct row *row, unsigned int pct)
+{
+	// Nearest rank
+	unsigned long rank = (row->count * pct + 99) / 100;
+	return row->latency_ns[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static int run_row(const struct options *opts, unsigned int cs, unsigned long size,
+				   char *tx, char *rx, struct row *row)
+{
+	/*
+		Opens /dev/spi<cs> non-blocking and writes count messages of size bytes. Each write returns
+		once the message has been sent and received; the received bytes are then read back until
+		the file returns -EAGAIN. A write longer than the free room of the receive ring is cut short by the driver,
+		so the ring is read before the rest is written: every byte is read back.
+		Only the writes are timed for the latency, the whole loop for the throughput and the CPU use.
+	*/
+	unsigned long count = opts->budget / size;
+	uint64_t start_ns, start_cpu_ns;
+	int fd, ret = 0;
+
+	if (count < MIN_COUNT) {
+		count = MIN_COUNT;
+	} else if (count > MAX_COUNT) {
+		count = MAX_COUNT;
+	}
+	memset(row, 0, sizeof(*row));
+	row->latency_ns = calloc(count, sizeof(*row->latency_ns));
+	if (row->latency_ns == NULL) {
+		return -ENOMEM;
+	}
+
+	fd = bench_open(cs, O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "bench: cannot open /dev/spi%u: %s\n", cs, strerror(-fd));
+		return fd;
+	}
+	if (opts->speed_hz) {
+		struct stz_spi_config config;
+
+		ret = bench_ioctl(fd, STZ_SPI_IOC_RD_CONFIG, &config);
+		if (ret == 0) {
+			config.speed_hz = opts->speed_hz;
+			ret = bench_ioctl(fd, STZ_SPI_IOC_WR_CONFIG, &config);
+		}
+		if (ret) {
+			fprintf(stderr, "bench: cannot set %lu Hz on /dev/spi%u: %s\n", opts->speed_hz, cs, strerror(-ret));
+			bench_close(fd);
+			return ret;
+		}
+	}
+
+	start_ns = bench_now_ns();
+	start_cpu_ns = bench_cpu_ns();
+	for (unsigned long n = 0; n < count && ret == 0; n++) {
+		unsigned long sent = 0;
+
+		while (sent < size) {
+			uint64_t write_ns = bench_now_ns();
+			ssize_t done = bench_write(fd, tx + sent, size - sent);
+			ssize_t got;
+
+			row->latency_ns[n] += bench_now_ns() - write_ns;
+			row->syscalls++;
+			if (done < 0 && (done != -EAGAIN || sent == 0)) {
+				fprintf(stderr, "bench: write of %lu bytes to /dev/spi%u failed: %s\n", size, cs, strerror(-done));
+				ret = done;
+				break;
+			}
+			if (done > 0) {
+				sent += done;
+				row->bytes += done;
+			}
+
+			do {
+				got = bench_read(fd, rx, size);
+				row->syscalls++;
+				if (got > 0) {
+					row->received += got;
+				}
+			} while (got > 0);
+			if (got != -EAGAIN && got != 0) {
+				fprintf(stderr, "bench: read of /dev/spi%u failed: %s\n", cs, strerror(-got));
+				ret = got;
+				break;
+			}
+		}
+		if (sent == size) {
+			row->count++;
+		}
+	}
+	row->wall_ns = bench_now_ns() - start_ns;
+	row->cpu_ns = bench_cpu_ns() - start_cpu_ns;
+	bench_close(fd);
+
+	qsort(row->latency_ns, row->count, sizeof(*row->latency_ns), compare_ns);
+	return row->count ? ret : -EIO;
+}
+
+static void print_header(const struct options *opts)
+{
+	if (opts->csv) {
+		printf("mode,cs,size,writes,bytes_per_s,p50_us,p90_us,p99_us,max_us,syscalls_per_kib,cpu_pct,rx_pct\n");
+		return;
+	}
+	printf("%-5s %3s %9s %6s %12s %10s %10s %10s %10s %9s %6s %6s\n",
+		"mode", "cs", "size", "writes", "bytes/s", "p50 us", "p90 us", "p99 us", "max us",
+		"calls/KiB", "cpu %", "rx %");
+}
+
+static void print_row(const struct options *opts, enum bench_mode mode, unsigned int cs,
+					  unsigned long size, const struct row *row)
+{
+	double seconds = row->wall_ns / 1e9;
+	double rate = seconds > 0 ? row->bytes / seconds : 0;
+	double calls = row->syscalls * 1024.0 / row->bytes;
+	double cpu = row->wall_ns ? 100.0 * row->cpu_ns / row->wall_ns : 0;
+	double rx = 100.0 * row->received / row->bytes;		// below 100: bytes dropped by the rx ring (rx_backpressure=0)
+
+	printf(opts->csv ? "%s,%u,%lu,%lu,%.0f,%.1f,%.1f,%.1f,%.1f,%.3f,%.1f,%.1f\n"
+					 : "%-5s %3u %9lu %6lu %12.0f %10.1f %10.1f %10.1f %10.1f %9.3f %6.1f %6.1f\n",
+		   mode_names[mode], cs, size, row->count, rate,
+		   percentile_us(row, 50), percentile_us(row, 90), percentile_us(row, 99),
+		   row->latency_ns[row->count - 1] / 1000.0, calls, cpu, rx);
+}
+
+int main(int argc, char **argv)
+{
+	struct options opts = {
+		.sizes = { 1, 16, 256, 4096, 65536, 1048576 },
+		.num_sizes = 6,
+		.cs = { 0 },
+		.num_cs = 1,
+		.modes = { MODE_POLL, MODE_IRQ },
+		.num_modes = 2,
+		.budget = 256 * 1024,
+		.module = "spi",
+	};
+	unsigned long max_size = 0;
+	unsigned long poll_threshold_us;
+	bool restore_threshold;
+	char *tx, *rx;
+	int ret = 0;
+
+	parse_args(argc, argv, &opts);
+	for (unsigned int i = 0; i < opts.num_sizes; i++) {
+		if (opts.sizes[i] > max_size) {
+			max_size = opts.sizes[i];
+		}
+	}
+	tx = malloc(max_size);
+	rx = malloc(max_size);
+	if (tx == NULL || rx == NULL) {
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+	for (unsigned long i = 0; i < max_size; i++) {
+		tx[i] = 'A' + (i % 26);
+	}
+
+	if (bench_init(opts.module)) {
+		return 1;
+	}
+	restore_threshold = bench_get_param("poll_threshold_us", &poll_threshold_us) == 0;
+
+	if (!opts.csv) {
+		printf("spi_bench on the %s, %lu bytes per row\n", bench_name(), opts.budget);
+	}
+	print_header(&opts);
+	for (unsigned int m = 0; m < opts.num_modes && ret == 0; m++) {
+		// Every transfer is polled below the threshold, and none above it
+		ret = bench_set_param("poll_threshold_us", opts.modes[m] == MODE_POLL ? 1000000000 : 0);
+		if (ret) {
+			fprintf(stderr, "bench: cannot set poll_threshold_us of module %s: %s\n", opts.module, strerror(-ret));
+			break;
+		}
+		for (unsigned int c = 0; c < opts.num_cs && ret == 0; c++) {
+			for (unsigned int s = 0; s < opts.num_sizes && ret == 0; s++) {
+				struct row row;
+
+				ret = run_row(&opts, opts.cs[c], opts.sizes[s], tx, rx, &row);
+				if (row.count) {
+					print_row(&opts, opts.modes[m], opts.cs[c], opts.sizes[s], &row);
+				}
+				free(row.latency_ns);
+			}
+		}
+	}
+
+	if (restore_threshold) {
+		bench_set_param("poll_threshold_us", poll_threshold_us);
+	}
+	bench_exit();
+	free(tx);
+	free(rx);
+	return ret ? 1 : 0;
+}
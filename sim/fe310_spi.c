@@ -0,0 +1,355 @@
+/*
+	File: fe310_spi.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Register-level model of the SiFive FE310 SPI block (see fe310_spi.h).
+		Register behaviour follows chapter 18 of the FE310-G000 manual.
+*/
+
+#include <string.h>
+#include "fe310_spi.h"
+
+#define REG(spi, offset)	((spi)->regs[(offset) / 4])
+
+static void fifo_push(struct fe310_fifo *fifo, unsigned int depth, uint8_t data)
+{
+	fifo->data[(fifo->head + fifo->count) % depth] = data;
+	fifo->count++;
+}
+
+static uint8_t fifo_pop(struct fe310_fifo *fifo, unsigned int depth)
+{
+	uint8_t data = fifo->data[fifo->head];
+	fifo->head = (fifo->head + 1) % depth;
+	fifo->count--;
+	return data;
+}
+
+static uint32_t mark_mask(unsigned int depth)
+{
+	/*
+		Bits of the txmark and rxmark fields: wide enough for 0 to depth - 1, as log2(depth) bits
+		for the power of two depths of the FE310. Higher bits read as zero.
+	*/
+	uint32_t mask = 0;
+
+	while (mask < depth - 1) {
+		mask = (mask << 1) | 1;
+	}
+	return mask;
+}
+
+static uint64_t sck_cycles_ns(const struct fe310_spi *spi, uint64_t cycles)
+{
+	/*
+		Duration of a number of SCK cycles: f_sck = f_in / (2 * (div + 1)).
+	*/
+	uint64_t div = (REG(spi, FE310_SCK_DIV) & 0xFFF) + 1;
+	return cycles * 2 * div * 1000000000ULL / spi->config.clk_hz;
+}
+
+static uint64_t frame_cycles(const struct fe310_spi *spi)
+{
+	/*
+		SCK cycles needed to shift one frame: len bits over 1, 2 or 4 data lines.
+	*/
+	uint32_t fmt = REG(spi, FE310_FMT);
+	unsigned int len = (fmt >> FE310_FMT_LEN_SHIFT) & FE310_FMT_LEN_MASK;
+	unsigned int lanes = 1U << (fmt & FE310_FMT_PROTO);
+	if (lanes > 4) {
+		lanes = 4;
+	}
+	return (len + lanes - 1) / lanes;
+}
+
+static uint8_t flash_transfer(struct fe310_spi *spi, uint8_t mosi)
+{
+	/*
+		Serial flash: a command byte, 3 address bytes, dummy bytes for the fast reads, then data
+		from the address on. MISO is high outside the data phase. Frames are bytes whatever the
+		number of data lines they use, so dual and quad reads work the same way.
+	*/
+	unsigned int pos = spi->flash_pos++;
+	unsigned int dummy;
+
+	if (pos == 0) {
+		spi->flash_cmd = mosi;
+		spi->flash_addr = 0;
+		return 0xFF;
+	}
+	switch (spi->flash_cmd) {
+	case 0x03: dummy = 0; break;			// read
+	case 0x0B:								// fast read
+	case 0x3B:								// dual output fast read
+	case 0x6B:								// quad output fast read
+	case 0xBB: dummy = 1; break;			// dual I/O fast read: mode byte
+	case 0xEB: dummy = 3; break;			// quad I/O fast read: mode byte and 4 dummy cycles
+	default: return 0xFF;
+	}
+	if (pos <= 3) {
+		spi->flash_addr = (spi->flash_addr << 8) | mosi;
+		return 0xFF;
+	}
+	if (pos <= 3 + dummy) {
+		return 0xFF;
+	}
+	return fe310_flash_byte(spi->flash_addr++);
+}
+
+static uint8_t slave_transfer(struct fe310_spi *spi, uint8_t mosi)
+{
+	switch (spi->config.slave) {
+	case FE310_SLAVE_PATTERN:
+		return spi->pattern++;
+	case FE310_SLAVE_FLASH:
+		return flash_transfer(spi, mosi);
+	case FE310_SLAVE_LOOPBACK:
+	default:
+		return mosi;
+	}
+}
+
+static void cs_deassert(struct fe310_spi *spi, uint64_t t)
+{
+	uint32_t delay0 = REG(spi, FE310_DELAY_0);
+	uint32_t delay1 = REG(spi, FE310_DELAY_1);
+
+	spi->cs_asserted = false;
+	// sckcs (SCK to CS deassert) followed by the minimum CS inactive time intercs
+	spi->next_start = t + sck_cycles_ns(spi, ((delay0 >> 16) & 0xFF) + (delay1 & 0xFF));
+}
+
+void fe310_spi_init(struct fe310_spi *spi, const struct fe310_spi_config *config)
+{
+	memset(spi, 0, sizeof(*spi));
+	spi->config = *config;
+	if (spi->config.fifo_depth == 0 || spi->config.fifo_depth > FE310_MAX_FIFO) {
+		spi->config.fifo_depth = 8;
+	}
+	if (spi->config.num_cs == 0 || spi->config.num_cs > FE310_MAX_CS) {
+		spi->config.num_cs = 2;
+	}
+
+	// Reset values
+	unsigned long div = config->clk_hz / (2 * config->sck_hz);
+	REG(spi, FE310_SCK_DIV) = div ? div - 1 : 0;
+	REG(spi, FE310_CS_DEF) = (1U << spi->config.num_cs) - 1;
+	REG(spi, FE310_DELAY_0) = (1 << 16) | 1;
+	REG(spi, FE310_DELAY_1) = 1;
+	REG(spi, FE310_FMT) = 8 << FE310_FMT_LEN_SHIFT;
+	REG(spi, FE310_TX_MARK) = 0;
+	REG(spi, FE310_RX_MARK) = 0;
+}
+
+void fe310_spi_advance(struct fe310_spi *spi, uint64_t now)
+{
+	/*
+		Runs the shift register from the last update up to time now.
+		Frames start as soon as TX data is available and the CS/inter-frame gaps have elapsed,
+		and complete after the frame's SCK cycles, pushing the MISO byte into the RX FIFO.
+	*/
+	unsigned int depth = spi->config.fifo_depth;
+	uint64_t t = spi->time;
+
+	for (;;) {
+		if (!spi->busy) {
+			bool rx_dir = !(REG(spi, FE310_FMT) & FE310_FMT_DIR);
+			if (spi->tx_fifo.count == 0) {
+				break;
+			}
+			if (spi->config.rx_overrun_stall && rx_dir && spi->rx_fifo.count == depth) {
+				break;
+			}
+			uint64_t start = (t > spi->next_start) ? t : spi->next_start;
+			if (start > now) {
+				break;
+			}
+
+			// Load the shift register, asserting CS first if needed
+			uint64_t setup = 0;
+			if (!spi->cs_asserted && REG(spi, FE310_CS_MODE) != FE310_CSMODE_OFF) {
+				spi->cs_asserted = true;
+				spi->stats.cs_assertions++;
+				spi->flash_pos = 0;
+				setup = REG(spi, FE310_DELAY_0) & 0xFF;		// cssck
+			}
+			spi->shift = fifo_pop(&spi->tx_fifo, depth);
+			spi->frame_start = start;
+			spi->frame_end = start + sck_cycles_ns(spi, setup + frame_cycles(spi));
+			spi->busy = true;
+			t = start;
+		}
+
+		if (spi->frame_end > now) {
+			break;
+		}
+
+		// Frame complete
+		t = spi->frame_end;
+		spi->busy = false;
+		spi->stats.frames++;
+		spi->stats.busy_ns += spi->frame_end - spi->frame_start;
+
+		uint8_t miso = slave_transfer(spi, spi->shift);
+		if (!(REG(spi, FE310_FMT) & FE310_FMT_DIR)) {
+			if (spi->rx_fifo.count < depth) {
+				fifo_push(&spi->rx_fifo, depth, miso);
+			}
+			else {
+				spi->stats.rx_overruns++;
+			}
+		}
+
+		if (REG(spi, FE310_CS_MODE) == FE310_CSMODE_AUTO) {
+			cs_deassert(spi, t);
+		}
+		else {
+			spi->next_start = t + sck_cycles_ns(spi, (REG(spi, FE310_DELAY_1) >> 16) & 0xFF);		// interxfr
+		}
+	}
+
+	spi->time = now;
+}
+
+uint64_t fe310_spi_next_event(const struct fe310_spi *spi)
+{
+	/*
+		Returns the time at which the model will next change state by itself, or UINT64_MAX.
+	*/
+	if (spi->busy) {
+		return spi->frame_end;
+	}
+	if (spi->tx_fifo.count == 0) {
+		return UINT64_MAX;
+	}
+	if (spi->config.rx_overrun_stall && !(REG(spi, FE310_FMT) & FE310_FMT_DIR)
+		&& spi->rx_fifo.count == spi->config.fifo_depth) {
+		return UINT64_MAX;
+	}
+	return (spi->time > spi->next_start) ? spi->time : spi->next_start;
+}
+
+static uint32_t interrupt_pending(const struct fe310_spi *spi)
+{
+	uint32_t ip = 0;
+	if (spi->tx_fifo.count < (REG(spi, FE310_TX_MARK) & 0xFF)) {
+		ip |= FE310_IP_TXWM;
+	}
+	if (spi->rx_fifo.count > (REG(spi, FE310_RX_MARK) & 0xFF)) {
+		ip |= FE310_IP_RXWM;
+	}
+	return ip;
+}
+
+bool fe310_spi_irq_pending(const struct fe310_spi *spi)
+{
+	return (interrupt_pending(spi) & REG(spi, FE310_IE)) != 0;
+}
+
+bool fe310_spi_idle(const struct fe310_spi *spi)
+{
+	return !spi->busy && spi->tx_fifo.count == 0;
+}
+
+unsigned long fe310_spi_sck_hz(const struct fe310_spi *spi)
+{
+	return spi->config.clk_hz / (2 * ((REG(spi, FE310_SCK_DIV) & 0xFFF) + 1));
+}
+
+uint32_t fe310_spi_read(struct fe310_spi *spi, unsigned int offset)
+{
+	unsigned int depth = spi->config.fifo_depth;
+
+	spi->stats.reg_reads++;
+	offset &= ~3U;
+	switch (offset) {
+	case FE310_TXDATA:
+		return (spi->tx_fifo.count == depth) ? FE310_FIFO_FLAG : 0;
+	case FE310_RXDATA:
+		if (spi->rx_fifo.count == 0) {
+			return FE310_FIFO_FLAG;
+		}
+		return fifo_pop(&spi->rx_fifo, depth);
+	case FE310_IP:
+		return interrupt_pending(spi);
+	default:
+		if (offset >= FE310_REG_SPACE) {
+			return 0;
+		}
+		return REG(spi, offset);
+	}
+}
+
+void fe310_spi_write(struct fe310_spi *spi, unsigned int offset, uint32_t value)
+{
+	unsigned int depth = spi->config.fifo_depth;
+
+	spi->stats.reg_writes++;
+	offset &= ~3U;
+	switch (offset) {
+	case FE310_TXDATA:
+		if (spi->tx_fifo.count == depth) {
+			spi->stats.tx_overflows++;
+		}
+		else {
+			fifo_push(&spi->tx_fifo, depth, value & 0xFF);
+		}
+		break;
+	case FE310_RXDATA:
+	case FE310_IP:
+		break;					// read only
+	case FE310_TX_MARK:
+	case FE310_RX_MARK:
+		REG(spi, offset) = value & mark_mask(depth);
+		break;
+	case FE310_CS_ID:
+	case FE310_CS_DEF:
+	case FE310_CS_MODE:
+		REG(spi, offset) = value;
+		// Leaving hold mode or switching slaves releases CS once the current frame is done
+		if (spi->cs_asserted && !spi->busy && (offset != FE310_CS_MODE || value != FE310_CSMODE_HOLD)) {
+			cs_deassert(spi, spi->time);
+		}
+		break;
+	default:
+		if (offset < FE310_REG_SPACE) {
+			REG(spi, offset) = value;
+		}
+		break;
+	}
+}
+
+static unsigned int ffmt_cycles(unsigned int bits, unsigned int proto)
+{
+	unsigned int lanes = 1U << (proto & 0x3);
+	return (bits + lanes - 1) / lanes;
+}
+
+uint64_t fe310_spi_flash_read(struct fe310_spi *spi, uint32_t addr, uint8_t *buf, size_t len)
+{
+	/*
+		Read of len bytes of the flash window at addr, in flash mode: the controller asserts CS,
+		sends the ffmt instruction and reads the data. Returns the time it takes,
+		or UINT64_MAX if the controller is not in flash mode or the read is outside the window.
+	*/
+	uint32_t ffmt = REG(spi, FE310_FFMT);
+	uint64_t cycles;
+
+	if (!(REG(spi, FE310_FCTRL) & FE310_FCTRL_EN) || spi->busy || spi->tx_fifo.count
+		|| addr >= spi->config.flash_size || len > spi->config.flash_size - addr) {
+		return UINT64_MAX;
+	}
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = fe310_flash_byte(addr + i);
+	}
+
+	cycles = (REG(spi, FE310_DELAY_0) & 0xFF)									// cssck
+		+ ((ffmt & FE310_FFMT_CMD_EN) ? ffmt_cycles(8, ffmt >> 8) : 0)			// command
+		+ ffmt_cycles(8 * ((ffmt >> 1) & 0x7), ffmt >> 10)						// address
+		+ ((ffmt >> 4) & 0xF)													// dummy cycles
+		+ ffmt_cycles(8 * len, ffmt >> 12);										// data
+	spi->stats.flash_reads++;
+	spi->stats.frames += len;
+	spi->stats.cs_assertions++;
+	spi->stats.busy_ns += sck_cycles_ns(spi, cycles);
+	return sck_cycles_ns(spi, cycles) + sck_cycles_ns(spi, ((REG(spi, FE310_DELAY_0) >> 16) & 0xFF) + (REG(spi, FE310_DELAY_1) & 0xFF));
+}
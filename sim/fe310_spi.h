@@ -0,0 +1,127 @@
+/*
+	File: fe310_spi.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: Register-level model of the SiFive FE310 SPI block.
+		TX/RX FIFOs of configurable depth with watermarks, a shift register clocked
+		at the SCK rate set by sckdiv, chip select timing and an interrupt pending line. In flash mode (fctrl.en), reads of the
+		memory-mapped flash window run the instruction programmed in ffmt.
+		Time is virtual (nanoseconds) and advanced by the simulator, so runs are deterministic.
+*/
+
+#ifndef FE310_SPI_H
+#define FE310_SPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Register offsets (same as the driver)
+#define FE310_SCK_DIV       0x00
+#define FE310_SCK_MODE      0x04
+#define FE310_CS_ID         0x10
+#define FE310_CS_DEF        0x14
+#define FE310_CS_MODE       0x18
+#define FE310_DELAY_0       0x28
+#define FE310_DELAY_1       0x2C
+#define FE310_FMT           0x40
+#define FE310_TXDATA        0x48
+#define FE310_RXDATA        0x4C
+#define FE310_TX_MARK       0x50
+#define FE310_RX_MARK       0x54
+#define FE310_FCTRL         0x60
+#define FE310_FFMT          0x64
+#define FE310_IE            0x70
+#define FE310_IP            0x74
+#define FE310_REG_SPACE     0x80
+
+// Register bit fields
+#define FE310_FIFO_FLAG     0x80000000		// txdata full / rxdata empty
+#define FE310_IP_TXWM       0x1
+#define FE310_IP_RXWM       0x2
+#define FE310_CSMODE_AUTO   0
+#define FE310_CSMODE_HOLD   2
+#define FE310_CSMODE_OFF    3
+#define FE310_FMT_PROTO     0x3
+#define FE310_FMT_ENDIAN    0x4
+#define FE310_FMT_DIR       0x8
+#define FE310_FMT_LEN_SHIFT 16
+#define FE310_FMT_LEN_MASK  0xF
+#define FE310_FCTRL_EN      0x1
+#define FE310_FFMT_CMD_EN   0x1
+
+#define FE310_MAX_FIFO      64
+#define FE310_MAX_CS        8
+
+enum fe310_slave_type {
+	FE310_SLAVE_LOOPBACK,		// MISO returns the byte just shifted out on MOSI
+	FE310_SLAVE_PATTERN,		// MISO returns a free running byte counter (includes 0x00)
+	FE310_SLAVE_FLASH,			// serial flash: answers the read commands (0x03, 0x0B, 0x3B, 0x6B, 0xBB, 0xEB) with fe310_flash_byte
+};
+
+// Content of the simulated flash
+static inline uint8_t fe310_flash_byte(uint32_t addr)
+{
+	return (uint8_t) (addr ^ (addr >> 8) ^ (addr >> 16));
+}
+
+struct fe310_spi_config {
+	unsigned int fifo_depth;
+	unsigned long clk_hz;		// controller input clock
+	unsigned long sck_hz;		// SCK rate selected by the reset value of sckdiv
+	unsigned int num_cs;
+	bool rx_overrun_stall;		// true: shifter waits for RX space, false: frames are dropped
+	uint32_t flash_size;		// bytes of the memory-mapped flash window, 0 if there is none
+	enum fe310_slave_type slave;
+};
+
+struct fe310_spi_stats {
+	uint64_t frames;			// frames shifted on the bus
+	uint64_t rx_overruns;		// frames dropped because the RX FIFO was full
+	uint64_t tx_overflows;		// txdata writes ignored because the TX FIFO was full
+	uint64_t cs_assertions;		// chip select assert edges
+	uint64_t flash_reads;		// flash window reads served in flash mode
+	uint64_t busy_ns;			// time the shift register was clocking
+	uint64_t reg_reads;
+	uint64_t reg_writes;
+};
+
+struct fe310_fifo {
+	uint8_t data[FE310_MAX_FIFO];
+	unsigned int head;
+	unsigned int count;
+};
+
+struct fe310_spi {
+	struct fe310_spi_config config;
+	struct fe310_spi_stats stats;
+	uint32_t regs[FE310_REG_SPACE / 4];
+	struct fe310_fifo tx_fifo;
+	struct fe310_fifo rx_fifo;
+
+	// Shift register state
+	uint64_t time;				// time the model has been advanced to
+	uint64_t next_start;		// earliest start of the next frame (CS and inter-frame gaps)
+	uint64_t frame_start;
+	uint64_t frame_end;
+	bool busy;
+	bool cs_asserted;
+	uint8_t shift;
+	uint8_t pattern;
+
+	// Flash slave state, reset when CS is asserted
+	unsigned int flash_pos;		// bytes since CS assertion
+	uint8_t flash_cmd;
+	uint32_t flash_addr;
+};
+
+void fe310_spi_init(struct fe310_spi *spi, const struct fe310_spi_config *config);
+uint32_t fe310_spi_read(struct fe310_spi *spi, unsigned int offset);
+void fe310_spi_write(struct fe310_spi *spi, unsigned int offset, uint32_t value);
+void fe310_spi_advance(struct fe310_spi *spi, uint64_t now);
+uint64_t fe310_spi_next_event(const struct fe310_spi *spi);
+bool fe310_spi_irq_pending(const struct fe310_spi *spi);
+bool fe310_spi_idle(const struct fe310_spi *spi);
+unsigned long fe310_spi_sck_hz(const struct fe310_spi *spi);
+uint64_t fe310_spi_flash_read(struct fe310_spi *spi, uint32_t addr, uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,2 @@
+/* Host simulator shim: see sim/include/sim_kernel.h */
+#include <sim_kernel.h>
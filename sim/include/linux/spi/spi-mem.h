@@ -0,0 +1,96 @@
+/*
+	Host simulator shim for the spi-mem layer (see sim/sim_spi.c).
+	Only the fields and calls used by the drivers are provided; layouts follow Linux v6.1.
+*/
+
+#ifndef SIM_LINUX_SPI_MEM_H
+#define SIM_LINUX_SPI_MEM_H
+
+#include <linux/spi/spi.h>
+
+#define SPI_MEM_OP_CMD(__opcode, __buswidth) \
+	{ .nbytes = 1, .buswidth = __buswidth, .opcode = __opcode }
+#define SPI_MEM_OP_ADDR(__nbytes, __val, __buswidth) \
+	{ .nbytes = __nbytes, .buswidth = __buswidth, .val = __val }
+#define SPI_MEM_OP_NO_ADDR				{ }
+#define SPI_MEM_OP_DUMMY(__nbytes, __buswidth) \
+	{ .nbytes = __nbytes, .buswidth = __buswidth }
+#define SPI_MEM_OP_NO_DUMMY				{ }
+#define SPI_MEM_OP_DATA_IN(__nbytes, __buf, __buswidth) \
+	{ .buswidth = __buswidth, .dir = SPI_MEM_DATA_IN, .nbytes = __nbytes, .buf.in = __buf }
+#define SPI_MEM_OP_NO_DATA				{ }
+#define SPI_MEM_OP(__cmd, __addr, __dummy, __data) \
+	{ .cmd = __cmd, .addr = __addr, .dummy = __dummy, .data = __data }
+
+enum spi_mem_data_dir {
+	SPI_MEM_NO_DATA,
+	SPI_MEM_DATA_IN,
+	SPI_MEM_DATA_OUT,
+};
+
+struct spi_mem_op {
+	struct {
+		u8 nbytes;
+		u8 buswidth;
+		u8 dtr : 1;
+		u16 opcode;
+	} cmd;
+	struct {
+		u8 nbytes;
+		u8 buswidth;
+		u8 dtr : 1;
+		u64 val;
+	} addr;
+	struct {
+		u8 nbytes;
+		u8 buswidth;
+		u8 dtr : 1;
+	} dummy;
+	struct {
+		u8 buswidth;
+		u8 dtr : 1;
+		enum spi_mem_data_dir dir;
+		unsigned int nbytes;
+		union {
+			void *in;
+			const void *out;
+		} buf;
+	} data;
+};
+
+struct spi_mem {
+	struct spi_device *spi;
+	void *drvpriv;
+	const char *name;
+};
+
+struct spi_mem_dirmap_info {
+	struct spi_mem_op op_tmpl;
+	u64 offset;
+	u64 length;
+};
+
+struct spi_mem_dirmap_desc {
+	struct spi_mem *mem;
+	struct spi_mem_dirmap_info info;
+	unsigned int nodirmap;
+	void *priv;
+};
+
+struct spi_controller_mem_ops {
+	int (*adjust_op_size)(struct spi_mem *mem, struct spi_mem_op *op);
+	bool (*supports_op)(struct spi_mem *mem, const struct spi_mem_op *op);
+	int (*exec_op)(struct spi_mem *mem, const struct spi_mem_op *op);
+	int (*dirmap_create)(struct spi_mem_dirmap_desc *desc);
+	void (*dirmap_destroy)(struct spi_mem_dirmap_desc *desc);
+	ssize_t (*dirmap_read)(struct spi_mem_dirmap_desc *desc, u64 offs, size_t len, void *buf);
+	ssize_t (*dirmap_write)(struct spi_mem_dirmap_desc *desc, u64 offs, size_t len, const void *buf);
+};
+
+bool spi_mem_default_supports_op(struct spi_mem *mem, const struct spi_mem_op *op);
+int spi_mem_exec_op(struct spi_mem *mem, const struct spi_mem_op *op);
+struct spi_mem_dirmap_desc *spi_mem_dirmap_create(struct spi_mem *mem, const struct spi_mem_dirmap_info *info);
+void spi_mem_dirmap_destroy(struct spi_mem_dirmap_desc *desc);
+ssize_t spi_mem_dirmap_read(struct spi_mem_dirmap_desc *desc, u64 offs, size_t len, void *buf);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+	Host simulator shim for the SPI core (see sim/sim_spi.c).
+	Only the fields and calls used by the drivers are provided; layouts follow Linux v6.1.
+*/
+
+#ifndef SIM_LINUX_SPI_H
+#define SIM_LINUX_SPI_H
+
+#include <sim_kernel.h>
+
+#define SPI_CPHA						0x01
+#define SPI_CPOL						0x02
+#define SPI_MODE_0						0
+#define SPI_MODE_1						SPI_CPHA
+#define SPI_MODE_2						SPI_CPOL
+#define SPI_MODE_3						(SPI_CPOL | SPI_CPHA)
+#define SPI_CS_HIGH						0x04
+#define SPI_LSB_FIRST					0x08
+#define SPI_3WIRE						0x10
+#define SPI_LOOP						0x20
+#define SPI_NO_CS						0x40
+#define SPI_READY						0x80
+#define SPI_TX_DUAL						0x100
+#define SPI_TX_QUAD						0x200
+#define SPI_RX_DUAL						0x400
+#define SPI_RX_QUAD						0x800
+
+#define SPI_NBITS_SINGLE				0x01
+#define SPI_NBITS_DUAL					0x02
+#define SPI_NBITS_QUAD					0x04
+
+#define SPI_BPW_MASK(bits)				BIT((bits) - 1)
+
+#define SPI_DELAY_UNIT_USECS			0
+#define SPI_DELAY_UNIT_NSECS			1
+#define SPI_DELAY_UNIT_SCK				2
+
+struct spi_controller;
+struct spi_message;
+struct spi_controller_mem_ops;
+
+struct spi_delay {
+	u16 value;
+	u8 unit;
+};
+
+struct spi_device {
+	struct device dev;
+	struct spi_controller *controller;
+	struct spi_controller *master;
+	u32 max_speed_hz;
+	u8 chip_select;
+	u8 bits_per_word;
+	u32 mode;
+	void *controller_state;
+	void *controller_data;
+	char modalias[32];
+	struct spi_delay cs_setup;
+	struct spi_delay cs_hold;
+	struct spi_delay cs_inactive;
+	struct spi_delay word_delay;
+};
+
+struct spi_transfer {
+	const void *tx_buf;
+	void *rx_buf;
+	unsigned len;
+	unsigned cs_change:1;
+	unsigned tx_nbits:3;
+	unsigned rx_nbits:3;
+	u8 bits_per_word;
+	struct spi_delay delay;
+	struct spi_delay cs_change_delay;
+	struct spi_delay word_delay;
+	u32 speed_hz;
+	struct list_head transfer_list;
+};
+
+struct spi_message {
+	struct list_head transfers;
+	struct spi_device *spi;
+	void (*complete)(void *context);
+	void *context;
+	unsigned frame_length;
+	unsigned actual_length;
+	int status;
+	struct list_head queue;
+	void *state;
+};
+
+struct spi_controller {
+	struct device dev;
+	s16 bus_num;
+	u16 num_chipselect;
+	u32 mode_bits;
+	u32 bits_per_word_mask;
+	u32 min_speed_hz;
+	u32 max_speed_hz;
+	u16 flags;
+
+	int (*setup)(struct spi_device *spi);
+	void (*cleanup)(struct spi_device *spi);
+	int (*prepare_message)(struct spi_controller *ctlr, struct spi_message *message);
+	int (*unprepare_message)(struct spi_controller *ctlr, struct spi_message *message);
+	void (*set_cs)(struct spi_device *spi, bool enable);
+	int (*set_cs_timing)(struct spi_device *spi);
+	int (*transfer_one)(struct spi_controller *ctlr, struct spi_device *spi, struct spi_transfer *transfer);
+	void (*handle_err)(struct spi_controller *ctlr, struct spi_message *message);
+	const struct spi_controller_mem_ops *mem_ops;
+
+	// Simulator bookkeeping
+	void *devdata;
+	struct completion xfer_completion;
+};
+
+static inline void spi_message_init(struct spi_message *m)
+{
+	memset(m, 0, sizeof(*m));
+	INIT_LIST_HEAD(&m->transfers);
+}
+
+static inline void spi_message_add_tail(struct spi_transfer *t, struct spi_message *m)
+{
+	list_add_tail(&t->transfer_list, &m->transfers);
+}
+
+static inline void *spi_controller_get_devdata(struct spi_controller *ctlr) { return ctlr->devdata; }
+static inline void spi_controller_set_devdata(struct spi_controller *ctlr, void *data) { ctlr->devdata = data; }
+
+struct spi_controller *devm_spi_alloc_master(struct device *dev, unsigned int size);
+int devm_spi_register_controller(struct device *dev, struct spi_controller *ctlr);
+void spi_finalize_current_transfer(struct spi_controller *ctlr);
+int spi_setup(struct spi_device *spi);
+int spi_sync(struct spi_device *spi, struct spi_message *message);
+int spi_delay_to_ns(struct spi_delay *_delay, struct spi_transfer *xfer);
+
+// Simulator helper: a slave device on the registered controller
+struct spi_device *sim_spi_new_device(unsigned int chip_select, u32 mode, u32 max_speed_hz);
+
+#endif
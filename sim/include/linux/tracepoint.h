@@ -0,0 +1,17 @@
+/*
+	Host simulator shim: TRACE_EVENT defines trace_<event>() as a call to sim_trace_event,
+	which counts the event (and prints its name with --verbose). The entry layout and format are not used.
+*/
+#ifndef SIM_LINUX_TRACEPOINT_H
+#define SIM_LINUX_TRACEPOINT_H
+
+#include <sim_kernel.h>
+
+void sim_trace_event(const char *name);
+
+#define TP_PROTO(args...)				args
+#define TP_ARGS(args...)				args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { sim_trace_event(#name); }
+
+#endif
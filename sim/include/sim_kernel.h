@@ -0,0 +1,593 @@
+/*
+	File: sim_kernel.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: Minimal host (x86) stand-ins for the Linux kernel APIs used by the SPI drivers.
+		The driver sources are compiled unchanged against these headers, and every
+		ioread32/iowrite32 is routed to the FE310 SPI register model in fe310_spi.c.
+*/
+
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+// Kernel annotations and types
+#define __init
+#define __exit
+#define __user
+#define __iomem
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;			// as in the kernel, so that %llu matches
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+typedef unsigned short umode_t;
+
+// User space interface types, as in asm-generic/int-ll64.h
+typedef unsigned char		__u8;
+typedef unsigned short		__u16;
+typedef unsigned int		__u32;
+typedef unsigned long long	__u64;
+
+#define GFP_KERNEL						0
+#define THIS_MODULE						((struct module *)0)
+#define BIT(nr)							(1UL << (nr))
+#define BITS_PER_BYTE					8
+#define ARRAY_SIZE(arr)					(sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member)	((type *)((char *)(ptr) - offsetof(type, member)))
+
+// Module macros: module_init/module_exit export the entry points to the simulator harness
+#define MODULE_LICENSE(x)				extern int sim_modinfo_unused
+#define MODULE_AUTHOR(x)				extern int sim_modinfo_unused
+#define MODULE_DESCRIPTION(x)			extern int sim_modinfo_unused
+#define MODULE_DEVICE_TABLE(type, x)	extern int sim_modinfo_unused
+#define module_init(fn)					int (*sim_module_init_fn)(void) = fn
+#define module_exit(fn)					void (*sim_module_exit_fn)(void) = fn
+
+// Module parameters are registered with the harness, which sets them with --param name=value
+void sim_param_register(const char *name, void *value, size_t size);
+#define module_param(name, type, perm) \
+	static void __attribute__((constructor)) sim_param_##name(void) { sim_param_register(#name, &name, sizeof(name)); } \
+	extern int sim_modinfo_unused
+#define MODULE_PARM_DESC(name, desc)	extern int sim_modinfo_unused
+
+#define DIV_ROUND_UP(n, d)				(((n) + (d) - 1) / (d))
+#define DIV_ROUND_UP_ULL(n, d)			DIV_ROUND_UP((unsigned long long) (n), (d))
+#define NSEC_PER_USEC					1000L
+#define NSEC_PER_MSEC					1000000L
+#define NSEC_PER_SEC					1000000000L
+#define clamp(val, lo, hi)				min(max(val, lo), hi)
+
+// Error pointers
+#define MAX_ERRNO						4095
+#define IS_ERR(ptr)						((unsigned long) (ptr) >= (unsigned long) -MAX_ERRNO)
+#define PTR_ERR(ptr)					((long) (ptr))
+#define ERR_PTR(err)					((void *) (long) (err))
+
+// Ioctl numbers, as in asm-generic/ioctl.h
+#define _IOC_NRSHIFT					0
+#define _IOC_TYPESHIFT					8
+#define _IOC_SIZESHIFT					16
+#define _IOC_DIRSHIFT					30
+#define _IOC_WRITE						1U
+#define _IOC_READ						2U
+#define _IOC(dir, type, nr, size) \
+	(((dir) << _IOC_DIRSHIFT) | ((type) << _IOC_TYPESHIFT) | ((nr) << _IOC_NRSHIFT) | ((size) << _IOC_SIZESHIFT))
+#define _IO(type, nr)					_IOC(0U, (type), (nr), 0)
+#define _IOW(type, nr, argtype)			_IOC(_IOC_WRITE, (type), (nr), sizeof(argtype))
+#define _IOR(type, nr, argtype)			_IOC(_IOC_READ, (type), (nr), sizeof(argtype))
+#define _IOWR(type, nr, argtype)		_IOC(_IOC_READ | _IOC_WRITE, (type), (nr), sizeof(argtype))
+
+#define min(a, b)						((a) < (b) ? (a) : (b))
+#define max(a, b)						((a) > (b) ? (a) : (b))
+#define min_t(type, a, b)				min((type) (a), (type) (b))
+#define max_t(type, a, b)				max((type) (a), (type) (b))
+
+// Device numbers
+#define MINORBITS						20
+#define MINORMASK						((1U << MINORBITS) - 1)
+#define MAJOR(dev)						((unsigned int) ((dev) >> MINORBITS))
+#define MINOR(dev)						((unsigned int) ((dev) & MINORMASK))
+#define MKDEV(ma, mi)					(((dev_t)(ma) << MINORBITS) | (mi))
+
+// Lists
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list) { list->next = list; list->prev = list; }
+static inline int list_empty(const struct list_head *head) { return head->next == head; }
+static inline int list_is_last(const struct list_head *list, const struct list_head *head) { return list->next == head; }
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+static inline void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+static inline void list_del_init(struct list_head *entry) { list_del(entry); INIT_LIST_HEAD(entry); }
+#define list_entry(ptr, type, member)			container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member)		list_entry((ptr)->next, type, member)
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, typeof(*pos), member); &pos->member != (head); \
+		 pos = list_entry(pos->member.next, typeof(*pos), member))
+
+// Locking and waiting. The simulator is single threaded: a wait runs the hardware model and
+// delivers interrupts until the condition becomes true, and blocking on a held lock is a bug.
+struct mutex {
+	int locked;
+};
+
+struct completion {
+	unsigned int done;
+};
+
+void mutex_init(struct mutex *lock);
+void mutex_lock(struct mutex *lock);
+void mutex_unlock(struct mutex *lock);
+static inline int mutex_trylock(struct mutex *lock) { return lock->locked ? 0 : (lock->locked = 1); }
+static inline bool mutex_is_locked(struct mutex *lock) { return lock->locked; }
+static inline void init_completion(struct completion *x) { x->done = 0; }
+static inline void reinit_completion(struct completion *x) { x->done = 0; }
+static inline void complete(struct completion *x) { x->done++; }
+void wait_for_completion(struct completion *x);
+
+// Wait queues: a waiter runs the simulation until its condition holds. If nothing can make progress
+// any more the wait is interrupted, as a signal would interrupt a task that sleeps forever.
+#define ERESTARTSYS						512
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+bool sim_step(void);
+static inline void init_waitqueue_head(wait_queue_head_t *wq) { }
+static inline void wake_up_interruptible(wait_queue_head_t *wq) { }
+static inline void wake_up(wait_queue_head_t *wq) { }
+#define wait_event_interruptible(wq, condition) ({ \
+	int __ret = 0; \
+	while (!(condition)) { \
+		if (!sim_step()) { \
+			__ret = -ERESTARTSYS; \
+			break; \
+		} \
+	} \
+	__ret; \
+})
+#define wait_event(wq, condition) do { \
+	while (!(condition)) { \
+		if (!sim_step()) { \
+			fprintf(stderr, "sim: waiting for an event that can never happen\n"); \
+			exit(1); \
+		} \
+	} \
+} while (0)
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *lock) { lock->locked = 0; }
+static inline void spin_lock(spinlock_t *lock) { lock->locked = 1; }
+static inline void spin_unlock(spinlock_t *lock) { lock->locked = 0; }
+#define spin_lock_irqsave(lock, flags)		do { (flags) = 0; spin_lock(lock); } while (0)
+#define spin_unlock_irqrestore(lock, flags)	do { (void) (flags); spin_unlock(lock); } while (0)
+
+// Byte kfifo (power of two size, single producer / single consumer)
+struct kfifo {
+	unsigned char *data;
+	unsigned int mask;
+	unsigned int in;
+	unsigned int out;
+};
+
+int kfifo_alloc(struct kfifo *fifo, unsigned int size, int gfp);
+void kfifo_free(struct kfifo *fifo);
+static inline unsigned int kfifo_size(const struct kfifo *fifo) { return fifo->mask + 1; }
+static inline unsigned int kfifo_len(const struct kfifo *fifo) { return fifo->in - fifo->out; }
+static inline unsigned int kfifo_avail(const struct kfifo *fifo) { return kfifo_size(fifo) - kfifo_len(fifo); }
+static inline bool kfifo_is_empty(const struct kfifo *fifo) { return fifo->in == fifo->out; }
+static inline bool kfifo_is_full(const struct kfifo *fifo) { return kfifo_len(fifo) > fifo->mask; }
+static inline void kfifo_reset(struct kfifo *fifo) { fifo->in = fifo->out = 0; }
+static inline int kfifo_put(struct kfifo *fifo, unsigned char val)
+{
+	if (kfifo_is_full(fifo)) {
+		return 0;
+	}
+	fifo->data[fifo->in++ & fifo->mask] = val;
+	return 1;
+}
+static inline int kfifo_get(struct kfifo *fifo, unsigned char *val)
+{
+	if (kfifo_is_empty(fifo)) {
+		return 0;
+	}
+	*val = fifo->data[fifo->out++ & fifo->mask];
+	return 1;
+}
+unsigned int kfifo_in(struct kfifo *fifo, const void *buf, unsigned int len);
+unsigned int kfifo_out(struct kfifo *fifo, void *buf, unsigned int len);
+int kfifo_to_user(struct kfifo *fifo, void __user *to, unsigned int len, unsigned int *copied);
+
+// Structures
+struct module;
+struct vm_area_struct;
+struct device_node;
+struct proc_dir_entry { const char *name; void *data; };
+struct class { const char *name; };
+
+struct attribute_group;
+
+struct device {
+	const char *init_name;
+	struct device_node *of_node;
+	void *driver_data;
+	dev_t devt;									// class devices: device number and sysfs attribute groups
+	const struct attribute_group **groups;
+};
+
+struct of_device_id {
+	char name[32];
+	char type[32];
+	char compatible[128];
+	const void *data;
+};
+
+struct device_driver {
+	const char *name;
+	const struct of_device_id *of_match_table;
+};
+
+struct platform_device {
+	const char *name;
+	int id;
+	struct device dev;
+};
+
+struct platform_driver {
+	int (*probe)(struct platform_device *);
+	int (*remove)(struct platform_device *);
+	struct device_driver driver;
+};
+
+struct inode {
+	dev_t i_rdev;
+	struct cdev *i_cdev;
+};
+
+typedef unsigned int fmode_t;
+#define FMODE_READ						0x1
+#define FMODE_WRITE						0x2
+
+struct file {
+	const struct file_operations *f_op;
+	struct inode *f_inode;
+	fmode_t f_mode;
+	unsigned int f_flags;
+	loff_t f_pos;
+	void *private_data;
+};
+
+// Poll, as in uapi/linux/eventpoll.h
+typedef unsigned int __poll_t;
+#define EPOLLIN							0x00000001
+#define EPOLLOUT						0x00000004
+#define EPOLLERR						0x00000008
+#define EPOLLRDNORM						0x00000040
+#define EPOLLWRNORM						0x00000100
+
+typedef struct poll_table_struct {
+	int unused;
+} poll_table;
+
+static inline void poll_wait(struct file *filp, wait_queue_head_t *wq, poll_table *p) { }
+
+// I/O vectors and kiocbs: an iov_iter covers one user buffer, a kiocb with ki_complete is asynchronous
+#define READ							0
+#define WRITE							1
+#define EIOCBQUEUED						529
+#define IOCB_NOWAIT						(1 << 7)
+
+struct iov_iter {
+	int data_source;
+	char *buf;
+	size_t count;
+};
+
+struct kiocb {
+	struct file *ki_filp;
+	int ki_flags;
+	void (*ki_complete)(struct kiocb *iocb, long ret);
+	void *private;
+};
+
+static inline bool is_sync_kiocb(struct kiocb *kiocb) { return kiocb->ki_complete == NULL; }
+static inline size_t iov_iter_count(const struct iov_iter *i) { return i->count; }
+static inline int import_single_range(int type, void __user *buf, size_t len, struct iovec *iov, struct iov_iter *i)
+{
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	i->data_source = type;
+	i->buf = buf;
+	i->count = len;
+	return 0;
+}
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+	bytes = min(bytes, i->count);
+	memcpy(addr, i->buf, bytes);
+	i->buf += bytes;
+	i->count -= bytes;
+	return bytes;
+}
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+	bytes = min(bytes, i->count);
+	memcpy(i->buf, addr, bytes);
+	i->buf += bytes;
+	i->count -= bytes;
+	return bytes;
+}
+
+struct file_operations {
+	struct module *owner;
+	ssize_t (*read) (struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write) (struct file *, const char __user *, size_t, loff_t *);
+	ssize_t (*read_iter) (struct kiocb *, struct iov_iter *);
+	ssize_t (*write_iter) (struct kiocb *, struct iov_iter *);
+	int (*open) (struct inode *, struct file *);
+	int (*release) (struct inode *, struct file *);
+	__poll_t (*poll) (struct file *, struct poll_table_struct *);
+	int (*mmap) (struct file *, struct vm_area_struct *);
+	long (*unlocked_ioctl) (struct file *, unsigned int, unsigned long);
+	long (*compat_ioctl) (struct file *, unsigned int, unsigned long);
+};
+
+struct proc_ops {
+	int (*proc_open) (struct inode *, struct file *);
+	int (*proc_release) (struct inode *, struct file *);
+	ssize_t (*proc_read) (struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*proc_write) (struct file *, const char __user *, size_t, loff_t *);
+	__poll_t (*proc_poll) (struct file *, struct poll_table_struct *);
+};
+
+struct cdev {
+	struct module *owner;
+	const struct file_operations *ops;
+	dev_t dev;
+	unsigned int count;
+};
+
+// Interrupts
+typedef enum irqreturn {
+	IRQ_NONE = 0,
+	IRQ_HANDLED = 1,
+	IRQ_WAKE_THREAD = 2,
+} irqreturn_t;
+typedef irqreturn_t (*irq_handler_t)(int, void *);
+#define IRQF_SHARED						0x00000080
+#define IRQF_ONESHOT					0x00002000
+
+// Functions
+int printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+void *devm_kzalloc(struct device *dev, size_t size, int flags);
+static inline void *devm_kcalloc(struct device *dev, size_t n, size_t size, int flags) { return devm_kzalloc(dev, n * size, flags); }
+int device_property_read_u32(struct device *dev, const char *propname, u32 *val);
+static inline void *kmalloc(size_t size, int flags) { return malloc(size); }
+static inline void *kmalloc_array(size_t n, size_t size, int flags) { return malloc(n * size); }
+static inline void *kcalloc(size_t n, size_t size, int flags) { return calloc(n, size); }
+static inline void *kzalloc(size_t size, int flags) { return calloc(1, size); }
+static inline void kfree(const void *ptr) { free((void *) ptr); }
+const char *dev_name(const struct device *dev);
+
+int platform_driver_register(struct platform_driver *drv);
+void platform_driver_unregister(struct platform_driver *drv);
+void __iomem *devm_platform_ioremap_resource(struct platform_device *pdev, unsigned int index);
+
+// Memory resources of a platform device
+#define IORESOURCE_MEM					0x00000200
+struct resource {
+	u64 start;
+	u64 end;
+	unsigned long flags;
+};
+static inline u64 resource_size(const struct resource *res) { return res->end - res->start + 1; }
+struct resource *platform_get_resource(struct platform_device *pdev, unsigned int type, unsigned int num);
+void __iomem *devm_ioremap_resource(struct device *dev, const struct resource *res);
+int platform_get_irq(struct platform_device *pdev, unsigned int num);
+static inline void platform_set_drvdata(struct platform_device *pdev, void *data) { pdev->dev.driver_data = data; }
+static inline void *platform_get_drvdata(const struct platform_device *pdev) { return pdev->dev.driver_data; }
+
+// Clocks: the controller input clock runs at sim.config.spi.clk_hz
+struct clk {
+	unsigned long rate;
+};
+struct clk *devm_clk_get_enabled(struct device *dev, const char *id);
+struct clk *devm_clk_get_optional_enabled(struct device *dev, const char *id);
+static inline unsigned long clk_get_rate(struct clk *clk) { return clk->rate; }
+
+// Busy waits advance virtual time, which is also the monotonic clock
+void udelay(unsigned long usecs);
+void ndelay(unsigned long nsecs);
+// Sleeps let virtual time pass while the hardware, interrupts and timers run (sim_wait)
+void usleep_range(unsigned long min, unsigned long max);
+static inline void fsleep(unsigned long usecs) { if (usecs <= 10) udelay(usecs); else usleep_range(usecs, 2 * usecs); }
+static inline void cpu_relax(void) { }
+u64 ktime_get_ns(void);
+
+// High resolution timers: sim_step fires them when virtual time reaches their expiry, as an interrupt
+typedef s64 ktime_t;
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC					1
+#endif
+
+enum hrtimer_restart {
+	HRTIMER_NORESTART,
+	HRTIMER_RESTART,
+};
+
+enum hrtimer_mode {
+	HRTIMER_MODE_ABS,
+	HRTIMER_MODE_REL,
+};
+
+struct hrtimer {
+	enum hrtimer_restart (*function)(struct hrtimer *timer);
+	u64 expires;					// virtual time in ns
+	bool queued;
+};
+
+static inline ktime_t ns_to_ktime(u64 ns) { return (ktime_t) ns; }
+static inline s64 ktime_to_ns(ktime_t kt) { return kt; }
+static inline ktime_t ktime_get(void) { return (ktime_t) ktime_get_ns(); }
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags, const char *name, void *dev);
+int request_threaded_irq(unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn, unsigned long flags, const char *name, void *dev);
+// Device managed: freed by sim_cleanup, with the device's other resources
+int devm_request_threaded_irq(struct device *dev, unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn,
+							  unsigned long flags, const char *name, void *dev_id);
+
+struct proc_dir_entry *proc_create(const char *name, int mode, struct proc_dir_entry *parent, const struct proc_ops *proc_ops);
+struct proc_dir_entry *proc_create_data(const char *name, int mode, struct proc_dir_entry *parent, const struct proc_ops *proc_ops, void *data);
+void proc_remove(struct proc_dir_entry *de);
+void *pde_data(const struct inode *inode);
+
+// Id allocator, up to 64 ids
+struct ida { unsigned long long used; };
+#define DEFINE_IDA(name)				struct ida name = { 0 }
+static inline int ida_alloc(struct ida *ida, int gfp)
+{
+	for (int id = 0; id < 64; id++) {
+		if (!(ida->used & (1ULL << id))) {
+			ida->used |= 1ULL << id;
+			return id;
+		}
+	}
+	return -ENOSPC;
+}
+static inline void ida_free(struct ida *ida, unsigned int id) { ida->used &= ~(1ULL << id); }
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name);
+void unregister_chrdev_region(dev_t from, unsigned int count);
+struct class *sim_class_create(const char *name);
+#define class_create(owner, name)		sim_class_create(name)
+void class_destroy(struct class *cls);
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...);
+struct device *device_create_with_groups(struct class *cls, struct device *parent, dev_t devt, void *drvdata,
+										 const struct attribute_group **groups, const char *fmt, ...);
+static inline void *dev_get_drvdata(const struct device *dev) { return dev->driver_data; }
+struct device *sim_class_device(dev_t devt);			// device created for devt, NULL if none
+
+// sysfs attributes of class devices, read by the harness through their show functions
+struct attribute {
+	const char *name;
+	umode_t mode;
+};
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+	ssize_t (*store)(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+};
+struct attribute_group {
+	const char *name;
+	struct attribute **attrs;
+};
+#define DEVICE_ATTR_RO(_name) \
+	struct device_attribute dev_attr_##_name = { .attr = { .name = #_name, .mode = 0444 }, .show = _name##_show }
+#define ATTRIBUTE_GROUPS(_name) \
+	static const struct attribute_group _name##_group = { .attrs = _name##_attrs }; \
+	static const struct attribute_group *_name##_groups[] = { &_name##_group, NULL }
+int sysfs_emit(char *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int sysfs_emit_at(char *buf, int at, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void device_destroy(struct class *cls, dev_t devt);
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+static inline unsigned int iminor(const struct inode *inode) { return MINOR(inode->i_rdev); }
+static inline struct inode *file_inode(const struct file *f) { return f->f_inode; }
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) { memcpy(to, from, n); return 0; }
+static inline void __user *u64_to_user_ptr(u64 ptr) { return (void __user *) (uintptr_t) ptr; }
+long compat_ptr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) { memcpy(to, from, n); return 0; }
+#define put_user(x, ptr)				({ *(ptr) = (x); 0; })
+#define get_user(x, ptr)				({ (x) = *(ptr); 0; })
+
+// Memory shared with user space. The simulator has one address space: remap_vmalloc_range
+// "maps" the buffer by returning its address in vma->vm_start, where the harness picks it up.
+#define PAGE_SIZE						4096UL
+#define PAGE_ALIGN(x)					(((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+};
+
+static inline void *vmalloc_user(unsigned long size)
+{
+	void *ptr = aligned_alloc(PAGE_SIZE, PAGE_ALIGN(size));
+	if (ptr) {
+		memset(ptr, 0, PAGE_ALIGN(size));
+	}
+	return ptr;
+}
+static inline void vfree(const void *addr) { free((void *) addr); }
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr, unsigned long pgoff)
+{
+	vma->vm_end = (unsigned long) addr + (vma->vm_end - vma->vm_start);
+	vma->vm_start = (unsigned long) addr;
+	return 0;
+}
+static inline int ilog2(unsigned long long n)
+{
+	return 63 - __builtin_clzll(n);
+}
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	unsigned long rounded = 1;
+
+	while (rounded < n) {
+		rounded <<= 1;
+	}
+	return rounded;
+}
+
+// Barriers for data shared with user space or other CPUs
+#define smp_load_acquire(p)				__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)			__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+u32 ioread32(const void __iomem *addr);
+void iowrite32(u32 value, void __iomem *addr);
+void memcpy_fromio(void *to, const void __iomem *from, size_t count);
+
+#endif
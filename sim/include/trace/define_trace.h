@@ -0,0 +1 @@
+/* Host simulator shim: the tracepoints are defined by linux/tracepoint.h, there is nothing to create */
@@ -0,0 +1,65 @@
+/*
+	File: sim.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: Control interface of the host simulator, used by the harness in spi_sim.c.
+*/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <sim_kernel.h>
+#include "fe310_spi.h"
+
+struct spi_controller;
+
+struct sim_config {
+	struct fe310_spi_config spi;
+	uint64_t mmio_ns;			// cost of one register access
+	uint64_t irq_ns;			// interrupt entry/exit overhead
+	uint64_t thread_ns;			// wake-up latency of a threaded interrupt handler
+	bool has_irq;				// whether the platform device has an interrupt line
+	bool dt_fifo_depth;			// the device tree node gives the fifo depth (sifive,fifo-depth), otherwise the driver probes it
+	bool verbose;				// echo driver printk output
+};
+
+struct sim_stats {
+	uint64_t irqs;				// interrupts delivered to the driver
+	uint64_t irq_threads;		// threaded handler runs
+	uint64_t timers;			// hrtimer callbacks run
+	uint64_t printks;			// printk calls made by the driver
+	uint64_t trace_events;		// tracepoints hit by the driver
+	uint64_t idle_ns;			// virtual time the CPU spent waiting for the hardware, the rest is CPU time
+};
+
+struct sim {
+	struct sim_config config;
+	struct sim_stats stats;
+	struct fe310_spi spi;
+	uint64_t now;				// virtual time in ns
+
+	// Driver registrations captured by the kernel shims
+	struct platform_driver *driver;
+	struct platform_device pdev;
+	struct cdev *cdev;
+	const struct proc_ops *proc_ops;
+	struct proc_dir_entry *proc_entry;
+	irq_handler_t irq_handler;
+	irq_handler_t irq_thread;
+	void *irq_dev;
+	struct spi_controller *controller;
+};
+
+extern struct sim sim;
+
+// Driver entry points exported by module_init/module_exit
+extern int (*sim_module_init_fn)(void);
+extern void (*sim_module_exit_fn)(void);
+
+void sim_init(const struct sim_config *config);
+void sim_cleanup(void);
+bool sim_step(void);
+void sim_idle(void);
+void sim_wait(uint64_t ns);
+int sim_param_set(const char *assignment);
+
+#endif
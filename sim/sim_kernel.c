@@ -0,0 +1,686 @@
+/*
+	File: sim_kernel.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Host implementations of the kernel shims declared in sim_kernel.h.
+		Register accesses cost sim.config.mmio_ns of virtual time and advance the FE310 model;
+		interrupts are delivered whenever the driver (or the harness) waits for the hardware.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+
+#define SIM_MAJOR			240
+#define SIM_IRQ				5
+#define SIM_MAX_ALLOCS		64
+#define SIM_IRQ_STORM		1000000
+#define SIM_MAX_TIMERS		64
+
+struct sim sim;
+
+static uint8_t sim_regs[FE310_REG_SPACE];		// stands in for the ioremapped register window
+static uint8_t sim_flash_window[1];				// base of the flash window, never dereferenced: reads go to the model
+static void *sim_allocs[SIM_MAX_ALLOCS];
+static unsigned int sim_num_allocs;
+static struct hrtimer *sim_timers[SIM_MAX_TIMERS];		// started and not expired or cancelled
+static unsigned int sim_num_timers;
+
+void sim_init(const struct sim_config *config)
+{
+	memset(&sim, 0, sizeof(sim));
+	sim_num_timers = 0;
+	sim.config = *config;
+	fe310_spi_init(&sim.spi, &config->spi);
+	sim.pdev.name = "10014000.spi";
+	sim.pdev.dev.init_name = sim.pdev.name;
+}
+
+void sim_cleanup(void)
+{
+	sim.irq_handler = NULL;					// devm_request_threaded_irq
+	sim.irq_thread = NULL;
+	while (sim_num_allocs) {
+		free(sim_allocs[--sim_num_allocs]);
+	}
+}
+
+static void sim_deliver_irq(void)
+{
+	sim.stats.irqs++;
+	sim.now += sim.config.irq_ns;
+	fe310_spi_advance(&sim.spi, sim.now);
+	if (sim.irq_handler(SIM_IRQ, sim.irq_dev) == IRQ_WAKE_THREAD && sim.irq_thread) {
+		// The line stays masked (IRQF_ONESHOT) until the thread has run
+		sim.stats.irq_threads++;
+		sim.now += sim.config.thread_ns;
+		fe310_spi_advance(&sim.spi, sim.now);
+		sim.irq_thread(SIM_IRQ, sim.irq_dev);
+	}
+}
+
+static struct hrtimer *sim_next_timer(void)
+{
+	struct hrtimer *next = NULL;
+
+	for (unsigned int i = 0; i < sim_num_timers; i++) {
+		if (next == NULL || sim_timers[i]->expires < next->expires) {
+			next = sim_timers[i];
+		}
+	}
+	return next;
+}
+
+static void sim_dequeue_timer(struct hrtimer *timer)
+{
+	for (unsigned int i = 0; i < sim_num_timers; i++) {
+		if (sim_timers[i] == timer) {
+			sim_timers[i] = sim_timers[--sim_num_timers];
+			break;
+		}
+	}
+	timer->queued = false;
+}
+
+static void sim_fire_timer(struct hrtimer *timer)
+{
+	sim_dequeue_timer(timer);
+	sim.stats.timers++;
+	sim.now += sim.config.irq_ns;
+	fe310_spi_advance(&sim.spi, sim.now);
+	if (timer->function(timer) == HRTIMER_RESTART) {
+		hrtimer_start(timer, ns_to_ktime(timer->expires), HRTIMER_MODE_ABS);
+	}
+}
+
+static uint64_t sim_next_event(struct hrtimer **timer)
+{
+	/*
+		Returns the time of the next hardware event or timer expiry, and in timer the timer if it comes first.
+	*/
+	uint64_t next = fe310_spi_next_event(&sim.spi);
+
+	*timer = sim_next_timer();
+	if (*timer && (*timer)->expires <= next) {
+		return (*timer)->expires;
+	}
+	*timer = NULL;
+	return next;
+}
+
+bool sim_step(void)
+{
+	/*
+		Makes one unit of progress: delivers a pending interrupt, or advances virtual time
+		to the next hardware event or timer expiry. Returns false if nothing can ever happen again.
+	*/
+	struct hrtimer *timer;
+	uint64_t next;
+
+	if (sim.irq_handler && fe310_spi_irq_pending(&sim.spi)) {
+		sim_deliver_irq();
+		return true;
+	}
+	next = sim_next_event(&timer);
+	if (next == UINT64_MAX) {
+		return false;
+	}
+	if (next > sim.now) {
+		sim.stats.idle_ns += next - sim.now;		// the CPU waits for the hardware
+		sim.now = next;
+	}
+	fe310_spi_advance(&sim.spi, sim.now);
+	if (timer) {
+		sim_fire_timer(timer);
+	}
+	return true;
+}
+
+void sim_wait(uint64_t ns)
+{
+	/*
+		Lets ns of virtual time pass with no CPU activity, as a program that sleeps:
+		the hardware runs, interrupts are delivered and timers fire.
+	*/
+	uint64_t end = sim.now + ns;
+	struct hrtimer *timer;
+
+	while (sim.now < end) {
+		if (!(sim.irq_handler && fe310_spi_irq_pending(&sim.spi)) && sim_next_event(&timer) > end) {
+			sim.stats.idle_ns += end - sim.now;
+			sim.now = end;
+			fe310_spi_advance(&sim.spi, sim.now);
+			break;
+		}
+		sim_step();
+	}
+}
+
+void sim_idle(void)
+{
+	/*
+		Lets the hardware and interrupt handler run with no other CPU activity until nothing is left to do.
+	*/
+	uint64_t irqs = sim.stats.irqs;
+	while (sim_step()) {
+		if (sim.stats.irqs - irqs > SIM_IRQ_STORM) {
+			fprintf(stderr, "sim: interrupt storm, IE=0x%x IP=0x%x\n",
+					fe310_spi_read(&sim.spi, FE310_IE), fe310_spi_read(&sim.spi, FE310_IP));
+			exit(1);
+		}
+	}
+}
+
+// Kernel shims
+
+int printk(const char *fmt, ...)
+{
+	va_list args;
+	int ret = 0;
+
+	sim.stats.printks++;
+	if (sim.config.verbose) {
+		va_start(args, fmt);
+		ret = vfprintf(stderr, fmt, args);
+		va_end(args);
+	}
+	return ret;
+}
+
+void *devm_kzalloc(struct device *dev, size_t size, int flags)
+{
+	if (sim_num_allocs == SIM_MAX_ALLOCS) {
+		return NULL;
+	}
+	void *ptr = calloc(1, size);
+	if (ptr) {
+		sim_allocs[sim_num_allocs++] = ptr;
+	}
+	return ptr;
+}
+
+int device_property_read_u32(struct device *dev, const char *propname, u32 *val)
+{
+	// The simulated device tree node only has num-cs, and sifive,fifo-depth if configured
+	if (!strcmp(propname, "num-cs")) {
+		*val = sim.config.spi.num_cs;
+		return 0;
+	}
+	if (!strcmp(propname, "sifive,fifo-depth") && sim.config.dt_fifo_depth) {
+		*val = sim.config.spi.fifo_depth;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+const char *dev_name(const struct device *dev)
+{
+	return dev->init_name;
+}
+
+int platform_driver_register(struct platform_driver *drv)
+{
+	// The simulated board has one matching device, probe it straight away
+	sim.driver = drv;
+	return drv->probe(&sim.pdev);
+}
+
+void platform_driver_unregister(struct platform_driver *drv)
+{
+	if (drv->remove) {
+		drv->remove(&sim.pdev);
+	}
+	sim.driver = NULL;
+}
+
+void __iomem *devm_platform_ioremap_resource(struct platform_device *pdev, unsigned int index)
+{
+	return (index == 0) ? sim_regs : NULL;
+}
+
+struct resource *platform_get_resource(struct platform_device *pdev, unsigned int type, unsigned int num)
+{
+	// Resource 0 is the register window, resource 1 the flash window if the board has one
+	static struct resource regs = { .start = 0x10014000, .end = 0x10014000 + FE310_REG_SPACE - 1, .flags = IORESOURCE_MEM };
+	static struct resource flash = { .start = 0x20000000, .flags = IORESOURCE_MEM };
+
+	if (type != IORESOURCE_MEM) {
+		return NULL;
+	}
+	if (num == 0) {
+		return &regs;
+	}
+	if (num == 1 && sim.config.spi.flash_size) {
+		flash.end = flash.start + sim.config.spi.flash_size - 1;
+		return &flash;
+	}
+	return NULL;
+}
+
+void __iomem *devm_ioremap_resource(struct device *dev, const struct resource *res)
+{
+	if (res->start == 0x20000000) {
+		return sim_flash_window;
+	}
+	return (res->start == 0x10014000) ? sim_regs : ERR_PTR(-EINVAL);
+}
+
+int platform_get_irq(struct platform_device *pdev, unsigned int num)
+{
+	return (sim.config.has_irq && num == 0) ? SIM_IRQ : -ENXIO;
+}
+
+struct clk *devm_clk_get_enabled(struct device *dev, const char *id)
+{
+	static struct clk clk;
+	clk.rate = sim.config.spi.clk_hz;
+	return &clk;
+}
+
+struct clk *devm_clk_get_optional_enabled(struct device *dev, const char *id)
+{
+	// The simulated device tree node always has its clock
+	return devm_clk_get_enabled(dev, id);
+}
+
+void udelay(unsigned long usecs)
+{
+	sim.now += (uint64_t) usecs * 1000;
+	fe310_spi_advance(&sim.spi, sim.now);
+}
+
+void ndelay(unsigned long nsecs)
+{
+	sim.now += nsecs;
+	fe310_spi_advance(&sim.spi, sim.now);
+}
+
+void usleep_range(unsigned long min, unsigned long max)
+{
+	sim_wait((uint64_t) min * 1000);
+}
+
+u64 ktime_get_ns(void)
+{
+	return sim.now;
+}
+
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode)
+{
+	memset(timer, 0, sizeof(*timer));
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode)
+{
+	timer->expires = (mode == HRTIMER_MODE_REL) ? sim.now + tim : (u64) tim;
+	if (timer->queued) {
+		return;
+	}
+	if (sim_num_timers == SIM_MAX_TIMERS) {
+		fprintf(stderr, "sim: too many timers\n");
+		exit(1);
+	}
+	sim_timers[sim_num_timers++] = timer;
+	timer->queued = true;
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+	int queued = timer->queued;
+
+	sim_dequeue_timer(timer);
+	return queued;
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval)
+{
+	/*
+		Moves the expiry forward by whole intervals until it is after now, returns the number of intervals.
+	*/
+	u64 overruns;
+
+	if (timer->expires > sim.now) {
+		return 0;
+	}
+	overruns = (sim.now - timer->expires) / interval + 1;
+	timer->expires += overruns * interval;
+	return overruns;
+}
+
+long compat_ptr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	return file->f_op->unlocked_ioctl(file, cmd, arg);
+}
+
+int request_irq(unsigned int irq, irq_handler_t handler, unsigned long flags, const char *name, void *dev)
+{
+	return request_threaded_irq(irq, handler, NULL, flags, name, dev);
+}
+
+int request_threaded_irq(unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn, unsigned long flags, const char *name, void *dev)
+{
+	if (irq != SIM_IRQ || handler == NULL) {
+		return -EINVAL;
+	}
+	sim.irq_handler = handler;
+	sim.irq_thread = thread_fn;
+	sim.irq_dev = dev;
+	return 0;
+}
+
+int devm_request_threaded_irq(struct device *dev, unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn,
+							  unsigned long flags, const char *name, void *dev_id)
+{
+	return request_threaded_irq(irq, handler, thread_fn, flags, name, dev_id);
+}
+
+struct proc_dir_entry *proc_create(const char *name, int mode, struct proc_dir_entry *parent, const struct proc_ops *proc_ops)
+{
+	return proc_create_data(name, mode, parent, proc_ops, NULL);
+}
+
+struct proc_dir_entry *proc_create_data(const char *name, int mode, struct proc_dir_entry *parent, const struct proc_ops *proc_ops, void *data)
+{
+	static struct proc_dir_entry entry;
+	entry.name = name;
+	entry.data = data;
+	sim.proc_ops = proc_ops;
+	sim.proc_entry = &entry;
+	return &entry;
+}
+
+void proc_remove(struct proc_dir_entry *de)
+{
+	sim.proc_ops = NULL;
+	sim.proc_entry = NULL;
+}
+
+void *pde_data(const struct inode *inode)
+{
+	// The simulated board has one /proc file
+	return sim.proc_entry ? sim.proc_entry->data : NULL;
+}
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name)
+{
+	*dev = MKDEV(SIM_MAJOR, baseminor);
+	return 0;
+}
+
+void unregister_chrdev_region(dev_t from, unsigned int count)
+{
+}
+
+struct class *sim_class_create(const char *name)
+{
+	static struct class cls;
+	cls.name = name;
+	return &cls;
+}
+
+void class_destroy(struct class *cls)
+{
+}
+
+static struct device sim_class_devices[64];
+
+struct device *device_create_with_groups(struct class *cls, struct device *parent, dev_t devt, void *drvdata,
+										 const struct attribute_group **groups, const char *fmt, ...)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(sim_class_devices); i++) {
+		struct device *dev = &sim_class_devices[i];
+		if (!dev->devt) {
+			dev->devt = devt;
+			dev->driver_data = drvdata;
+			dev->groups = groups;
+			return dev;
+		}
+	}
+	return ERR_PTR(-ENOMEM);
+}
+
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...)
+{
+	return device_create_with_groups(cls, parent, devt, drvdata, NULL, fmt);
+}
+
+void device_destroy(struct class *cls, dev_t devt)
+{
+	struct device *dev = sim_class_device(devt);
+	if (dev) {
+		memset(dev, 0, sizeof(*dev));
+	}
+}
+
+struct device *sim_class_device(dev_t devt)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(sim_class_devices); i++) {
+		if (sim_class_devices[i].devt == devt) {
+			return &sim_class_devices[i];
+		}
+	}
+	return NULL;
+}
+
+int sysfs_emit(char *buf, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, PAGE_SIZE, fmt, args);
+	va_end(args);
+	return len;
+}
+
+int sysfs_emit_at(char *buf, int at, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf + at, PAGE_SIZE - at, fmt, args);
+	va_end(args);
+	return len;
+}
+
+void sim_trace_event(const char *name)
+{
+	sim.stats.trace_events++;
+	if (sim.config.verbose) {
+		fprintf(stderr, "trace: %s\n", name);
+	}
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	memset(cdev, 0, sizeof(*cdev));
+	cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	cdev->dev = dev;
+	cdev->count = count;
+	sim.cdev = cdev;
+	return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+	sim.cdev = NULL;
+}
+
+static unsigned int sim_reg_offset(const void __iomem *addr)
+{
+	ptrdiff_t offset = (const uint8_t *)addr - sim_regs;
+	if (offset < 0 || offset >= FE310_REG_SPACE) {
+		fprintf(stderr, "sim: access outside register window (%p)\n", addr);
+		exit(1);
+	}
+	return offset;
+}
+
+void memcpy_fromio(void *to, const void __iomem *from, size_t count)
+{
+	/*
+		Reads of the flash window are served by the model in flash mode and take the time of the flash read.
+	*/
+	uintptr_t addr = (uintptr_t) from - (uintptr_t) sim_flash_window;
+	uint64_t ns;
+
+	if ((uintptr_t) from < (uintptr_t) sim_flash_window || addr >= sim.config.spi.flash_size) {
+		fprintf(stderr, "sim: memcpy_fromio outside the flash window (%p)\n", from);
+		exit(1);
+	}
+	fe310_spi_advance(&sim.spi, sim.now);
+	ns = fe310_spi_flash_read(&sim.spi, addr, to, count);
+	if (ns == UINT64_MAX) {
+		fprintf(stderr, "sim: flash window read of %zu bytes at 0x%lx outside flash mode or the window\n", count, (unsigned long) addr);
+		exit(1);
+	}
+	sim.now += ns;
+	fe310_spi_advance(&sim.spi, sim.now);
+}
+
+u32 ioread32(const void __iomem *addr)
+{
+	unsigned int offset = sim_reg_offset(addr);
+	sim.now += sim.config.mmio_ns;
+	fe310_spi_advance(&sim.spi, sim.now);
+	return fe310_spi_read(&sim.spi, offset);
+}
+
+void iowrite32(u32 value, void __iomem *addr)
+{
+	unsigned int offset = sim_reg_offset(addr);
+	sim.now += sim.config.mmio_ns;
+	fe310_spi_advance(&sim.spi, sim.now);
+	fe310_spi_write(&sim.spi, offset, value);
+}
+
+void mutex_init(struct mutex *lock)
+{
+	lock->locked = 0;
+}
+
+void mutex_lock(struct mutex *lock)
+{
+	if (lock->locked) {
+		fprintf(stderr, "sim: deadlock, mutex %p already held\n", (void *) lock);
+		exit(1);
+	}
+	lock->locked = 1;
+}
+
+void mutex_unlock(struct mutex *lock)
+{
+	lock->locked = 0;
+}
+
+void wait_for_completion(struct completion *x)
+{
+	while (!x->done) {
+		if (!sim_step()) {
+			fprintf(stderr, "sim: waiting for a completion that can never happen\n");
+			exit(1);
+		}
+	}
+	x->done--;
+}
+
+int kfifo_alloc(struct kfifo *fifo, unsigned int size, int gfp)
+{
+	unsigned int rounded = 2;
+
+	while (rounded < size) {
+		rounded <<= 1;
+	}
+	fifo->data = malloc(rounded);
+	fifo->mask = rounded - 1;
+	fifo->in = fifo->out = 0;
+	return fifo->data ? 0 : -ENOMEM;
+}
+
+void kfifo_free(struct kfifo *fifo)
+{
+	free(fifo->data);
+	fifo->data = NULL;
+}
+
+unsigned int kfifo_in(struct kfifo *fifo, const void *buf, unsigned int len)
+{
+	const unsigned char *src = buf;
+	unsigned int i;
+
+	len = min(len, kfifo_avail(fifo));
+	for (i = 0; i < len; i++) {
+		fifo->data[fifo->in++ & fifo->mask] = src[i];
+	}
+	return len;
+}
+
+unsigned int kfifo_out(struct kfifo *fifo, void *buf, unsigned int len)
+{
+	unsigned char *dst = buf;
+	unsigned int i;
+
+	len = min(len, kfifo_len(fifo));
+	for (i = 0; i < len; i++) {
+		dst[i] = fifo->data[fifo->out++ & fifo->mask];
+	}
+	return len;
+}
+
+int kfifo_to_user(struct kfifo *fifo, void __user *to, unsigned int len, unsigned int *copied)
+{
+	*copied = kfifo_out(fifo, to, len);
+	return 0;
+}
+
+// Module parameters
+
+#define SIM_MAX_PARAMS		32
+
+static struct {
+	const char *name;
+	void *value;
+	size_t size;
+} sim_params[SIM_MAX_PARAMS];
+static unsigned int sim_num_params;
+
+void sim_param_register(const char *name, void *value, size_t size)
+{
+	if (sim_num_params < SIM_MAX_PARAMS) {
+		sim_params[sim_num_params].name = name;
+		sim_params[sim_num_params].value = value;
+		sim_params[sim_num_params].size = size;
+		sim_num_params++;
+	}
+}
+
+int sim_param_set(const char *assignment)
+{
+	/*
+		Sets a driver module parameter from a "name=value" string, before the driver is loaded.
+	*/
+	const char *eq = strchr(assignment, '=');
+	unsigned int i;
+
+	if (eq == NULL) {
+		return -EINVAL;
+	}
+	for (i = 0; i < sim_num_params; i++) {
+		if (strlen(sim_params[i].name) == (size_t) (eq - assignment)
+			&& !strncmp(sim_params[i].name, assignment, eq - assignment)) {
+			unsigned long long value = strtoull(eq + 1, NULL, 0);
+			switch (sim_params[i].size) {
+			case 1: *(uint8_t *) sim_params[i].value = value; break;
+			case 2: *(uint16_t *) sim_params[i].value = value; break;
+			case 4: *(uint32_t *) sim_params[i].value = value; break;
+			default: *(uint64_t *) sim_params[i].value = value; break;
+			}
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
@@ -0,0 +1,381 @@
+/*
+	File: sim_spi.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Minimal single threaded SPI core for the simulator.
+		spi_sync runs a message the way the kernel's message pump does: prepare_message,
+		set_cs, transfer_one (waiting for spi_finalize_current_transfer when it returns > 0),
+		cs_change handling, handle_err on failure and unprepare_message.
+		The spi-mem calls follow drivers/spi/spi-mem.c: direct mappings use the controller's
+		dirmap_create/dirmap_read, and fall back to operations sent as spi_messages.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include <linux/spi/spi.h>
+#include <linux/spi/spi-mem.h>
+
+struct spi_controller *devm_spi_alloc_master(struct device *dev, unsigned int size)
+{
+	struct spi_controller *ctlr = devm_kzalloc(dev, sizeof(*ctlr) + size, GFP_KERNEL);
+	if (ctlr) {
+		ctlr->devdata = size ? (void *) (ctlr + 1) : NULL;
+		ctlr->bus_num = -1;
+	}
+	return ctlr;
+}
+
+int devm_spi_register_controller(struct device *dev, struct spi_controller *ctlr)
+{
+	if (!ctlr->transfer_one) {
+		return -EINVAL;
+	}
+	sim.controller = ctlr;
+	return 0;
+}
+
+void spi_finalize_current_transfer(struct spi_controller *ctlr)
+{
+	complete(&ctlr->xfer_completion);
+}
+
+int spi_setup(struct spi_device *spi)
+{
+	struct spi_controller *ctlr = spi->controller;
+	int ret;
+
+	if (spi->chip_select >= ctlr->num_chipselect) {
+		return -EINVAL;
+	}
+	if (spi->mode & ~ctlr->mode_bits) {
+		return -EINVAL;
+	}
+	if (!spi->bits_per_word) {
+		spi->bits_per_word = 8;
+	}
+	if (ctlr->bits_per_word_mask && !(ctlr->bits_per_word_mask & SPI_BPW_MASK(spi->bits_per_word))) {
+		return -EINVAL;
+	}
+	if (!spi->max_speed_hz || (ctlr->max_speed_hz && spi->max_speed_hz > ctlr->max_speed_hz)) {
+		spi->max_speed_hz = ctlr->max_speed_hz;
+	}
+	ret = ctlr->setup ? ctlr->setup(spi) : 0;
+
+	// Like the kernel, spi_setup deasserts CS outside of any message, without the controller's bus
+	if (ret == 0 && ctlr->set_cs) {
+		ctlr->set_cs(spi, !(spi->mode & SPI_CS_HIGH));
+	}
+	return ret;
+}
+
+struct spi_device *sim_spi_new_device(unsigned int chip_select, u32 mode, u32 max_speed_hz)
+{
+	struct spi_device *spi;
+
+	if (!sim.controller) {
+		return NULL;
+	}
+	spi = devm_kzalloc(&sim.controller->dev, sizeof(*spi), GFP_KERNEL);
+	if (!spi) {
+		return NULL;
+	}
+	spi->controller = sim.controller;
+	spi->master = sim.controller;
+	spi->chip_select = chip_select;
+	spi->mode = mode;
+	spi->max_speed_hz = max_speed_hz;
+	strcpy(spi->modalias, "sim");
+	if (spi_setup(spi)) {
+		return NULL;
+	}
+	return spi;
+}
+
+int spi_delay_to_ns(struct spi_delay *_delay, struct spi_transfer *xfer)
+{
+	switch (_delay->unit) {
+	case SPI_DELAY_UNIT_USECS:
+		return _delay->value * 1000;
+	case SPI_DELAY_UNIT_NSECS:
+		return _delay->value;
+	case SPI_DELAY_UNIT_SCK:
+		if (!xfer || !xfer->speed_hz) {
+			return -EINVAL;
+		}
+		return _delay->value * (1000000000 / xfer->speed_hz);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void sim_spi_delay_exec(struct spi_delay *delay)
+{
+	int ns = spi_delay_to_ns(delay, NULL);
+	if (ns > 0) {
+		ndelay(ns);
+	}
+}
+
+static void sim_spi_set_cs(struct spi_device *spi, bool enable)
+{
+	// Same polarity convention as the kernel: set_cs receives the electrical level
+	bool activate = enable;
+
+	if (spi->mode & SPI_CS_HIGH) {
+		enable = !enable;
+	}
+	// The core waits for the CS delays itself unless the controller times them
+	if (!activate && !spi->controller->set_cs_timing) {
+		sim_spi_delay_exec(&spi->cs_hold);
+	}
+	if (spi->controller->set_cs) {
+		spi->controller->set_cs(spi, !enable);
+	}
+	if (!spi->controller->set_cs_timing) {
+		sim_spi_delay_exec(activate ? &spi->cs_setup : &spi->cs_inactive);
+	}
+}
+
+int spi_sync(struct spi_device *spi, struct spi_message *message)
+{
+	struct spi_controller *ctlr = spi->controller;
+	struct spi_transfer *xfer;
+	bool keep_cs = false;
+	int ret = 0;
+
+	message->spi = spi;
+	message->actual_length = 0;
+	message->frame_length = 0;
+	list_for_each_entry(xfer, &message->transfers, transfer_list) {
+		if (!xfer->bits_per_word) {
+			xfer->bits_per_word = spi->bits_per_word;
+		}
+		if (!xfer->speed_hz || xfer->speed_hz > spi->max_speed_hz) {
+			xfer->speed_hz = spi->max_speed_hz;
+		}
+		if (xfer->speed_hz && ctlr->min_speed_hz && xfer->speed_hz < ctlr->min_speed_hz) {
+			message->status = -EINVAL;
+			return -EINVAL;
+		}
+		if (!xfer->tx_nbits) {
+			xfer->tx_nbits = SPI_NBITS_SINGLE;
+		}
+		if (!xfer->rx_nbits) {
+			xfer->rx_nbits = SPI_NBITS_SINGLE;
+		}
+		// As __spi_validate: multi-line transfers need the matching mode bits of the slave
+		if ((xfer->tx_buf && ((xfer->tx_nbits == SPI_NBITS_DUAL && !(spi->mode & (SPI_TX_DUAL | SPI_TX_QUAD)))
+							  || (xfer->tx_nbits == SPI_NBITS_QUAD && !(spi->mode & SPI_TX_QUAD))))
+			|| (xfer->rx_buf && ((xfer->rx_nbits == SPI_NBITS_DUAL && !(spi->mode & (SPI_RX_DUAL | SPI_RX_QUAD)))
+								 || (xfer->rx_nbits == SPI_NBITS_QUAD && !(spi->mode & SPI_RX_QUAD))))) {
+			message->status = -EINVAL;
+			return -EINVAL;
+		}
+		message->frame_length += xfer->len;
+	}
+
+	if (ctlr->prepare_message) {
+		ret = ctlr->prepare_message(ctlr, message);
+		if (ret) {
+			message->status = ret;
+			return ret;
+		}
+	}
+
+	sim_spi_set_cs(spi, true);
+	list_for_each_entry(xfer, &message->transfers, transfer_list) {
+		if (xfer->len) {
+			reinit_completion(&ctlr->xfer_completion);
+			ret = ctlr->transfer_one(ctlr, spi, xfer);
+			if (ret < 0) {
+				break;
+			}
+			if (ret > 0) {
+				wait_for_completion(&ctlr->xfer_completion);
+				ret = 0;
+			}
+			message->actual_length += xfer->len;
+		}
+		if (xfer->cs_change) {
+			if (list_is_last(&xfer->transfer_list, &message->transfers)) {
+				keep_cs = true;
+			}
+			else {
+				sim_spi_set_cs(spi, false);
+				sim_spi_set_cs(spi, true);
+			}
+		}
+	}
+
+	if (ret || !keep_cs) {
+		sim_spi_set_cs(spi, false);
+	}
+	if (ret && ctlr->handle_err) {
+		ctlr->handle_err(ctlr, message);
+	}
+	if (ctlr->unprepare_message) {
+		ctlr->unprepare_message(ctlr, message);
+	}
+	message->status = ret;
+	if (message->complete) {
+		message->complete(message->context);
+	}
+	return ret;
+}
+
+// spi-mem
+
+static bool sim_spi_mem_buswidth_ok(struct spi_mem *mem, u8 buswidth, bool tx)
+{
+	u32 mode = mem->spi->mode;
+
+	switch (buswidth) {
+	case 1:
+		return true;
+	case 2:
+		return mode & (tx ? (SPI_TX_DUAL | SPI_TX_QUAD) : (SPI_RX_DUAL | SPI_RX_QUAD));
+	case 4:
+		return mode & (tx ? SPI_TX_QUAD : SPI_RX_QUAD);
+	default:
+		return false;
+	}
+}
+
+bool spi_mem_default_supports_op(struct spi_mem *mem, const struct spi_mem_op *op)
+{
+	if (op->cmd.dtr || op->addr.dtr || op->dummy.dtr || op->data.dtr || op->cmd.nbytes != 1) {
+		return false;
+	}
+	if (!sim_spi_mem_buswidth_ok(mem, op->cmd.buswidth, true)
+		|| (op->addr.nbytes && !sim_spi_mem_buswidth_ok(mem, op->addr.buswidth, true))
+		|| (op->dummy.nbytes && !sim_spi_mem_buswidth_ok(mem, op->dummy.buswidth, true))) {
+		return false;
+	}
+	if (op->data.dir != SPI_MEM_NO_DATA
+		&& !sim_spi_mem_buswidth_ok(mem, op->data.buswidth, op->data.dir == SPI_MEM_DATA_OUT)) {
+		return false;
+	}
+	return true;
+}
+
+int spi_mem_exec_op(struct spi_mem *mem, const struct spi_mem_op *op)
+{
+	/*
+		Sends an operation as one spi_message with a transfer for each phase: command, address,
+		dummy bytes and data, each on the bus width of its phase.
+	*/
+	struct spi_transfer xfers[4] = { 0 };
+	struct spi_message message;
+	u8 header[1 + 8 + 32];
+	unsigned int len = 0;
+	int ret;
+
+	if (!spi_mem_default_supports_op(mem, op) || op->addr.nbytes > 8 || op->dummy.nbytes > 32) {
+		return -EOPNOTSUPP;
+	}
+	spi_message_init(&message);
+	header[len] = op->cmd.opcode;
+	xfers[0].tx_buf = header + len;
+	xfers[0].len = 1;
+	xfers[0].tx_nbits = op->cmd.buswidth;
+	spi_message_add_tail(&xfers[0], &message);
+	len++;
+	if (op->addr.nbytes) {
+		for (int i = op->addr.nbytes - 1; i >= 0; i--) {
+			header[len + op->addr.nbytes - 1 - i] = op->addr.val >> (8 * i);
+		}
+		xfers[1].tx_buf = header + len;
+		xfers[1].len = op->addr.nbytes;
+		xfers[1].tx_nbits = op->addr.buswidth;
+		spi_message_add_tail(&xfers[1], &message);
+		len += op->addr.nbytes;
+	}
+	if (op->dummy.nbytes) {
+		memset(header + len, 0xFF, op->dummy.nbytes);
+		xfers[2].tx_buf = header + len;
+		xfers[2].len = op->dummy.nbytes;
+		xfers[2].tx_nbits = op->dummy.buswidth;
+		spi_message_add_tail(&xfers[2], &message);
+		len += op->dummy.nbytes;
+	}
+	if (op->data.nbytes) {
+		if (op->data.dir == SPI_MEM_DATA_IN) {
+			xfers[3].rx_buf = op->data.buf.in;
+			xfers[3].rx_nbits = op->data.buswidth;
+		}
+		else {
+			xfers[3].tx_buf = op->data.buf.out;
+			xfers[3].tx_nbits = op->data.buswidth;
+		}
+		xfers[3].len = op->data.nbytes;
+		spi_message_add_tail(&xfers[3], &message);
+	}
+	ret = spi_sync(mem->spi, &message);
+	if (ret) {
+		return ret;
+	}
+	return message.actual_length == len + op->data.nbytes ? 0 : -EIO;
+}
+
+struct spi_mem_dirmap_desc *spi_mem_dirmap_create(struct spi_mem *mem, const struct spi_mem_dirmap_info *info)
+{
+	struct spi_controller *ctlr = mem->spi->controller;
+	struct spi_mem_dirmap_desc *desc;
+	int ret = -EOPNOTSUPP;
+
+	if (!info->op_tmpl.addr.nbytes || info->op_tmpl.addr.nbytes > 8 || info->op_tmpl.data.dir == SPI_MEM_NO_DATA) {
+		return ERR_PTR(-EINVAL);
+	}
+	desc = calloc(1, sizeof(*desc));
+	if (!desc) {
+		return ERR_PTR(-ENOMEM);
+	}
+	desc->mem = mem;
+	desc->info = *info;
+	if (ctlr->mem_ops && ctlr->mem_ops->dirmap_create) {
+		ret = ctlr->mem_ops->dirmap_create(desc);
+	}
+	if (ret) {
+		desc->nodirmap = true;
+		if (!spi_mem_default_supports_op(mem, &desc->info.op_tmpl)) {
+			free(desc);
+			return ERR_PTR(-EOPNOTSUPP);
+		}
+	}
+	return desc;
+}
+
+void spi_mem_dirmap_destroy(struct spi_mem_dirmap_desc *desc)
+{
+	struct spi_controller *ctlr = desc->mem->spi->controller;
+
+	if (!desc->nodirmap && ctlr->mem_ops && ctlr->mem_ops->dirmap_destroy) {
+		ctlr->mem_ops->dirmap_destroy(desc);
+	}
+	free(desc);
+}
+
+ssize_t spi_mem_dirmap_read(struct spi_mem_dirmap_desc *desc, u64 offs, size_t len, void *buf)
+{
+	struct spi_controller *ctlr = desc->mem->spi->controller;
+	struct spi_mem_op op = desc->info.op_tmpl;
+	int ret;
+
+	if (desc->info.op_tmpl.data.dir != SPI_MEM_DATA_IN) {
+		return -EINVAL;
+	}
+	if (!len) {
+		return 0;
+	}
+	if (!desc->nodirmap && ctlr->mem_ops && ctlr->mem_ops->dirmap_read) {
+		return ctlr->mem_ops->dirmap_read(desc, offs, len, buf);
+	}
+	if (desc->nodirmap) {
+		op.addr.val = desc->info.offset + offs;
+		op.data.buf.in = buf;
+		op.data.nbytes = len;
+		ret = spi_mem_exec_op(desc->mem, &op);
+		return ret ? ret : (ssize_t) len;
+	}
+	return -EOPNOTSUPP;
+}
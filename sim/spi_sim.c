@@ -0,0 +1,1251 @@
+/*
+	File: spi_sim.c
+	Authors: Salman, Tayyab, Zawaher
+	Description: Simulator harness. Loads a driver built against the kernel shims, opens its
+		/dev/spiN character device and runs a write/read workload against the FE310 SPI model,
+		then reports throughput, interrupts and register accesses in virtual time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "sim.h"
+#include <linux/spi/spi.h>
+#include <linux/spi/spi-mem.h>
+#include "../src/stz_spi.h"
+
+enum api {
+	API_CDEV,					// write()/read() on /dev/spiN
+	API_SPI,					// spi_sync() through the registered spi_controller
+	API_IOCTL,					// STZ_SPI_IOC_TRANSFER on /dev/spiN
+	API_AIO,					// asynchronous write_iter on /dev/spiN, all transfers in flight
+	API_MMAP,					// rings mmapped from /dev/spiN, STZ_SPI_IOC_MMAP_KICK doorbell
+	API_DIRMAP,					// spi-mem direct mapping reads of a serial flash
+	API_WRITE_READ,				// STZ_SPI_IOC_WRITE_READ command/response exchanges on /dev/spiN
+	API_SAMPLE,					// STZ_SPI_IOC_SAMPLER_START periodic sampling of /dev/spiN, records read()
+	API_STREAM,					// receive-only streaming read()s of /dev/spiN, STZ_SPI_IOC_RX_STREAM
+};
+
+struct workload {
+	enum api api;
+	unsigned int cs;
+	size_t size;
+	unsigned int count;
+	unsigned int segments;
+	unsigned int seg_delay_us;	// ioctl: delay_usecs of each segment
+	bool cs_change;				// ioctl: set cs_change on each segment
+	unsigned int files;			// files opened by the aio workload
+	unsigned int txn_parts;		// cdev: write each message in this many write()s of one transaction, 0 for one write() and no transaction
+	unsigned int txn_idle_us;	// idle timeout of the transactions, 0 for the txn_idle_us module parameter
+	unsigned int txn_gap_us;	// time between the write()s of a transaction
+	unsigned int cmd_len;		// write_read: command bytes, the flash slave gets a 4 byte read command
+	unsigned int period_us;		// sample: sampling period
+	unsigned int ring_records;	// sample: records in the ring, 0 for the driver's default
+	unsigned int read_every_us;	// sample: time between reads of the records, 0 for 16 periods; aio: of the received bytes, 0 for every step
+	unsigned int fill;			// stream: byte clocked by the reads
+	bool binary;
+	bool nonblock;
+	bool write_only;			// cdev, aio: open /dev/spiN with O_WRONLY, nothing is read back
+	unsigned int speed_hz;		// STZ_SPI_IOC_WR_CONFIG rate of the CS line, 0 keeps the reset rate
+	unsigned int xfer_speed_hz;	// rate of each spi_transfer or ioctl segment, 0 keeps the line's rate
+	unsigned int lines;			// data lines of the dirmap reads: 1, 2 or 4
+	bool set_delays;			// --delays given
+	unsigned int delays[4];		// cssck, sckcs, intercs and interxfr of the CS line or slave, in SCK cycles
+	int word_delay;				// interxfr of each spi_transfer or ioctl segment, negative keeps the line's
+};
+
+struct result {
+	uint64_t tx_total;
+	uint64_t rx_total;
+	uint64_t rx_match;
+	unsigned int poll_ready;		// writes after which poll reported the file readable
+	unsigned int eagain;			// non-blocking reads of an empty ring that returned -EAGAIN
+	unsigned int aio_queued;		// asynchronous writes queued by the driver
+	unsigned int aio_max_in_flight;
+	unsigned int aio_longest_run;	// most completions in a row from one file
+	unsigned int kicks;				// STZ_SPI_IOC_MMAP_KICK calls
+	unsigned int txn_ended;			// transactions ended by STZ_SPI_IOC_TXN_END
+	unsigned int txn_timed_out;		// transactions ended by the idle timeout
+	unsigned int samples;			// sample records read
+	unsigned int reads;				// reads that returned records, or streaming reads
+	unsigned int rx_reads;			// reads that made room after a write cut short or refused by the receive ring
+	unsigned int sample_gaps;		// periods missing from the sequence numbers
+	unsigned int sample_overruns;	// samples lost, reported by the last record
+	uint64_t sample_jitter_ns;		// largest distance of a timestamp from its period
+	bool dirmap;					// the direct mapping is served by the controller, not by spi_messages
+};
+
+static unsigned int aio_completed;
+static unsigned int aio_last_file;			// file of the last completion (kiocb private)
+static unsigned int aio_run, aio_longest_run;	// completions in a row from one file
+
+static void aio_complete(struct kiocb *iocb, long ret)
+{
+	unsigned int file = (uintptr_t) iocb->private;
+
+	aio_completed++;
+	aio_run = (file == aio_last_file) ? aio_run + 1 : 1;
+	aio_last_file = file;
+	aio_longest_run = max(aio_longest_run, aio_run);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --depth N       FIFO depth in frames (default 8)\n"
+		"  --dt-depth      give the FIFO depth in the device tree (sifive,fifo-depth) instead of letting the driver\n"
+		"                  probe it from the watermark fields, which are rounded up to a power of two\n"
+		"  --clk HZ        controller input clock (default 16000000)\n"
+		"  --sck HZ        reset SCK rate (default 1000000)\n"
+		"  --mmio-ns N     cost of one register access (default 50)\n"
+		"  --irq-ns N      interrupt entry/exit overhead (default 2000)\n"
+		"  --thread-ns N   threaded interrupt handler wake-up latency (default 4000)\n"
+		"  --no-irq        platform device has no interrupt line\n"
+		"  --num-cs N      chip select lines (device tree num-cs, default 2)\n"
+		"  --stall         shifter stalls on a full RX FIFO instead of dropping frames\n"
+		"  --slave TYPE    loopback | pattern | flash (default loopback, flash for --api dirmap)\n"
+		"  --flash-window N  bytes of the memory-mapped flash window, 0 for none (default 1048576)\n"
+		"  --lines N       dirmap reads use fast read (1), dual I/O (2) or quad I/O (4) (default 1);\n"
+		"                  ioctl: the segments are sent on N lines, transmit only\n"
+		"  --api API       cdev (write/read /dev/spiN) | spi (spi_sync messages) |\n"
+		"                  ioctl (STZ_SPI_IOC_TRANSFER on /dev/spiN) |\n"
+		"                  aio (asynchronous writes on /dev/spiN, submitted together) |\n"
+		"                  mmap (rings mmapped from /dev/spiN) |\n"
+		"                  dirmap (spi-mem direct mapping reads of a flash) |\n"
+		"                  wr (STZ_SPI_IOC_WRITE_READ command/response, size is the response) |\n"
+		"                  sample (STZ_SPI_IOC_SAMPLER_START, count records of size bytes) |\n"
+		"                  stream (receive-only read()s that clock --fill, STZ_SPI_IOC_RX_STREAM) (default cdev)\n"
+		"  --fill N        stream: byte sent by the reads (default 0xff)\n"
+		"  --period US     sample: sampling period (default 100)\n"
+		"  --ring N        sample: records in the driver's ring (default: the driver's)\n"
+		"  --read-every US sample: time between reads of the records (default 16 periods);\n"
+		"                  aio: time between reads of the received bytes (default: as soon as they arrive)\n"
+		"  --cmd N         wr: command bytes (default 1; with --slave flash, a read command and its address)\n"
+		"  --segments N    ioctl segments per transfer (default 1)\n"
+		"  --seg-delay US  ioctl: delay after each segment (delay_usecs, default 0)\n"
+		"  --cs-change     ioctl: release CS between the segments (cs_change)\n"
+		"  --files N       aio: open N files, on CS lines cs, cs + 1, ..., each submitting count writes (default 1)\n"
+		"  --txn N         cdev: write each message in N write()s, in one transaction (STZ_SPI_IOC_TXN_BEGIN/END)\n"
+		"  --txn-idle US   idle timeout of the transactions (default: the txn_idle_us module parameter)\n"
+		"  --txn-gap US    time between the write()s of a transaction (default 0)\n"
+		"  --binary        send every byte value, zeros included, instead of text lines\n"
+		"  --nonblock      open /dev/spiN with O_NONBLOCK\n"
+		"  --write-only    cdev, aio: open /dev/spiN with O_WRONLY, so the writes do not keep what they receive\n"
+		"  --cs N          chip select / minor number (default 0)\n"
+		"  --speed HZ      configure the SCK rate of the CS line with STZ_SPI_IOC_WR_CONFIG (the slave's max_speed_hz with --api spi)\n"
+		"  --xfer-speed HZ SCK rate of each spi_transfer (--api spi) or ioctl segment (--api ioctl)\n"
+		"  --delays A,B,C,D  cssck, sckcs, intercs and interxfr in SCK cycles, of the CS line (STZ_SPI_IOC_WR_CONFIG)\n"
+		"                  or of the slave with --api spi\n"
+		"  --word-delay N  SCK cycles between frames of each spi_transfer or ioctl segment\n"
+		"  --size N        bytes per transfer, including the trailing newline of text (default 32)\n"
+		"  --count N       number of transfers (default 4)\n"
+		"  --param N=V     set driver module parameter N to V\n"
+		"  -v              echo driver printk output\n", prog);
+	exit(2);
+}
+
+static void parse_args(int argc, char **argv, struct sim_config *config, struct workload *work)
+{
+	static const struct option options[] = {
+		{ "depth",   required_argument, NULL, 'd' },
+		{ "dt-depth", no_argument,      NULL, 'T' },
+		{ "clk",     required_argument, NULL, 'k' },
+		{ "sck",     required_argument, NULL, 's' },
+		{ "mmio-ns", required_argument, NULL, 'm' },
+		{ "irq-ns",  required_argument, NULL, 'i' },
+		{ "thread-ns", required_argument, NULL, 't' },
+		{ "no-irq",  no_argument,       NULL, 'n' },
+		{ "stall",   no_argument,       NULL, 'o' },
+		{ "slave",   required_argument, NULL, 'S' },
+		{ "api",     required_argument, NULL, 'a' },
+		{ "cs",      required_argument, NULL, 'c' },
+		{ "size",    required_argument, NULL, 'z' },
+		{ "count",   required_argument, NULL, 'N' },
+		{ "param",   required_argument, NULL, 'p' },
+		{ "segments", required_argument, NULL, 'g' },
+		{ "seg-delay", required_argument, NULL, 'u' },
+		{ "cs-change", no_argument, NULL, 'j' },
+		{ "files",   required_argument, NULL, 'f' },
+		{ "txn",     required_argument, NULL, 'x' },
+		{ "cmd",     required_argument, NULL, 'M' },
+		{ "txn-idle", required_argument, NULL, 'I' },
+		{ "txn-gap", required_argument, NULL, 'G' },
+		{ "period",  required_argument, NULL, 'P' },
+		{ "ring",    required_argument, NULL, 'R' },
+		{ "read-every", required_argument, NULL, 'E' },
+		{ "fill",    required_argument, NULL, 'y' },
+		{ "binary",  no_argument,       NULL, 'b' },
+		{ "nonblock", no_argument,      NULL, 'B' },
+		{ "write-only", no_argument,    NULL, 'w' },
+		{ "num-cs",  required_argument, NULL, 'C' },
+		{ "speed",   required_argument, NULL, 'H' },
+		{ "flash-window", required_argument, NULL, 'F' },
+		{ "lines",   required_argument, NULL, 'L' },
+		{ "xfer-speed", required_argument, NULL, 'X' },
+		{ "delays",  required_argument, NULL, 'D' },
+		{ "word-delay", required_argument, NULL, 'W' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "v", options, NULL)) != -1) {
+		switch (opt) {
+		case 'd': config->spi.fifo_depth = strtoul(optarg, NULL, 0); break;
+		case 'T': config->dt_fifo_depth = true; break;
+		case 'k': config->spi.clk_hz = strtoul(optarg, NULL, 0); break;
+		case 's': config->spi.sck_hz = strtoul(optarg, NULL, 0); break;
+		case 'm': config->mmio_ns = strtoull(optarg, NULL, 0); break;
+		case 'i': config->irq_ns = strtoull(optarg, NULL, 0); break;
+		case 't': config->thread_ns = strtoull(optarg, NULL, 0); break;
+		case 'n': config->has_irq = false; break;
+		case 'o': config->spi.rx_overrun_stall = true; break;
+		case 'c': work->cs = strtoul(optarg, NULL, 0); break;
+		case 'z': work->size = strtoul(optarg, NULL, 0); break;
+		case 'N': work->count = strtoul(optarg, NULL, 0); break;
+		case 'g': work->segments = strtoul(optarg, NULL, 0); break;
+		case 'u': work->seg_delay_us = strtoul(optarg, NULL, 0); break;
+		case 'j': work->cs_change = true; break;
+		case 'f': work->files = strtoul(optarg, NULL, 0); break;
+		case 'x': work->txn_parts = strtoul(optarg, NULL, 0); break;
+		case 'M': work->cmd_len = strtoul(optarg, NULL, 0); break;
+		case 'I': work->txn_idle_us = strtoul(optarg, NULL, 0); break;
+		case 'G': work->txn_gap_us = strtoul(optarg, NULL, 0); break;
+		case 'P': work->period_us = strtoul(optarg, NULL, 0); break;
+		case 'R': work->ring_records = strtoul(optarg, NULL, 0); break;
+		case 'E': work->read_every_us = strtoul(optarg, NULL, 0); break;
+		case 'y': work->fill = strtoul(optarg, NULL, 0) & 0xff; break;
+		case 'b': work->binary = true; break;
+		case 'B': work->nonblock = true; break;
+		case 'w': work->write_only = true; break;
+		case 'C': config->spi.num_cs = strtoul(optarg, NULL, 0); break;
+		case 'H': work->speed_hz = strtoul(optarg, NULL, 0); break;
+		case 'F': config->spi.flash_size = strtoul(optarg, NULL, 0); break;
+		case 'L': work->lines = strtoul(optarg, NULL, 0); break;
+		case 'X': work->xfer_speed_hz = strtoul(optarg, NULL, 0); break;
+		case 'D':
+			if (sscanf(optarg, "%u,%u,%u,%u", &work->delays[0], &work->delays[1], &work->delays[2], &work->delays[3]) != 4) {
+				usage(argv[0]);
+			}
+			work->set_delays = true;
+			break;
+		case 'W': work->word_delay = strtol(optarg, NULL, 0); break;
+		case 'v': config->verbose = true; break;
+		case 'p':
+			if (sim_param_set(optarg)) {
+				fprintf(stderr, "sim: unknown module parameter %s\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'a':
+			if (!strcmp(optarg, "cdev")) {
+				work->api = API_CDEV;
+			}
+			else if (!strcmp(optarg, "spi")) {
+				work->api = API_SPI;
+			}
+			else if (!strcmp(optarg, "ioctl")) {
+				work->api = API_IOCTL;
+			}
+			else if (!strcmp(optarg, "aio")) {
+				work->api = API_AIO;
+			}
+			else if (!strcmp(optarg, "mmap")) {
+				work->api = API_MMAP;
+			}
+			else if (!strcmp(optarg, "dirmap")) {
+				work->api = API_DIRMAP;
+				config->spi.slave = FE310_SLAVE_FLASH;
+			}
+			else if (!strcmp(optarg, "wr")) {
+				work->api = API_WRITE_READ;
+			}
+			else if (!strcmp(optarg, "sample")) {
+				work->api = API_SAMPLE;
+			}
+			else if (!strcmp(optarg, "stream")) {
+				work->api = API_STREAM;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		case 'S':
+			if (!strcmp(optarg, "loopback")) {
+				config->spi.slave = FE310_SLAVE_LOOPBACK;
+			}
+			else if (!strcmp(optarg, "pattern")) {
+				config->spi.slave = FE310_SLAVE_PATTERN;
+			}
+			else if (!strcmp(optarg, "flash")) {
+				config->spi.slave = FE310_SLAVE_FLASH;
+			}
+			else {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (config->spi.clk_hz == 0 || config->spi.sck_hz == 0 || work->size == 0
+		|| work->segments == 0 || work->segments > STZ_SPI_MAX_SEGMENTS || work->files == 0
+		|| work->cmd_len > STZ_SPI_MAX_COMMAND || work->size > STZ_SPI_MAX_RESPONSE
+		|| work->period_us == 0 || (work->api == API_SAMPLE && work->size > STZ_SPI_MAX_SAMPLE)
+		|| (work->lines != 1 && work->lines != 2 && work->lines != 4)) {
+		usage(argv[0]);
+	}
+}
+
+static void print_cs_sysfs(dev_t devt)
+{
+	/*
+		Prints the sysfs files of the CS line's /dev/spiN device, one line each.
+		Multi-line files (the latency histogram) are printed on one line, leaving out the zero buckets.
+	*/
+	struct device *dev = sim_class_device(devt);
+	static char buf[PAGE_SIZE];
+
+	if (dev == NULL || dev->groups == NULL) {
+		return;
+	}
+	printf("sysfs:\n");
+	for (const struct attribute_group **group = dev->groups; *group; group++) {
+		for (struct attribute **attr = (*group)->attrs; *attr; attr++) {
+			struct device_attribute *dev_attr = container_of(*attr, struct device_attribute, attr);
+			char *line, *next;
+
+			if (!dev_attr->show || dev_attr->show(dev, dev_attr, buf) < 0) {
+				continue;
+			}
+			printf("  %-20s", (*attr)->name);
+			for (line = buf; (next = strchr(line, '\n')) != NULL; line = next + 1) {
+				*next = 0;
+				if (next[1] == 0 && line == buf) {
+					printf(" %s", line);					// single value
+				}
+				else if (strchr(line, ' ') == NULL || strcmp(strchr(line, ' '), " 0")) {
+					printf(" [%s]", line);
+				}
+			}
+			printf("\n");
+		}
+	}
+}
+
+static int open_cs(const struct workload *work, struct inode *inode, struct file *file)
+{
+	/*
+		Opens /dev/spi<cs>, for reading and writing or with --write-only for writing only,
+		and, with --speed or --delays, configures its CS line, keeping the other settings.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct stz_spi_config config;
+
+	file->f_mode = work->write_only ? FMODE_WRITE : FMODE_READ | FMODE_WRITE;
+	if (fops->open && fops->open(inode, file) != 0) {
+		fprintf(stderr, "sim: open of minor %u failed\n", work->cs);
+		return 1;
+	}
+	if (work->speed_hz || work->set_delays) {
+		if (fops->unlocked_ioctl(file, STZ_SPI_IOC_RD_CONFIG, (unsigned long) (uintptr_t) &config) != 0) {
+			fprintf(stderr, "sim: STZ_SPI_IOC_RD_CONFIG failed\n");
+			return 1;
+		}
+		if (work->speed_hz) {
+			config.speed_hz = work->speed_hz;
+		}
+		if (work->set_delays) {
+			config.delay0 = work->delays[0] | work->delays[1] << 16;
+			config.delay1 = work->delays[2] | work->delays[3] << 16;
+		}
+		if (fops->unlocked_ioctl(file, STZ_SPI_IOC_WR_CONFIG, (unsigned long) (uintptr_t) &config) != 0) {
+			fprintf(stderr, "sim: STZ_SPI_IOC_WR_CONFIG failed\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int run_cdev(const struct workload *work, const char *tx, char *rx, struct result *res)
+{
+	/*
+		Each transfer opens /dev/spi<cs>, writes the message, lets the hardware finish,
+		polls the file, reads back the received message and closes the file.
+		A non-blocking file is first read while its ring is empty, which must return -EAGAIN.
+		With --txn N, the message is written in N parts, --txn-gap apart, in one transaction.
+		Each write() is one transfer. A write sends only what the receive ring has room for (rx_backpressure):
+		one cut short, or refused with -EAGAIN, is continued once the ring has been read.
+		With --write-only, nothing is read: the file does not keep what its writes receive.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+		struct file file = { .f_op = fops, .f_flags = work->nonblock ? O_NONBLOCK : 0 };
+		size_t received = 0;
+
+		if (open_cs(work, &inode, &file)) {
+			return 1;
+		}
+
+		if (work->nonblock && !work->write_only && fops->read(&file, rx, work->size, &file.f_pos) == -EAGAIN) {
+			res->eagain++;
+		}
+
+		if (work->txn_parts) {
+			__u32 idle_us = work->txn_idle_us;
+
+			if (fops->unlocked_ioctl(&file, STZ_SPI_IOC_TXN_BEGIN, (unsigned long) (uintptr_t) &idle_us) != 0) {
+				fprintf(stderr, "sim: STZ_SPI_IOC_TXN_BEGIN failed\n");
+				return 1;
+			}
+		}
+		for (unsigned int part = 0, offset = 0; part < max(work->txn_parts, 1U); part++) {
+			size_t end = offset + work->size / max(work->txn_parts, 1U) + (part < work->size % max(work->txn_parts, 1U));
+
+			if (part) {
+				sim_wait((uint64_t) work->txn_gap_us * 1000);
+			}
+			while (offset < end) {
+				ssize_t written = fops->write(&file, tx + offset, end - offset, &file.f_pos);
+				ssize_t got;
+
+				if (written > 0) {
+					res->tx_total += written;
+					offset += written;
+					if (offset == end) {
+						continue;
+					}
+				}
+				else if (written != -EAGAIN || work->write_only) {
+					fprintf(stderr, "sim: write failed: %zd\n", written);
+					return 1;
+				}
+				// The ring has no room for the rest of the write until this read
+				got = fops->read(&file, rx + received, work->size - received, &file.f_pos);
+				if (got <= 0) {
+					fprintf(stderr, "sim: write returned %zd with nothing to read\n", written);
+					return 1;
+				}
+				received += got;
+				res->rx_reads++;
+			}
+		}
+		if (work->txn_parts) {
+			long ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_TXN_END, 0);
+
+			if (ret == 0) {
+				res->txn_ended++;
+			}
+			else if (ret == -ETIMEDOUT) {
+				res->txn_timed_out++;
+			}
+			else {
+				fprintf(stderr, "sim: STZ_SPI_IOC_TXN_END failed: %ld\n", ret);
+				return 1;
+			}
+		}
+		sim_idle();
+		if (fops->poll && (fops->poll(&file, NULL) & EPOLLIN)) {
+			res->poll_ready++;
+		}
+
+		while (received < work->size && !work->write_only) {
+			ssize_t ret = fops->read(&file, rx + received, work->size - received, &file.f_pos);
+			if (ret <= 0) {
+				break;
+			}
+			received += ret;
+		}
+		if (received > work->size) {
+			received = work->size;
+		}
+		res->rx_total += received;
+		if (sim.config.spi.slave == FE310_SLAVE_LOOPBACK) {
+			for (size_t i = 0; i < received; i++) {
+				res->rx_match += (rx[i] == tx[i]);
+			}
+		}
+
+		if (fops->release) {
+			fops->release(&inode, &file);
+		}
+	}
+	return 0;
+}
+
+static int run_ioctl(const struct workload *work, const char *tx, char *rx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> once; each transfer is one STZ_SPI_IOC_TRANSFER with the message
+		split into work->segments full-duplex segments, with --seg-delay and --cs-change applied to each.
+		With --lines 2 or 4, the segments are transmit only on that many data lines, and nothing is read back.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+	struct file file = { .f_op = fops };
+	struct stz_spi_segment segments[STZ_SPI_MAX_SEGMENTS];
+	struct stz_spi_transfer transfer = { .segments = (uintptr_t) segments, .num_segments = work->segments };
+
+	if (!fops->unlocked_ioctl) {
+		fprintf(stderr, "sim: driver has no ioctl\n");
+		return 1;
+	}
+	if (open_cs(work, &inode, &file)) {
+		return 1;
+	}
+
+	memset(segments, 0, sizeof(segments));
+	for (unsigned int s = 0, offset = 0; s < work->segments; s++) {
+		unsigned int len = work->size / work->segments + (s < work->size % work->segments);
+		segments[s].tx_buf = (uintptr_t) (tx + offset);
+		segments[s].rx_buf = work->lines > 1 ? 0 : (uintptr_t) (rx + offset);
+		segments[s].tx_nbits = work->lines > 1 ? work->lines : 0;
+		segments[s].len = len;
+		segments[s].speed_hz = work->xfer_speed_hz;
+		segments[s].delay_usecs = work->seg_delay_us;
+		segments[s].cs_change = work->cs_change;
+		if (work->word_delay >= 0) {
+			segments[s].word_delay = work->word_delay;
+			segments[s].flags = STZ_SPI_SEG_WORD_DELAY;
+		}
+		offset += len;
+	}
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		memset(rx, 0, work->size);
+		long ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_TRANSFER, (unsigned long) (uintptr_t) &transfer);
+		if (ret < 0) {
+			fprintf(stderr, "sim: ioctl failed: %ld\n", ret);
+			return 1;
+		}
+		res->tx_total += ret;
+		if (work->lines > 1) {
+			continue;
+		}
+		res->rx_total += ret;
+		if (sim.config.spi.slave == FE310_SLAVE_LOOPBACK) {
+			for (long i = 0; i < ret; i++) {
+				res->rx_match += (rx[i] == tx[i]);
+			}
+		}
+	}
+
+	if (fops->release) {
+		fops->release(&inode, &file);
+	}
+	sim_idle();
+	return 0;
+}
+
+static size_t aio_drain(const struct file_operations *fops, struct file *file, char *rx, size_t len)
+{
+	/*
+		Reads the received bytes available now, without blocking. A write-only file has none.
+	*/
+	struct kiocb iocb = { .ki_filp = file, .ki_flags = IOCB_NOWAIT };
+	struct iovec iov;
+	struct iov_iter iter;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len && (file->f_mode & FMODE_READ)) {
+		import_single_range(READ, rx + done, len - done, &iov, &iter);
+		ret = fops->read_iter(&iocb, &iter);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+static int run_aio(const struct workload *work, const char *tx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> once and submits every transfer as an asynchronous write, as aio or io_uring would,
+		before waiting for any of them. A submission refused with -EAGAIN (queue full) is retried after a completion.
+		The received bytes are read back with non-blocking reads while the writes complete.
+		With --files N, N files are opened on CS lines cs, cs + 1, ... and each submits count writes,
+		the first file all of its writes first: the order of the completions shows how the bus is shared.
+		With --read-every, the received bytes are only read that often: a write is only queued once the receive
+		ring has room reserved for its response (rx_backpressure), and is refused with -EAGAIN until then.
+		A write sent synchronously (no interrupt line) may be cut short by the ring: the rest is written after a read.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	unsigned int files = work->files;
+	unsigned int total_count = work->count * files;
+	size_t total = work->size * work->count;
+	struct inode *inodes = calloc(files, sizeof(*inodes));
+	struct file *filps = calloc(files, sizeof(*filps));
+	unsigned int *submitted = calloc(files, sizeof(*submitted));
+	size_t *sent = calloc(files, sizeof(*sent));
+	size_t *received = calloc(files, sizeof(*received));
+	char **rx = calloc(files, sizeof(*rx));
+	struct kiocb *iocbs = calloc(total_count, sizeof(*iocbs));
+	unsigned int in_flight = 0;
+
+	if (!fops->write_iter || !fops->read_iter) {
+		fprintf(stderr, "sim: driver has no write_iter/read_iter\n");
+		return 1;
+	}
+	for (unsigned int f = 0; f < files; f++) {
+		struct workload file_work = *work;
+
+		file_work.cs = (work->cs + f) % sim.config.spi.num_cs;
+		inodes[f] = (struct inode) { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + file_work.cs), .i_cdev = sim.cdev };
+		filps[f] = (struct file) { .f_op = fops };
+		rx[f] = calloc(1, total);
+		if (open_cs(&file_work, &inodes[f], &filps[f])) {
+			return 1;
+		}
+	}
+
+	aio_completed = 0;
+	aio_last_file = UINT_MAX;
+	aio_longest_run = 0;
+	while (aio_completed < total_count) {
+		for (unsigned int f = 0; f < files; f++) {
+			while (submitted[f] < work->count) {
+				struct kiocb *iocb = &iocbs[f * work->count + submitted[f]];
+				struct iovec iov;
+				struct iov_iter iter;
+				ssize_t ret;
+
+				*iocb = (struct kiocb) { .ki_filp = &filps[f], .ki_complete = aio_complete, .private = (void *) (uintptr_t) f };
+				import_single_range(WRITE, (char *) tx + sent[f], work->size - sent[f], &iov, &iter);
+				ret = fops->write_iter(iocb, &iter);
+				if (ret == -EAGAIN) {
+					break;
+				}
+				if (ret == -EIOCBQUEUED) {
+					res->aio_queued++;
+					res->tx_total += work->size;
+				}
+				else if (ret > 0 && (size_t) ret <= work->size - sent[f]) {
+					// Sent synchronously, as far as the ring had room
+					res->tx_total += ret;
+					sent[f] += ret;
+					if (sent[f] < work->size) {
+						break;
+					}
+					sent[f] = 0;
+					aio_complete(iocb, work->size);
+				}
+				else if (ret == -EMSGSIZE) {
+					fprintf(stderr, "sim: asynchronous write of %zu bytes longer than the receive ring or async_max_write\n", work->size);
+					return 1;
+				}
+				else {
+					fprintf(stderr, "sim: asynchronous write failed: %zd\n", ret);
+					return 1;
+				}
+				submitted[f]++;
+				in_flight++;
+				res->aio_max_in_flight = max(res->aio_max_in_flight, in_flight - aio_completed);
+				if (ret != -EIOCBQUEUED) {
+					break;								// its received bytes are read before the next one waits for room
+				}
+			}
+			received[f] += aio_drain(fops, &filps[f], rx[f] + received[f], total - received[f]);
+		}
+		if (aio_completed < total_count && work->read_every_us) {
+			sim_wait((uint64_t) work->read_every_us * 1000);
+		}
+		else if (in_flight > aio_completed && !sim_step()) {
+			fprintf(stderr, "sim: %u asynchronous writes never completed\n", total_count - aio_completed);
+			return 1;
+		}
+	}
+	sim_idle();
+
+	for (unsigned int f = 0; f < files; f++) {
+		received[f] += aio_drain(fops, &filps[f], rx[f] + received[f], total - received[f]);
+		res->rx_total += received[f];
+		if (sim.config.spi.slave == FE310_SLAVE_LOOPBACK) {
+			for (size_t i = 0; i < received[f]; i++) {
+				res->rx_match += (rx[f][i] == tx[i % work->size]);
+			}
+		}
+		if (fops->release) {
+			fops->release(&inodes[f], &filps[f]);
+		}
+		free(rx[f]);
+	}
+	res->aio_longest_run = aio_longest_run;
+	free(iocbs);
+	free(rx);
+	free(received);
+	free(sent);
+	free(submitted);
+	free(filps);
+	free(inodes);
+	return 0;
+}
+
+static int run_mmap(const struct workload *work, const char *tx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> once and maps its rings. Each transfer is written into the tx ring
+		as far as it has room, sent with the STZ_SPI_IOC_MMAP_KICK doorbell and its received bytes
+		are consumed from the rx ring, until the whole transfer has been sent.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+	struct file file = { .f_op = fops, .f_inode = &inode };
+	struct vm_area_struct vma = { 0 };
+	struct stz_spi_mmap_ring *ring;
+	char *tx_area, *rx_area;
+	__u32 map_size, mask;
+	uint64_t rx_index = 0;
+
+	if (!fops->mmap || !fops->unlocked_ioctl) {
+		fprintf(stderr, "sim: driver has no mmap\n");
+		return 1;
+	}
+	if (open_cs(work, &inode, &file)) {
+		return 1;
+	}
+	if (fops->unlocked_ioctl(&file, STZ_SPI_IOC_MMAP_SIZE, (unsigned long) (uintptr_t) &map_size) != 0) {
+		fprintf(stderr, "sim: STZ_SPI_IOC_MMAP_SIZE failed\n");
+		return 1;
+	}
+	vma.vm_end = map_size;
+	if (fops->mmap(&file, &vma) != 0) {
+		fprintf(stderr, "sim: mmap failed\n");
+		return 1;
+	}
+	ring = (struct stz_spi_mmap_ring *) vma.vm_start;
+	tx_area = (char *) ring + ring->tx_offset;
+	rx_area = (char *) ring + ring->rx_offset;
+	mask = ring->size - 1;
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		size_t sent = 0;
+
+		while (sent < work->size) {
+			// Produce as much of the transfer as the tx ring has room for
+			__u32 head = ring->tx_head;
+			while (sent < work->size && head - ring->tx_tail < ring->size) {
+				tx_area[head++ & mask] = tx[sent++];
+			}
+			__atomic_store_n(&ring->tx_head, head, __ATOMIC_RELEASE);
+
+			long ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_MMAP_KICK, 0);
+			if (ret < 0) {
+				fprintf(stderr, "sim: STZ_SPI_IOC_MMAP_KICK failed: %ld\n", ret);
+				return 1;
+			}
+			res->kicks++;
+			res->tx_total += ret;
+
+			// Consume the received bytes
+			__u32 tail = ring->rx_tail;
+			__u32 rx_head = __atomic_load_n(&ring->rx_head, __ATOMIC_ACQUIRE);
+			for (; tail != rx_head; tail++, rx_index++) {
+				res->rx_total++;
+				res->rx_match += (rx_area[tail & mask] == tx[rx_index % work->size]);
+			}
+			__atomic_store_n(&ring->rx_tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (fops->release) {
+		fops->release(&inode, &file);
+	}
+	sim_idle();
+	return 0;
+}
+
+static int run_spi(const struct workload *work, const char *tx, char *rx, struct result *res)
+{
+	/*
+		Each transfer is one spi_message with a single full-duplex spi_transfer,
+		on a slave with a max_speed_hz of --speed and the CS delays of --delays.
+	*/
+	struct spi_device *spi = sim_spi_new_device(work->cs, SPI_MODE_0, work->speed_hz);
+	if (spi == NULL) {
+		fprintf(stderr, "sim: no spi controller registered for cs %u\n", work->cs);
+		return 1;
+	}
+	if (work->set_delays) {
+		spi->cs_setup = (struct spi_delay) { .value = work->delays[0], .unit = SPI_DELAY_UNIT_SCK };
+		spi->cs_hold = (struct spi_delay) { .value = work->delays[1], .unit = SPI_DELAY_UNIT_SCK };
+		spi->cs_inactive = (struct spi_delay) { .value = work->delays[2], .unit = SPI_DELAY_UNIT_SCK };
+		spi->word_delay = (struct spi_delay) { .value = work->delays[3], .unit = SPI_DELAY_UNIT_SCK };
+	}
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		struct spi_transfer xfer = { .tx_buf = tx, .rx_buf = rx, .len = work->size, .speed_hz = work->xfer_speed_hz };
+		if (work->word_delay >= 0) {
+			xfer.word_delay = (struct spi_delay) { .value = work->word_delay, .unit = SPI_DELAY_UNIT_SCK };
+		}
+		struct spi_message message;
+
+		memset(rx, 0, work->size);
+		spi_message_init(&message);
+		spi_message_add_tail(&xfer, &message);
+		if (spi_sync(spi, &message) != 0) {
+			fprintf(stderr, "sim: spi_sync failed: %d\n", message.status);
+			return 1;
+		}
+		res->tx_total += message.actual_length;
+		res->rx_total += message.actual_length;
+		if (sim.config.spi.slave == FE310_SLAVE_LOOPBACK) {
+			for (size_t i = 0; i < message.actual_length; i++) {
+				res->rx_match += (rx[i] == tx[i]);
+			}
+		}
+	}
+	sim_idle();
+	return 0;
+}
+
+static int run_dirmap(const struct workload *work, char *rx, struct result *res)
+{
+	/*
+		Reads a serial flash the way spi-nor does: one direct mapping with the fast read instruction
+		on work->lines lines (1-1-1 fast read, 1-2-2 dual I/O or 1-4-4 quad I/O),
+		then work->count reads of work->size bytes at consecutive offsets, each repeated until complete.
+	*/
+	static const struct spi_mem_op ops[] = {
+		[1] = SPI_MEM_OP(SPI_MEM_OP_CMD(0x0B, 1), SPI_MEM_OP_ADDR(3, 0, 1), SPI_MEM_OP_DUMMY(1, 1), SPI_MEM_OP_DATA_IN(0, NULL, 1)),
+		[2] = SPI_MEM_OP(SPI_MEM_OP_CMD(0xBB, 1), SPI_MEM_OP_ADDR(3, 0, 2), SPI_MEM_OP_DUMMY(1, 2), SPI_MEM_OP_DATA_IN(0, NULL, 2)),
+		[4] = SPI_MEM_OP(SPI_MEM_OP_CMD(0xEB, 1), SPI_MEM_OP_ADDR(3, 0, 4), SPI_MEM_OP_DUMMY(3, 4), SPI_MEM_OP_DATA_IN(0, NULL, 4)),
+	};
+	u32 mode = SPI_MODE_0 | (work->lines == 4 ? SPI_TX_QUAD | SPI_RX_QUAD : work->lines == 2 ? SPI_TX_DUAL | SPI_RX_DUAL : 0);
+	struct spi_device *spi = sim_spi_new_device(work->cs, mode, work->speed_hz);
+	struct spi_mem mem = { .spi = spi, .name = "sim-flash" };
+	struct spi_mem_dirmap_info info = {
+		.op_tmpl = ops[work->lines],
+		.offset = 0,
+		.length = sim.config.spi.flash_size ? sim.config.spi.flash_size : 1 << 24,
+	};
+	struct spi_mem_dirmap_desc *desc;
+
+	if (spi == NULL) {
+		fprintf(stderr, "sim: no spi controller registered for cs %u\n", work->cs);
+		return 1;
+	}
+	if (work->size > info.length) {
+		fprintf(stderr, "sim: reads larger than the flash\n");
+		return 1;
+	}
+	desc = spi_mem_dirmap_create(&mem, &info);
+	if (IS_ERR(desc)) {
+		fprintf(stderr, "sim: spi_mem_dirmap_create failed: %ld\n", PTR_ERR(desc));
+		return 1;
+	}
+	res->dirmap = !desc->nodirmap;
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		u64 offs = ((u64) n * work->size) % (info.length - work->size + 1);
+		size_t done = 0;
+
+		memset(rx, 0, work->size);
+		while (done < work->size) {
+			ssize_t ret = spi_mem_dirmap_read(desc, offs + done, work->size - done, rx + done);
+			if (ret <= 0) {
+				fprintf(stderr, "sim: spi_mem_dirmap_read failed: %zd\n", ret);
+				return 1;
+			}
+			done += ret;
+		}
+		res->rx_total += done;
+		for (size_t i = 0; i < done; i++) {
+			res->rx_match += ((uint8_t) rx[i] == fe310_flash_byte(offs + i));
+		}
+	}
+	spi_mem_dirmap_destroy(desc);
+	sim_idle();
+	return 0;
+}
+
+static int run_write_read(const struct workload *work, char *rx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> once; each transfer is one STZ_SPI_IOC_WRITE_READ of a --cmd byte command
+		and a size byte response. The loopback slave answers the command's zeros, so the response must be zeros:
+		the echo of the command is not in it. The flash slave gets a read command (0x03) and a 3 byte address,
+		and the response must be the flash data at the address.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+	struct file file = { .f_op = fops };
+	bool flash = sim.config.spi.slave == FE310_SLAVE_FLASH;
+	uint8_t cmd[STZ_SPI_MAX_COMMAND];
+	struct stz_spi_write_read write_read = {
+		.tx_buf = (uintptr_t) cmd,
+		.rx_buf = (uintptr_t) rx,
+		.tx_len = flash ? 4 : work->cmd_len,
+		.rx_len = work->size,
+	};
+
+	if (open_cs(work, &inode, &file)) {
+		return 1;
+	}
+	memset(cmd, 0xA5, sizeof(cmd));
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		uint32_t addr = (uint32_t) (((u64) n * work->size) % sim.config.spi.flash_size);
+
+		if (flash) {
+			cmd[0] = 0x03;
+			cmd[1] = addr >> 16;
+			cmd[2] = addr >> 8;
+			cmd[3] = addr;
+		}
+		memset(rx, 0xEE, work->size);
+		long ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_WRITE_READ, (unsigned long) (uintptr_t) &write_read);
+		if (ret != (long) work->size) {
+			fprintf(stderr, "sim: STZ_SPI_IOC_WRITE_READ returned %ld\n", ret);
+			return 1;
+		}
+		res->tx_total += write_read.tx_len;
+		res->rx_total += ret;
+		for (long i = 0; i < ret; i++) {
+			res->rx_match += (uint8_t) rx[i] == (flash ? fe310_flash_byte(addr + i) : 0);
+		}
+	}
+
+	if (fops->release) {
+		fops->release(&inode, &file);
+	}
+	sim_idle();
+	return 0;
+}
+
+static int run_sample(const struct workload *work, const char *tx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> and samples it with STZ_SPI_IOC_SAMPLER_START every --period us, the template
+		being the size byte message and the whole response recorded. The harness sleeps --read-every us
+		between non-blocking reads of the records, until count records were read, then stops the sampler
+		and reads the records left until the end of the records. The loopback slave echoes the template.
+		Checks the sequence numbers and the timestamps against the period.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+	struct file file = { .f_op = fops, .f_flags = O_NONBLOCK };
+	struct stz_spi_sampler sampler = {
+		.tx_buf = (uintptr_t) tx,
+		.tx_len = work->size,
+		.rx_len = work->size,
+		.period_us = work->period_us,
+		.ring_records = work->ring_records,
+	};
+	size_t record_size = STZ_SPI_SAMPLE_SIZE(work->size);
+	size_t buf_size = record_size * STZ_SPI_MAX_SAMPLE_RECORDS;
+	uint8_t *buf = malloc(buf_size);
+	uint64_t period_ns = (uint64_t) work->period_us * 1000;
+	uint64_t last_ns = 0;
+	uint32_t last_seq = 0;
+	bool stopped = false;
+	long ret;
+
+	if (open_cs(work, &inode, &file)) {
+		return 1;
+	}
+	ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_SAMPLER_START, (unsigned long) (uintptr_t) &sampler);
+	if (ret) {
+		fprintf(stderr, "sim: STZ_SPI_IOC_SAMPLER_START returned %ld\n", ret);
+		return 1;
+	}
+
+	for (;;) {
+		if (!stopped && res->samples >= work->count) {
+			ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_SAMPLER_STOP, 0);
+			if (ret) {
+				fprintf(stderr, "sim: STZ_SPI_IOC_SAMPLER_STOP returned %ld\n", ret);
+				return 1;
+			}
+			stopped = true;
+		}
+		if (!stopped) {
+			sim_wait((uint64_t) work->read_every_us * 1000);
+		}
+		ret = fops->read(&file, (char __user *) buf, buf_size, &file.f_pos);
+		if (ret == 0 && stopped) {
+			break;
+		}
+		if (ret == -EAGAIN && !stopped) {
+			res->eagain++;
+			continue;
+		}
+		if (ret <= 0 || ret % record_size) {
+			fprintf(stderr, "sim: read of the sample records returned %ld\n", ret);
+			return 1;
+		}
+		res->reads++;
+		for (long off = 0; off < ret; off += record_size) {
+			const struct stz_spi_sample *sample = (const void *) (buf + off);
+			const uint8_t *data = buf + off + sizeof(*sample);
+
+			if (res->samples) {
+				uint32_t periods = sample->seq - last_seq;
+				uint64_t expected = last_ns + periods * period_ns;
+				uint64_t jitter = sample->timestamp_ns > expected ? sample->timestamp_ns - expected : expected - sample->timestamp_ns;
+
+				res->sample_gaps += periods - 1;
+				res->sample_jitter_ns = max(res->sample_jitter_ns, jitter);
+			}
+			last_ns = sample->timestamp_ns;
+			last_seq = sample->seq;
+			res->sample_overruns = sample->overruns;
+			res->samples++;
+			res->rx_total += work->size;
+			for (size_t i = 0; i < work->size; i++) {
+				res->rx_match += data[i] == (uint8_t) tx[i];
+			}
+		}
+	}
+	res->tx_total = (uint64_t) res->samples * work->size;
+
+	if (fops->release) {
+		fops->release(&inode, &file);
+	}
+	free(buf);
+	sim_idle();
+	return 0;
+}
+
+static int run_stream(const struct workload *work, char *rx, struct result *res)
+{
+	/*
+		Opens /dev/spi<cs> in receive-only streaming mode (STZ_SPI_IOC_RX_STREAM) with the --fill byte;
+		each transfer is one read() of size bytes, which clocks the fill byte. The loopback slave echoes it,
+		the pattern slave sends its counter.
+	*/
+	const struct file_operations *fops = sim.cdev->ops;
+	struct inode inode = { .i_rdev = MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work->cs), .i_cdev = sim.cdev };
+	struct file file = { .f_op = fops };
+	__u32 rx_stream = STZ_SPI_RX_STREAM | work->fill;
+	size_t done;
+	long ret;
+
+	if (open_cs(work, &inode, &file)) {
+		return 1;
+	}
+	ret = fops->unlocked_ioctl(&file, STZ_SPI_IOC_RX_STREAM, (unsigned long) (uintptr_t) &rx_stream);
+	if (ret) {
+		fprintf(stderr, "sim: STZ_SPI_IOC_RX_STREAM returned %ld\n", ret);
+		return 1;
+	}
+
+	for (unsigned int n = 0; n < work->count; n++) {
+		// Reads longer than STZ_SPI_MAX_STREAM_READ return less, read the rest
+		for (done = 0; done < work->size; done += ret) {
+			ret = fops->read(&file, (char __user *) rx + done, work->size - done, &file.f_pos);
+			if (ret <= 0) {
+				fprintf(stderr, "sim: streaming read returned %ld\n", ret);
+				return 1;
+			}
+			res->reads++;
+		}
+		res->rx_total += work->size;
+		for (size_t i = 0; i < work->size; i++) {
+			res->rx_match += (uint8_t) rx[i] == work->fill;
+		}
+	}
+
+	if (fops->release) {
+		fops->release(&inode, &file);
+	}
+	sim_idle();
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_config config = {
+		.spi = {
+			.fifo_depth = 8,
+			.clk_hz = 16000000,
+			.sck_hz = 1000000,
+			.num_cs = 2,
+			.slave = FE310_SLAVE_LOOPBACK,
+			.flash_size = 1 << 20,
+		},
+		.mmio_ns = 50,
+		.irq_ns = 2000,
+		.thread_ns = 4000,
+		.has_irq = true,
+	};
+	struct workload work = { .api = API_CDEV, .cs = 0, .size = 32, .count = 4, .segments = 1, .files = 1, .cmd_len = 1, .lines = 1, .word_delay = -1,
+		.period_us = 100, .fill = 0xff };
+	struct result res = { 0 };
+
+	parse_args(argc, argv, &config, &work);
+	if (work.api == API_SAMPLE && work.read_every_us == 0) {
+		work.read_every_us = 16 * work.period_us;
+	}
+	sim_init(&config);
+
+	if (sim_module_init_fn() != 0 || sim.driver == NULL || sim.cdev == NULL) {
+		fprintf(stderr, "sim: driver failed to load\n");
+		return 1;
+	}
+
+	char *tx = malloc(work.size);
+	char *rx = calloc(1, work.size + 4096);		// drivers may return more than was asked for
+
+	for (size_t i = 0; i < work.size; i++) {
+		tx[i] = work.binary ? (char) i : 'A' + (i % 26);
+	}
+	if (!work.binary) {
+		tx[work.size - 1] = '\n';
+	}
+
+	struct fe310_spi_stats start_hw = sim.spi.stats;
+	struct sim_stats start_sim = sim.stats;
+	uint64_t start = sim.now;
+
+	bool compared = false;
+	uint64_t rx_dropped = 0;		// received bytes dropped by the driver's full receive rings
+	int ret;
+	switch (work.api) {
+	case API_SPI: ret = run_spi(&work, tx, rx, &res); break;
+	case API_IOCTL: ret = run_ioctl(&work, tx, rx, &res); break;
+	case API_AIO: ret = run_aio(&work, tx, &res); break;
+	case API_MMAP: ret = run_mmap(&work, tx, &res); break;
+	case API_DIRMAP: ret = run_dirmap(&work, rx, &res); break;
+	case API_WRITE_READ: ret = run_write_read(&work, rx, &res); break;
+	case API_SAMPLE: ret = run_sample(&work, tx, &res); break;
+	case API_STREAM: ret = run_stream(&work, rx, &res); break;
+	default: ret = run_cdev(&work, tx, rx, &res); break;
+	}
+	if (ret) {
+		return ret;
+	}
+
+	uint64_t elapsed = sim.now - start;
+	uint64_t frames = sim.spi.stats.frames - start_hw.frames;
+	uint64_t reads = sim.spi.stats.reg_reads - start_hw.reg_reads;
+	uint64_t writes = sim.spi.stats.reg_writes - start_hw.reg_writes;
+	uint64_t irqs = sim.stats.irqs - start_sim.irqs;
+	double seconds = elapsed / 1e9;
+
+	printf("config:      fifo depth %u, sck %lu Hz, mmio %llu ns, irq %llu ns%s\n",
+		config.spi.fifo_depth, fe310_spi_sck_hz(&sim.spi),
+		(unsigned long long) config.mmio_ns, (unsigned long long) config.irq_ns,
+		config.has_irq ? "" : ", no irq line");
+	static const char *const api_names[] = { "/dev/spiN", "spi_sync", "ioctl", "aio", "mmap", "spi-mem dirmap", "write_read", "sampler", "streaming read" };
+	printf("workload:    %u x %zu B on cs %u via %s", work.count, work.size, work.cs, api_names[work.api]);
+	if (work.api == API_IOCTL) {
+		printf(" (%u segments)", work.segments);
+	}
+	if (work.api == API_DIRMAP || (work.api == API_IOCTL && work.lines > 1)) {
+		printf(" (%u data lines)", work.lines);
+	}
+	if (work.api == API_WRITE_READ) {
+		printf(" (responses, %u byte commands)", config.spi.slave == FE310_SLAVE_FLASH ? 4 : work.cmd_len);
+	}
+	printf("\n");
+	printf("bytes:       written %llu, clocked %llu, read %llu",
+		(unsigned long long) res.tx_total, (unsigned long long) frames, (unsigned long long) res.rx_total);
+	if (config.spi.slave == FE310_SLAVE_LOOPBACK) {
+		printf(", loopback match %llu", (unsigned long long) res.rx_match);
+		compared = true;
+	}
+	if (work.api == API_DIRMAP || (work.api == API_WRITE_READ && config.spi.slave == FE310_SLAVE_FLASH)) {
+		printf(", flash match %llu", (unsigned long long) res.rx_match);
+		compared = true;
+	}
+	printf("\n");
+	if (work.api == API_CDEV) {
+		printf("poll:        readable after %u of %u writes", res.poll_ready, work.count);
+		if (work.nonblock) {
+			printf(", %u empty non-blocking reads returned -EAGAIN", res.eagain);
+		}
+		printf("\n");
+	}
+	if (work.api == API_CDEV && res.rx_reads) {
+		printf("             %u writes cut short or refused by the full receive ring and continued after a read\n", res.rx_reads);
+	}
+	if (work.api == API_CDEV && work.txn_parts) {
+		printf("txn:         %u of %u transactions ended by STZ_SPI_IOC_TXN_END, %u by the idle timeout\n",
+			res.txn_ended, work.count, res.txn_timed_out);
+	}
+	if (work.api == API_AIO) {
+		printf("aio:         %u of %u writes queued, up to %u in flight\n", res.aio_queued, work.count * work.files, res.aio_max_in_flight);
+		if (work.files > 1) {
+			printf("             %u files, at most %u completions in a row from one file\n", work.files, res.aio_longest_run);
+		}
+	}
+	if (work.api == API_SAMPLE) {
+		printf("sample:      %u records every %u us in %u reads, %u periods missing, %u lost by the driver, jitter max %.3f us\n",
+			res.samples, work.period_us, res.reads, res.sample_gaps, res.sample_overruns, res.sample_jitter_ns / 1e3);
+	}
+	if (work.api == API_STREAM) {
+		printf("stream:      %u reads, fill 0x%02x\n", res.reads, work.fill);
+	}
+	if (work.api == API_MMAP) {
+		printf("mmap:        %u doorbells\n", res.kicks);
+	}
+	if (work.api == API_DIRMAP) {
+		printf("dirmap:      %s, %llu flash window reads\n",
+			res.dirmap ? "served in flash mode" : "sent as spi_messages",
+			(unsigned long long) (sim.spi.stats.flash_reads - start_hw.flash_reads));
+	}
+	printf("time:        %.3f us virtual, bus busy %.1f%%\n", elapsed / 1e3,
+		elapsed ? 100.0 * (sim.spi.stats.busy_ns - start_hw.busy_ns) / elapsed : 0.0);
+	printf("throughput:  %.0f B/s clocked, %.0f B/s read\n",
+		seconds > 0 ? frames / seconds : 0.0, seconds > 0 ? res.rx_total / seconds : 0.0);
+	printf("interrupts:  %llu (%.2f per transfer, %.3f per byte)\n", (unsigned long long) irqs,
+		work.count ? (double) irqs / work.count : 0.0, frames ? (double) irqs / frames : 0.0);
+	printf("             %llu threaded handler runs\n", (unsigned long long) (sim.stats.irq_threads - start_sim.irq_threads));
+	if (sim.cdev->ops->unlocked_ioctl) {
+		// Counters of the controller, read through its first file
+		struct inode inode = { .i_rdev = sim.cdev->dev, .i_cdev = sim.cdev };
+		struct file file = { .f_op = sim.cdev->ops, .f_inode = &inode };
+		struct stz_spi_stats stats;
+		if (sim.cdev->ops->open(&inode, &file) != 0) {
+			return 1;
+		}
+		if (sim.cdev->ops->unlocked_ioctl(&file, STZ_SPI_IOC_STATS, (unsigned long) (uintptr_t) &stats) == 0) {
+			printf("driver:      %llu transfers, %llu bytes, %llu irqs (%.1f per KB), last transfer %u bytes %u irqs\n",
+				(unsigned long long) stats.transfers, (unsigned long long) stats.bytes, (unsigned long long) stats.irqs,
+				stats.bytes ? 1024.0 * stats.irqs / stats.bytes : 0.0, stats.last_bytes, stats.last_irqs);
+			printf("             %llu polled, %llu interrupt driven\n",
+				(unsigned long long) stats.polled_transfers, (unsigned long long) stats.irq_transfers);
+			printf("             busy %.3f us, %.3f us of SCK cycles (%.1f%% bus utilization, %.0f bit/s)\n",
+				stats.busy_ns / 1e3, stats.clocked_ns / 1e3, stats.busy_ns ? 100.0 * stats.clocked_ns / stats.busy_ns : 0.0,
+				stats.busy_ns ? 8e9 * stats.bytes / stats.busy_ns : 0.0);
+			printf("             %llu received bytes dropped (receive ring full), %llu waits for room in it\n",
+				(unsigned long long) stats.rx_overruns, (unsigned long long) stats.rx_stalls);
+			rx_dropped = stats.rx_overruns;
+			if (stats.stream_bytes) {
+				printf("             %llu bytes streamed in %.3f us (%.0f B/s sustained)\n",
+					(unsigned long long) stats.stream_bytes, stats.stream_ns / 1e3, stats.stream_ns ? 1e9 * stats.stream_bytes / stats.stream_ns : 0.0);
+			}
+		}
+		sim.cdev->ops->release(&inode, &file);
+	}
+	printf("mmio:        %llu reads, %llu writes (%.2f per byte)\n",
+		(unsigned long long) reads, (unsigned long long) writes, frames ? (double) (reads + writes) / frames : 0.0);
+	printf("hw events:   %llu rx overruns, %llu tx overflows, %llu cs assertions\n",
+		(unsigned long long) (sim.spi.stats.rx_overruns - start_hw.rx_overruns),
+		(unsigned long long) (sim.spi.stats.tx_overflows - start_hw.tx_overflows),
+		(unsigned long long) (sim.spi.stats.cs_assertions - start_hw.cs_assertions));
+	printf("printk:      %llu calls, %llu trace events\n", (unsigned long long) (sim.stats.printks - start_sim.printks),
+		(unsigned long long) (sim.stats.trace_events - start_sim.trace_events));
+	print_cs_sysfs(MKDEV(MAJOR(sim.cdev->dev), MINOR(sim.cdev->dev) + work.cs));
+
+	sim_module_exit_fn();
+	sim_cleanup();
+	free(tx);
+	free(rx);
+
+	// A regression check: the bytes read back must all match what the slave sent, and none may be lost
+	if (compared && res.rx_match != res.rx_total) {
+		fprintf(stderr, "sim: %llu of %llu bytes read back do not match\n",
+			(unsigned long long) (res.rx_total - res.rx_match), (unsigned long long) res.rx_total);
+		return 1;
+	}
+	if (rx_dropped) {
+		fprintf(stderr, "sim: %llu received bytes dropped by the full receive ring\n", (unsigned long long) rx_dropped);
+		return 1;
+	}
+	return 0;
+}
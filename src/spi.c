@@ -1,19 +1,42 @@
 /*
-	File: spi_nointerrupt.c
+	File: spi.c
 	Authors: Salman, Tayyab, Zawaher
 	Last updated:
-	Description: Linux driver for SPI with interrupts.
+	Description: Linux driver for SPI. Short transfers are polled, long transfers are interrupt driven.
 */
 
 #include <linux/module.h>
 #include <linux/device.h>
 #include <linux/platform_device.h>
 #include <linux/spi/spi.h>
+#include <linux/spi/spi-mem.h>
+#include <linux/io.h>
 #include <linux/proc_fs.h>
 #include <linux/fs.h>
 #include <linux/kdev_t.h>
 #include <linux/cdev.h>
 #include <linux/interrupt.h>
+#include <linux/mutex.h>
+#include <linux/clk.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/property.h>
+#include <linux/idr.h>
+#include <linux/hrtimer.h>
+#include "stz_spi.h"
+#define CREATE_TRACE_POINTS
+#include "stz_spi_trace.h"
 
 // SPI register offsets
 #define SPI_SCK_DIV_R   0x00 // Serial clock divisor
@@ -34,7 +57,14 @@
 #define SPI_IP_R        0x74 // SPI interrupt pending
 
 // Parameters
-#define MSG_BUFFER_SIZE					256
+#define MSG_BUFFER_SIZE					256			// bytes copied from/to user space at a time
+#define NUM_CS							2			// chip select lines, if the device tree has no num-cs
+#define MAX_CS							32			// bits of CS_DEF
+#define FIFO_DEPTH						8			// tx/rx fifo depth in frames, if neither the device tree nor the watermark registers give it
+#define MAX_FIFO_DEPTH					256
+#define RX_RING_MIN						(MSG_BUFFER_SIZE + MAX_FIFO_DEPTH)	// rx_ring holds a chunk of a write and the frames in flight
+#define LATENCY_BUCKETS					16			// transfer latency histogram: < 1 us, then powers of two up to 2^14 us and more
+#define POLL_TIMEOUT_NS					NSEC_PER_MSEC	// a polled transfer whose fifo does not move for this long after its frames can have been clocked has timed out
 
 // SPI register bit fields
 #define CLK_POLARITY_HIGH 				1
@@ -43,58 +73,360 @@
 #define CLK_PHASE_SAMPLE_TRAIL_EDGE 	1
 #define CS_HIGH_INACTIVE_STATE 			0
 #define CS_LOW_INACTIVE_STATE 			1
-#define CS_MODE_AUTO 				    00
-#define CS_MODE_HOLD 				    10
-#define CS_MODE_OFF 				    11
-#define PROTOCOL_SINGLE 				00
+#define CS_MODE_AUTO 				    0
+#define CS_MODE_HOLD 				    2
+#define CS_MODE_OFF 				    3
+#define PROTOCOL_SINGLE 				0
+#define PROTOCOL_DUAL 					1
+#define PROTOCOL_QUAD 					2
+#define FMT_PROTO_MASK					0x3
+#define FMT_DIR_TX						0x8			// frames are not received: dual/quad data lines are driven
 #define MSB_ENDIANNESS 					0
 #define LSB_ENDIANNESS 					1
-#define INTERRUPT_TX 					01
-#define INTERRUPT_RX 					10
+#define SCK_POLARITY_SHIFT				1
+#define FMT_ENDIANNESS_SHIFT			2
+#define FMT_LENGTH_SHIFT				16
+#define FRAME_LENGTH					8
+#define INTERRUPT_TX 					0x1
+#define INTERRUPT_RX 					0x2
 #define TX_FIFO_FULL					0x80000000
 #define RX_FIFO_EMPTY					0x80000000
 #define SPI_DATA						0x000000FF
+#define SCK_DIV_MASK					0x00000FFF
+#define DELAY_MASK						0xFF		// each delay field counts SCK cycles
+#define DELAY0_SCKCS_SHIFT				16			// DELAY_0: cssck bits 7:0, sckcs bits 23:16
+#define DELAY1_INTERXFR_SHIFT			16			// DELAY_1: intercs bits 7:0, interxfr bits 23:16
+#define FCTRL_FLASH_MODE				0x1			// reads of the flash window are served by the controller
+#define FFMT_CMD_EN						0x1
+#define FFMT_ADDR_LEN_SHIFT				1
+#define FFMT_PAD_CNT_SHIFT				4
+#define FFMT_CMD_PROTO_SHIFT			8
+#define FFMT_ADDR_PROTO_SHIFT			10
+#define FFMT_DATA_PROTO_SHIFT			12
+#define FFMT_CMD_CODE_SHIFT				16
+#define FFMT_MAX_ADDR_LEN				4			// address bytes
+#define FFMT_MAX_PAD_CNT				15			// dummy cycles
 
 // Definations
-#define BASEADDRESS     				spi_device->base_address
-#define EOT								'\0'		// end of transmission char
+#define BASEADDRESS     				spi_device->base_address		// registers of the controller the function works on
 #define NO_ERROR        				0
 #define ERROR           				1
+#define XFER_CDEV						0			// transfer owners: /dev/spiN read/write/ioctl
+#define XFER_CORE						1			// spi_transfer queued by the SPI core
+#define XFER_ASYNC						2			// asynchronous /dev/spiN write or sampler transfer
 
 // Function definations
+struct spi_device_state;
+struct spi_cs_state;
+struct driver_cs_stats;
+struct driver_client;
+struct driver_request;
+struct driver_file;
+struct driver_sampler;
 static int __init spi_init(void);
 static void spi_exit(void);
 static int spi_probe(struct platform_device *pdev);
 static int spi_remove(struct platform_device *pdev);
+static void spi_destroy_files(struct spi_device_state *spi_device);
+static void spi_free_rings(struct spi_device_state *spi_device);
 static int driver_open(struct inode *inode, struct file *file_ptr);
+static int driver_proc_open(struct inode *inode, struct file *file_ptr);
+static int driver_file_alloc(struct file *file_ptr, struct spi_cs_state *cs_state);
 static int driver_close(struct inode *inode, struct file *file_ptr);
 static ssize_t driver_read (struct file *file_pointer, char __user *user_space_buffer, size_t count, loff_t *offset);
 static ssize_t driver_write (struct file *file_pointer, const char *user_space_buffer, size_t count, loff_t *offset);
-static void device_write(void);
-static void device_read(void);
+static ssize_t driver_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t driver_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t driver_read_ring(struct file *file_pointer, struct iov_iter *to, char nowait);
+static ssize_t driver_read_stream(struct driver_file *file, struct iov_iter *to);
+static ssize_t driver_write_stream(struct file *file_pointer, struct iov_iter *from);
+static ssize_t driver_write_async(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t driver_bus_get_room(struct driver_file *file, size_t len, char nowait);
+static uint driver_rx_room(struct spi_cs_state *cs_state);
+static __poll_t driver_poll(struct file *file_pointer, poll_table *wait);
+static long driver_ioctl(struct file *file_pointer, unsigned int cmd, unsigned long arg);
+static int driver_mmap(struct file *file_pointer, struct vm_area_struct *vma);
+static struct driver_mmap_ring *driver_mmap_alloc(struct file *file_pointer);
+static long driver_mmap_kick(struct file *file_pointer);
+static struct spi_cs_state *driver_cs(struct file *file_pointer);
+static struct driver_file *driver_file(struct file *file_pointer);
+static int driver_set_config(struct spi_cs_state *cs_state, const struct stz_spi_config *config);
+static void driver_get_config(struct spi_cs_state *cs_state, struct stz_spi_config *config);
+static void driver_cs_stats_get(struct device *dev, struct driver_cs_stats *stats);
+static int driver_transfer_segment(struct driver_file *file, const struct stz_spi_segment *segment);
+static long driver_write_read(struct driver_file *file, const struct stz_spi_write_read *write_read);
+static void driver_bus_get(struct driver_file *file);
+static void driver_bus_put(struct driver_file *file);
+static long driver_txn_begin(struct driver_file *file, u32 idle_us);
+static long driver_txn_end(struct driver_file *file);
+static void driver_txn_touch(struct driver_file *file);
+static enum hrtimer_restart driver_txn_timeout(struct hrtimer *timer);
+static long driver_sampler_start(struct driver_file *file, const struct stz_spi_sampler *config);
+static long driver_sampler_stop(struct driver_file *file);
+static void driver_sampler_free(struct driver_sampler *sampler);
+static enum hrtimer_restart driver_sampler_timer(struct hrtimer *timer);
+static void driver_sampler_store(struct driver_sampler *sampler, u64 start_ns);
+static ssize_t driver_sampler_read(struct driver_sampler *sampler, struct iov_iter *to, char nowait);
+static void device_set_speed(struct spi_device_state *spi_device, u32 speed_hz);
+static uint device_sck_div(struct spi_device_state *spi_device, u32 speed_hz);
+static void device_mode_regs(u32 mode, uint *sck_mode, uint *fmt);
+static void device_set_cs_polarity(struct spi_device_state *spi_device, uint cs, char cs_high);
+static void device_select_cs(struct spi_cs_state *cs_state);
+static void device_set_sck_div(struct spi_device_state *spi_device, uint sck_div);
+static uint device_lanes_proto(uint lanes);
+static void device_set_fmt(struct spi_device_state *spi_device, uint fmt);
+static void device_set_ie(struct spi_device_state *spi_device, uint ie);
+static void device_set_delays(struct spi_device_state *spi_device, uint delay0, uint delay1);
+static void device_set_cs_mode(struct spi_device_state *spi_device, uint cs_mode);
+static void device_write(struct spi_device_state *spi_device);
+static void device_read(struct spi_device_state *spi_device, uint ready);
+static uint device_fifo_depth(struct spi_device_state *spi_device, struct device *dev);
+static uint device_batch(struct spi_device_state *spi_device);
 inline long read_from_reg(void __iomem *address);
 inline void write_to_reg(void __iomem *address, unsigned long data);
-static irqreturn_t spi_interrupt_handler(int irq, void* spi_device);
+static irqreturn_t spi_interrupt_handler(int irq, void* dev_id);
+static irqreturn_t spi_interrupt_thread(int irq, void* dev_id);
+static void device_bus_lock(struct spi_device_state *spi_device, struct driver_client *client);
+static void device_bus_unlock(struct spi_device_state *spi_device);
+static void device_bus_queue(struct spi_device_state *spi_device, struct driver_request *request);
+static void device_bus_schedule(struct spi_device_state *spi_device);
+static void device_async_start(struct spi_device_state *spi_device, struct driver_request *request);
+static void device_async_complete(struct spi_device_state *spi_device);
+static void device_transfer_start(struct spi_device_state *spi_device, u8 *rx_buf, struct spi_cs_state *rx_cs, uint len, uint lanes, char owner);
+static void device_transfer_init(struct spi_device_state *spi_device, u8 *rx_buf, struct spi_cs_state *rx_cs, uint len, uint lanes, char owner);
+static void device_transfer_append(struct spi_device_state *spi_device, const u8 *tx_buf, uint len);
+static void device_transfer_finish(struct spi_device_state *spi_device);
+static int device_transfer_poll(struct spi_device_state *spi_device, char until_done);
+static int device_transfer_abort(struct spi_device_state *spi_device);
+static char device_transfer_done(struct spi_device_state *spi_device);
+static void device_transfer_complete(struct spi_device_state *spi_device);
+static void device_set_rx_mark(struct spi_device_state *spi_device);
+static int controller_setup(struct spi_device *device);
+static int controller_prepare_message(struct spi_controller *controller, struct spi_message *message);
+static int controller_unprepare_message(struct spi_controller *controller, struct spi_message *message);
+static void controller_set_cs(struct spi_device *device, bool is_high);
+static int controller_transfer_one(struct spi_controller *controller, struct spi_device *device, struct spi_transfer *transfer);
+static void controller_handle_err(struct spi_controller *controller, struct spi_message *message);
+static void controller_select_slave(struct spi_device_state *spi_device, struct spi_device *device);
+static int controller_set_cs_timing(struct spi_device *device);
+static uint controller_delay_cycles(struct spi_device_state *spi_device, struct spi_delay *delay, uint cycles);
+static int controller_dirmap_create(struct spi_mem_dirmap_desc *desc);
+static ssize_t controller_dirmap_read(struct spi_mem_dirmap_desc *desc, u64 offs, size_t len, void *buf);
+static int controller_flash_format(const struct spi_mem_op *op, u32 *ffmt);
 
 // Structures
 
+// Request for the bus: an asynchronous write or the transfer of a sampler, sent by the scheduler itself,
+// or a process waiting to use the bus (iocb and sampler NULL), which has it until device_bus_unlock
+struct driver_request {
+	struct list_head list;
+	struct driver_client *client;
+	struct kiocb *iocb;
+	struct driver_sampler *sampler;
+	struct completion granted;			// process waiting: the bus is granted
+	struct spi_cs_state *cs_state;
+	struct spi_cs_state *rx_cs;			// asynchronous write: CS line whose rx_ring stores the response, or NULL
+	uint len;
+	u8 *tx_buf;							// data of an asynchronous write or sampler transfer, allocated after the request
+};
+
+// Client of the bus: an open /dev/spiN or /proc file, or the SPI core.
+// The bus scheduler serves the clients with requests in turn, one request each. Protected by xfer_lock
+struct driver_client {
+	struct list_head sched;				// in bus_clients while the client has requests
+	struct list_head requests;			// driver_requests, served in order
+	uint async_queued;					// asynchronous writes among them, or being sent
+	struct driver_request lock_request;	// request of device_bus_lock, the bus owner until device_bus_unlock
+};
+
+// Open /dev/spiN or /proc file
+struct driver_file {
+	struct spi_cs_state *cs_state;
+	struct driver_client client;
+	struct spi_cs_state *rx_cs;			// cs_state if the file was opened for reading, NULL: its writes discard what they receive
+	struct mutex io_lock;				// serializes the calls of the file that use tx_buffer and rx_buffer
+	u8 tx_buffer[MSG_BUFFER_SIZE];		// data on its way to the fifo, filled before the bus is taken
+	u8 rx_buffer[MSG_BUFFER_SIZE];		// data on its way to user space
+
+	// Transaction, from STZ_SPI_IOC_TXN_BEGIN to STZ_SPI_IOC_TXN_END. Protected by xfer_lock
+	char txn_open;
+	char txn_held;						// the file keeps the bus between its calls, with CS asserted
+	uint txn_busy;						// calls of the file using the bus, the idle timeout waits for them
+	char txn_timed_out;					// the idle timeout ended the last transaction
+	u64 txn_idle_ns;
+	struct hrtimer txn_timer;			// idle timeout, runs while the file keeps the bus and no call uses it
+
+	struct driver_sampler *sampler;		// set by STZ_SPI_IOC_SAMPLER_START, freed with the file
+	u32 rx_stream;						// STZ_SPI_IOC_RX_STREAM argument: read() clocks its own data with STZ_SPI_RX_STREAM
+};
+
+// Periodic sampling of a file's CS line: a timer queues the canned transfer every period, with its own
+// client of the bus scheduler, and the interrupt thread stores each response in the ring as a record.
+// Protected by xfer_lock, except the ring, which has one writer (under xfer_lock) and readers under read_lock
+struct driver_sampler {
+	struct driver_client client;
+	struct driver_request *request;		// the canned transfer, its tx_buf holds the template and zeros
+	struct hrtimer timer;
+	u64 period_ns;
+	uint rx_skip;
+	uint rx_len;
+	uint record_size;					// STZ_SPI_SAMPLE_SIZE(rx_len)
+	u8 *rx_buf;							// response of the transfer in flight, request->len bytes
+	struct kfifo ring;					// records waiting to be read
+	struct mutex read_lock;
+	wait_queue_head_t wait;				// readers, and driver_sampler_stop waiting for the last transfer
+	u8 read_buffer[MSG_BUFFER_SIZE];	// records on their way to user space, used under read_lock
+	char running;
+	char pending;						// the transfer is queued or in flight
+	u32 seq;							// number of the next period
+	u32 request_seq;					// number of the period of the pending transfer
+	u32 overruns;						// samples lost since the start
+};
+
+// Rings shared with user space by mmap, one per CS line
+struct driver_mmap_ring {
+	struct stz_spi_mmap_ring *shared;	// header page, followed by the tx and rx data areas
+	u8 *tx_data;
+	u8 *rx_data;
+	u32 size;							// bytes in each data area
+	ulong map_size;
+	u32 tx_tail;						// driver copies of the indexes it owns, user space may overwrite the shared ones
+	u32 rx_head;
+};
+
+// Transfer counters of a CS line, shown in the sysfs directory of its /dev/spiN file.
+// Updated when a transfer completes, under xfer_lock
+struct driver_cs_stats {
+	u64 tx_bytes;						// frames sent
+	u64 rx_bytes;						// frames received
+	u64 transfers;
+	u64 irqs;							// interrupts taken by the transfers
+	u64 tx_stalls;						// times tx data had to wait for room in the tx fifo
+	u64 rx_overruns;					// received bytes dropped because rx_ring was full
+	u64 rx_stalls;						// times writes waited for room in rx_ring, or were refused for lack of it
+	u64 latency[LATENCY_BUCKETS];		// transfers by time from start to end: bucket 0 under 1 us, bucket i from 2^(i-1) us
+};
+
+// Context of a CS line: its configuration, programmed into the controller when the bus switches to the line,
+// and the buffers of its /dev/spiN file
+struct spi_cs_state {
+	struct spi_device_state *spi_device;	// controller of the line
+	uint cs;							// CS_ID value
+	int file_no;						// N of /dev/spiN, negative if the file could not be created
+	u32 mode;							// STZ_SPI_* mode bits
+	uint sck_div;						// SCK_DIV value
+	uint sck_mode;						// SCK_MODE value
+	uint fmt;							// FMT value
+	uint delay0;						// DELAY_0 value
+	uint delay1;						// DELAY_1 value
+	struct mutex rx_lock;				// serializes readers of rx_ring
+	struct kfifo rx_ring;				// bytes received by writes, waiting to be read
+	wait_queue_head_t rx_wait;			// readers waiting for rx_ring
+	wait_queue_head_t rx_room_wait;		// writers waiting for room in rx_ring
+	uint rx_reserved;					// room of rx_ring reserved by the writes queued or being sent, under xfer_lock
+	u8 rx_read_buffer[MSG_BUFFER_SIZE];	// rx_ring data on its way to user space, used under rx_lock
+	struct driver_mmap_ring mmap_ring;
+	struct driver_cs_stats stats;
+};
+
+// State of one controller instance, found from its files, interrupt, platform device and spi_controller
 struct spi_device_state {
+	int id;								// instance number, names the /proc file
+	char proc_name[24];
+	struct proc_dir_entry *proc_node;
 	dev_t major_no;
 	struct cdev cdev;
-	struct class *dev_class;
     void __iomem *base_address;
-	
-	char data_tx_available;
-	char data_rx_available;
-	uint rx_index;
-	uint tx_index;
-	uint user_rx_index;
-	uint user_tx_index;
-	char rx_data_buffer[MSG_BUFFER_SIZE];
-	char tx_data_buffer[MSG_BUFFER_SIZE];
+	struct clk *clk;					// controller input clock, divided down to SCK, NULL if the rate comes from clock-frequency
+	ulong clk_rate;						// input clock rate in Hz, read at probe
+	uint sck_div;						// SCK_DIV value programmed in the controller
+	ulong sck_period_ns;
+	uint cs_id;							// CS_ID value programmed in the controller
+	uint delay0;						// DELAY_0 value programmed in the controller
+	uint delay1;						// DELAY_1 value programmed in the controller
+	uint cs_mode;						// CS_MODE value programmed in the controller
+	int irq;							// negative if the device has no interrupt line
+	struct spi_controller *controller;
+	void __iomem *flash_base;			// memory-mapped flash window, NULL if the device has none
+	u64 flash_size;
+	uint cs_inactive;					// CS_DEF value: inactive level of each CS line
+	uint fmt;							// FMT value
+	uint num_cs;
+	struct spi_cs_state *cs_states;		// one per CS line
+	struct spi_cs_state *cs_current;	// context programmed into the controller, NULL after the SPI core used it
+
+	// Transfer in progress
+	spinlock_t xfer_lock;				// shared with the interrupt handler
+	struct completion xfer_tx_done;		// tx buffer written to tx fifo
+	struct completion xfer_done;		// /dev/spiN transfer received
+	char xfer_active;
+	char xfer_end;						// no more tx data will be appended
+	char xfer_owner;					// XFER_CDEV, XFER_CORE or XFER_ASYNC
+	char xfer_poll;						// moved by polling instead of by the interrupt handler
+	uint xfer_lanes;					// data lines: 1, or 2 and 4 for half-duplex dual and quad transfers
+	char xfer_dir_tx;					// transmit only: frames leave the tx fifo but are not received
+	const u8 *xfer_tx_buf;				// tx data not yet written to the fifo (NULL sends xfer_tx_fill)
+	u8 xfer_tx_fill;					// byte sent without tx data, 0 unless set after device_transfer_start
+	char xfer_stream;					// receive-only streaming read, counted in the stream stats
+	uint xfer_tx_len;
+	uint xfer_tx_index;
+	char xfer_tx_busy;					// xfer_tx_buf is still in use
+	u8 *xfer_rx_buf;					// received data goes to xfer_rx_buf or to the rx_ring of xfer_rx_cs
+	struct spi_cs_state *xfer_rx_cs;
+	uint xfer_rx_skip;					// frames received before this one are discarded (command echoes)
+	uint xfer_tx_count;					// frames written to tx fifo
+	uint xfer_rx_count;					// frames read from rx fifo
+	uint xfer_irqs;						// interrupts taken by the transfer
+	u64 xfer_start_ns;					// ktime of device_transfer_init, for the busy time of the stats
+	u64 xfer_rx_ready_ns;				// polled transfers: earliest ktime the next batch can be received
+	int xfer_error;						// -ETIMEDOUT once a polled transfer has timed out, or 0
+	char xfer_tx_stalled;				// the last device_write found the tx fifo full
+	uint xfer_tx_stalls;				// tx fifo full stalls of the transfer
+	uint xfer_rx_overruns;				// bytes of the transfer dropped because rx_ring was full
+	uint fifo_depth;					// tx/rx fifo depth in frames
+	uint rx_mark;						// RX_MARK value
+	uint tx_mark;						// TX_MARK value
+	uint xfer_ie;						// IE value
+	struct stz_spi_stats stats;
+
+	// Bus scheduler, protected by xfer_lock: the fifos are used by one request at a time
+	struct list_head bus_clients;		// driver_clients with requests, in the order they are served
+	struct driver_request *bus_owner;	// request the bus is granted to, NULL if it is free
+	struct driver_client core_client;	// spi_messages of the SPI core and spi-mem reads
+
+	struct mutex mmap_lock;				// serializes allocation of the mmap rings
 };
 
-static struct spi_device_state *spi_device;
+// Shared by the controller instances
+static struct class *spi_class;
+static DEFINE_IDA(spi_instance_ida);				// instance numbers
+static DEFINE_IDA(spi_file_ida);					// N of the /dev/spiN files, numbered across the instances
+
+// Module parameters
+static uint rx_ring_size = 4096;
+module_param(rx_ring_size, uint, 0444);
+MODULE_PARM_DESC(rx_ring_size, "Bytes of received data buffered for read(), rounded up to a power of two of at least 512");
+static uint irq_batch = 0;
+module_param(irq_batch, uint, 0644);
+MODULE_PARM_DESC(irq_batch, "Frames received per interrupt or polled batch (1 to the fifo depth, 0 for half of it); larger batches take fewer interrupts but leave less tx data queued");
+static uint poll_threshold_us = 50;
+module_param(poll_threshold_us, uint, 0644);
+MODULE_PARM_DESC(poll_threshold_us, "Transfers expected to take less than this (length x SCK period) are polled, longer ones use interrupts");
+static uint async_queue_depth = 16;
+module_param(async_queue_depth, uint, 0644);
+MODULE_PARM_DESC(async_queue_depth, "Asynchronous writes (aio, io_uring) queued at a time on each file; more submissions fail with EAGAIN");
+static uint async_max_write = 65536;
+module_param(async_max_write, uint, 0644);
+MODULE_PARM_DESC(async_max_write, "Bytes of an asynchronous write, which the driver copies to kernel memory; larger submissions fail with EMSGSIZE");
+static uint mmap_ring_size = 65536;
+module_param(mmap_ring_size, uint, 0444);
+MODULE_PARM_DESC(mmap_ring_size, "Bytes in each data area of the rings shared by mmap, rounded up to a power of two of at least a page");
+static uint rx_backpressure = 1;
+module_param(rx_backpressure, uint, 0644);
+MODULE_PARM_DESC(rx_backpressure, "Writes only send what the receive ring of their CS line has room for, waiting for it (1), instead of dropping the bytes received while it is full (0)");
+static uint txn_idle_us = 10000;
+module_param(txn_idle_us, uint, 0644);
+MODULE_PARM_DESC(txn_idle_us, "Transactions (STZ_SPI_IOC_TXN_BEGIN) whose file does not use the bus for this long are ended, releasing CS and the bus, unless the ioctl gives another timeout");
 
 static const struct of_device_id matching_devices[] = {
 	{ .compatible = "sifive,spi0", },
@@ -110,9 +442,18 @@ static struct platform_driver spi_driver = {
 	},
 };
 
+// Without these, or when dirmap_create fails, spi-mem sends the operations as spi_messages
+static const struct spi_controller_mem_ops controller_mem_ops = {
+	.dirmap_create = controller_dirmap_create,
+	.dirmap_read = controller_dirmap_read
+};
+
 struct proc_ops driver_proc_ops = {
+	.proc_open = driver_proc_open,
+	.proc_release = driver_close,
     .proc_read = driver_read,
-    .proc_write = driver_write
+    .proc_write = driver_write,
+	.proc_poll = driver_poll
 };
 
 struct file_operations driver_dev_ops = {
@@ -120,9 +461,65 @@ struct file_operations driver_dev_ops = {
 	.open = driver_open,
     .read = driver_read,
     .write = driver_write,
+	.read_iter = driver_read_iter,
+	.write_iter = driver_write_iter,
+	.poll = driver_poll,
+	.mmap = driver_mmap,
+	.unlocked_ioctl = driver_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 	.release = driver_close
 };
 
+// Files with the counters of a CS line, in the sysfs directory of its /dev/spiN file: one value each,
+// except latency_histogram which has a line per bucket
+#define DRIVER_CS_STAT_ATTR(field)														\
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{																						\
+	struct driver_cs_stats stats;														\
+																						\
+	driver_cs_stats_get(dev, &stats);													\
+	return sysfs_emit(buf, "%llu\n", stats.field);										\
+}																						\
+static DEVICE_ATTR_RO(field)
+
+DRIVER_CS_STAT_ATTR(tx_bytes);
+DRIVER_CS_STAT_ATTR(rx_bytes);
+DRIVER_CS_STAT_ATTR(transfers);
+DRIVER_CS_STAT_ATTR(irqs);
+DRIVER_CS_STAT_ATTR(tx_stalls);
+DRIVER_CS_STAT_ATTR(rx_overruns);
+DRIVER_CS_STAT_ATTR(rx_stalls);
+
+static ssize_t latency_histogram_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	/*
+		Each line is the lower bound of a bucket in microseconds and the transfers that took
+		at least that long, but less than the bound of the next line.
+	*/
+	struct driver_cs_stats stats;
+	int len = 0;
+
+	driver_cs_stats_get(dev, &stats);
+	for (uint i = 0; i < LATENCY_BUCKETS; i++) {
+		len += sysfs_emit_at(buf, len, "%u %llu\n", i ? 1U << (i - 1) : 0, stats.latency[i]);
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(latency_histogram);
+
+static struct attribute *driver_cs_attrs[] = {
+	&dev_attr_tx_bytes.attr,
+	&dev_attr_rx_bytes.attr,
+	&dev_attr_transfers.attr,
+	&dev_attr_irqs.attr,
+	&dev_attr_tx_stalls.attr,
+	&dev_attr_rx_overruns.attr,
+	&dev_attr_rx_stalls.attr,
+	&dev_attr_latency_histogram.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(driver_cs);
+
 // Functions
 
 static int __init spi_init(void)
@@ -130,8 +527,18 @@ static int __init spi_init(void)
 	/*
 		Called when driver is loaded into kernel.
 	*/
+	int ret;
+
 	printk("SPI driver loaded.\n");
-	platform_driver_register(&spi_driver);
+	spi_class = class_create(THIS_MODULE, "spi");					// device files of all the controllers are in /sys/class/spi
+	if (IS_ERR(spi_class)) {
+		return PTR_ERR(spi_class);
+	}
+	ret = platform_driver_register(&spi_driver);
+	if (ret) {
+		class_destroy(spi_class);
+		return ret;
+	}
   	return NO_ERROR;
 }
 
@@ -141,6 +548,7 @@ static void spi_exit(void)
 		Called when driver is unloaded from kernel.
 	*/
 	platform_driver_unregister(&spi_driver);
+	class_destroy(spi_class);
 	printk("SPI driver removed.\n");
 }
 
@@ -148,15 +556,23 @@ static int spi_probe(struct platform_device *pdev)
 {
 	/*
 		Called when device is registered with driver.
-		Allocates resources for device, enables interrupts and initializes device.
+		Allocates resources for device, initializes device and then registers the interrupt handler.
+		Each sifive,spi0 node is a separate instance with its own state, files and interrupt.
+		The device is initialized before its files are created. On failure, what is not device managed
+		is released in the reverse order, and the error is returned.
 	*/
+	struct spi_device_state *spi_device;
+	struct resource *flash_window;
+	struct device *file_device;
+	u32 clock_frequency;
+	int ret;
 
 	// Allocate dynamic memory struct to store device info.
 	// This is freed automatically by kernel when device or driver is removed: no need to manually free.
 	spi_device = devm_kzalloc(&pdev->dev, sizeof(struct spi_device_state), GFP_KERNEL);
 	if (spi_device == NULL) {
 		printk("SPI device: memory allocate error.\n");
-		return ERROR;
+		return -ENOMEM;
 	}
 
 	// Store struct pointer with device
@@ -164,77 +580,279 @@ static int spi_probe(struct platform_device *pdev)
 
 	// Get base address of device
 	spi_device->base_address =  devm_platform_ioremap_resource(pdev, 0);
-	if (spi_device->base_address == NULL) {
+	if (IS_ERR(spi_device->base_address)) {
 		printk("SPI device: address error.\n");
-		return ERROR;
+		return PTR_ERR(spi_device->base_address);
 	}
 
 	// Disable interrupts
 	write_to_reg(BASEADDRESS+SPI_IE_R, 0);
 
-	// Register device for interrupt
-	int irq = platform_get_irq(pdev, 0);
-	if (irq < 0) {
-		printk("SPI device: unable to get irq number.\n");
-		return ERROR;
+	// The fifos only work outside flash mode, which the controller may have been left in by the boot loader.
+	// Flash mode is entered by spi-mem direct mapping reads, if the device has a flash window.
+	write_to_reg(BASEADDRESS+SPI_FCTRL_R, 0);
+	flash_window = platform_get_resource(pdev, IORESOURCE_MEM, 1);
+	if (flash_window) {
+		spi_device->flash_base = devm_ioremap_resource(&pdev->dev, flash_window);
+		if (IS_ERR(spi_device->flash_base)) {
+			printk("SPI device: flash window address error.\n");
+			return PTR_ERR(spi_device->flash_base);
+		}
+		spi_device->flash_size = resource_size(flash_window);
 	}
-	//int ret = devm_request_irq(&pdev->dev, irq, spi_interrupt_handler, 0, dev_name(&pdev->dev), spi_device);
-	int ret = request_irq(irq, spi_interrupt_handler, 0, dev_name(&pdev->dev), &pdev->dev);
-	if (ret) {
-		printk("SPI device: unable to register for interrupt.\n");
-		return ERROR;
+
+	// Get input clock, which SCK is divided from: the clock of the device tree node, or its clock-frequency property
+	spi_device->clk = devm_clk_get_optional_enabled(&pdev->dev, NULL);
+	if (IS_ERR(spi_device->clk)) {
+		printk("SPI device: unable to get clock.\n");
+		return PTR_ERR(spi_device->clk);
+	}
+	if (spi_device->clk) {
+		spi_device->clk_rate = clk_get_rate(spi_device->clk);
+	}
+	else if (!device_property_read_u32(&pdev->dev, "clock-frequency", &clock_frequency)) {
+		spi_device->clk_rate = clock_frequency;
+	}
+	if (spi_device->clk_rate == 0) {
+		printk("SPI device: unknown input clock rate.\n");
+		return -EINVAL;
+	}
+	spi_device->sck_div = UINT_MAX;					// nothing cached, the reset divisor is programmed again
+	device_set_sck_div(spi_device, read_from_reg(BASEADDRESS+SPI_SCK_DIV_R) & SCK_DIV_MASK);
+
+	// Delays found in the registers, each line starts with them
+	spi_device->delay0 = read_from_reg(BASEADDRESS+SPI_DELAY_0_R);
+	spi_device->delay1 = read_from_reg(BASEADDRESS+SPI_DELAY_1_R);
+
+	// Number of CS lines
+	if (device_property_read_u32(&pdev->dev, "num-cs", &spi_device->num_cs)) {
+		spi_device->num_cs = NUM_CS;
+	}
+	if (spi_device->num_cs == 0 || spi_device->num_cs > MAX_CS) {
+		printk("SPI device: invalid num-cs.\n");
+		return -EINVAL;
 	}
 
-	// Setup proc dirs
-	static struct proc_dir_entry *spi_proc_node;
-	spi_proc_node = proc_create("stz_spidriver", 0, NULL, &driver_proc_ops);
-    if  (spi_proc_node == NULL) {
+	// Allocate a context for each CS line, starting from the configuration left in the registers
+	spi_device->cs_states = devm_kcalloc(&pdev->dev, spi_device->num_cs, sizeof(struct spi_cs_state), GFP_KERNEL);
+	if (spi_device->cs_states == NULL) {
+		printk("SPI device: memory allocate error.\n");
+		return -ENOMEM;
+	}
+	for (uint cs = 0; cs < spi_device->num_cs; cs++) {
+		struct spi_cs_state *cs_state = &spi_device->cs_states[cs];
+
+		cs_state->spi_device = spi_device;
+		cs_state->cs = cs;
+		cs_state->file_no = -1;										// no /dev/spiN file yet
+		cs_state->sck_div = spi_device->sck_div;
+		cs_state->sck_mode = read_from_reg(BASEADDRESS+SPI_SCK_MODE_R);
+		cs_state->fmt = read_from_reg(BASEADDRESS+SPI_FMT_R);
+		cs_state->delay0 = spi_device->delay0;
+		cs_state->delay1 = spi_device->delay1;
+		cs_state->mode = ((cs_state->sck_mode & CLK_PHASE_SAMPLE_TRAIL_EDGE) ? STZ_SPI_CPHA : 0)
+			| ((cs_state->sck_mode >> SCK_POLARITY_SHIFT) & CLK_POLARITY_HIGH ? STZ_SPI_CPOL : 0)
+			| ((cs_state->fmt >> FMT_ENDIANNESS_SHIFT) & LSB_ENDIANNESS ? STZ_SPI_LSB_FIRST : 0);
+		mutex_init(&cs_state->rx_lock);
+		init_waitqueue_head(&cs_state->rx_wait);
+		init_waitqueue_head(&cs_state->rx_room_wait);
+		if (kfifo_alloc(&cs_state->rx_ring, max_t(uint, rx_ring_size, RX_RING_MIN), GFP_KERNEL)) {
+			printk("SPI device: memory allocate error.\n");
+			ret = -ENOMEM;
+			goto err_free_rings;
+		}
+	}
+
+	// Initialize flags and registers
+	spi_device->xfer_active = 0;
+	mutex_init(&spi_device->mmap_lock);
+	spin_lock_init(&spi_device->xfer_lock);
+	init_completion(&spi_device->xfer_tx_done);
+	init_completion(&spi_device->xfer_done);
+	INIT_LIST_HEAD(&spi_device->bus_clients);
+	spi_device->bus_owner = NULL;
+	INIT_LIST_HEAD(&spi_device->core_client.sched);
+	INIT_LIST_HEAD(&spi_device->core_client.requests);
+	spi_device->core_client.async_queued = 0;
+	spi_device->cs_inactive = (u32) ((1ULL << spi_device->num_cs) - 1);
+	write_to_reg(BASEADDRESS+SPI_CS_DEF_R, spi_device->cs_inactive);
+	spi_device->cs_mode = CS_MODE_AUTO;
+	write_to_reg(BASEADDRESS+SPI_CS_MODE_R, spi_device->cs_mode);
+	spi_device->cs_current = NULL;
+	spi_device->fmt = read_from_reg(BASEADDRESS+SPI_FMT_R);
+	spi_device->fifo_depth = device_fifo_depth(spi_device, &pdev->dev);
+	spi_device->tx_mark = 1;
+	write_to_reg(BASEADDRESS+SPI_TX_MARK_R, spi_device->tx_mark);				// tx watermark paces transmit-only transfers, others are paced by rx
+	write_to_reg(BASEADDRESS+SPI_RX_MARK_R, 0);
+
+	// Register device for interrupt. Without an interrupt line every transfer is polled.
+	// The handler may run as soon as it is requested (a shared or pending line), so the state it uses is initialized first.
+	spi_device->irq = platform_get_irq(pdev, 0);
+	if (spi_device->irq < 0) {
+		printk("SPI device: no irq, transfers will be polled.\n");
+	}
+	else {
+		// The fifos are moved by a threaded handler, the line stays masked until it is done.
+		// The interrupt is freed by the kernel when the device is removed, before the device state.
+		ret = devm_request_threaded_irq(&pdev->dev, spi_device->irq, spi_interrupt_handler, spi_interrupt_thread,
+											IRQF_ONESHOT, dev_name(&pdev->dev), spi_device);
+		if (ret) {
+			printk("SPI device: unable to register for interrupt.\n");
+			goto err_free_rings;
+		}
+	}
+
+	// Setup proc dirs: /proc/stz_spidriver for the first instance, /proc/stz_spidriverN for the others
+	spi_device->id = ida_alloc(&spi_instance_ida, GFP_KERNEL);
+	if (spi_device->id < 0) {
+		printk("SPI device: memory allocate error.\n");
+		ret = spi_device->id;
+		goto err_free_rings;
+	}
+	if (spi_device->id == 0) {
+		snprintf(spi_device->proc_name, sizeof(spi_device->proc_name), "stz_spidriver");
+	}
+	else {
+		snprintf(spi_device->proc_name, sizeof(spi_device->proc_name), "stz_spidriver%d", spi_device->id);
+	}
+	spi_device->proc_node = proc_create_data(spi_device->proc_name, 0, NULL, &driver_proc_ops, spi_device);
+    if  (spi_device->proc_node == NULL) {
         printk ("SPI device: device file error.\n");
-        return ERROR;
+		ret = -ENOMEM;
+		goto err_free_id;
     }
 	
 	// Setup dev dirs
-	alloc_chrdev_region(&spi_device->major_no, 0, 2, "spi");							// allocate device major num and two minor nums (0,1) for two CS lines
-	spi_device->dev_class = class_create(THIS_MODULE, "spi");							// create device file in /dev/class
-	device_create(spi_device->dev_class, NULL, spi_device->major_no, NULL, "spi0");		// create two files /dev/spi0 and /dev/spi1 for the two CS lines
-	device_create(spi_device->dev_class, NULL, MKDEV(MAJOR(spi_device->major_no), MINOR(spi_device->major_no) + 1), NULL, "spi1");
-
+	ret = alloc_chrdev_region(&spi_device->major_no, 0, spi_device->num_cs, "spi");	// allocate device major num and a minor num for each CS line
+	if (ret) {
+		printk("SPI device: device file error.\n");
+		goto err_remove_proc;
+	}
 																	// initialize spi as a character device by setting struct cdev
 	cdev_init(&(spi_device->cdev), &driver_dev_ops);				// register file operations
 	spi_device->cdev.owner=THIS_MODULE;								// set this driver as owner of char device files
-	cdev_add(&(spi_device->cdev), spi_device->major_no, 2);			// register cdev structure with kernel
+	ret = cdev_add(&(spi_device->cdev), spi_device->major_no, spi_device->num_cs);	// register cdev structure with kernel
+	if (ret) {
+		printk("SPI device: device file error.\n");
+		goto err_unregister_region;
+	}
+	for (uint cs = 0; cs < spi_device->num_cs; cs++) {									// create files /dev/spiN for the CS lines, N is the lowest free number
+		struct spi_cs_state *cs_state = &spi_device->cs_states[cs];
 
-	// Initialize flags and registers
-	spi_device->data_tx_available = 0;
-	spi_device->data_rx_available = 0;
-	spi_device->rx_index = 0;
-	spi_device->tx_index = 0;
-	spi_device->user_rx_index = 0;
-	spi_device->user_tx_index = 0;
-	write_to_reg(BASEADDRESS+SPI_CS_ID_R, 1);
-	write_to_reg(BASEADDRESS+SPI_TX_MARK_R, 1);
-	write_to_reg(BASEADDRESS+SPI_RX_MARK_R, 0);
-	write_to_reg(BASEADDRESS+SPI_IE_R, INTERRUPT_RX);
+		ret = ida_alloc(&spi_file_ida, GFP_KERNEL);
+		if (ret < 0) {
+			printk("SPI device: device file error.\n");
+			goto err_destroy_files;
+		}
+		cs_state->file_no = ret;
+		file_device = device_create_with_groups(spi_class, &pdev->dev, MKDEV(MAJOR(spi_device->major_no), MINOR(spi_device->major_no) + cs),
+												cs_state, driver_cs_groups, "spi%d", cs_state->file_no);
+		if (IS_ERR(file_device)) {
+			printk("SPI device: device file error.\n");
+			ida_free(&spi_file_ida, cs_state->file_no);
+			cs_state->file_no = -1;
+			ret = PTR_ERR(file_device);
+			goto err_destroy_files;
+		}
+	}
+
+	// Register with the SPI core as a controller, so kernel drivers and spidev can queue spi_messages.
+	// Like the device state, the controller is freed by the kernel when the device is removed.
+	spi_device->controller = devm_spi_alloc_master(&pdev->dev, 0);
+	if (spi_device->controller == NULL) {
+		printk("SPI device: controller allocate error.\n");
+		ret = -ENOMEM;
+		goto err_destroy_files;
+	}
+	spi_controller_set_devdata(spi_device->controller, spi_device);
+	spi_device->controller->dev.of_node = pdev->dev.of_node;
+	spi_device->controller->bus_num = -1;								// dynamic bus number
+	spi_device->controller->num_chipselect = spi_device->num_cs;
+	spi_device->controller->mode_bits = SPI_CPOL | SPI_CPHA | SPI_CS_HIGH | SPI_LSB_FIRST
+		| SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD;
+	spi_device->controller->bits_per_word_mask = SPI_BPW_MASK(FRAME_LENGTH);
+	spi_device->controller->max_speed_hz = spi_device->clk_rate / 2;				// SCK_DIV 0
+	spi_device->controller->min_speed_hz = DIV_ROUND_UP(spi_device->clk_rate, 2 * (SCK_DIV_MASK + 1));
+	spi_device->controller->setup = controller_setup;
+	spi_device->controller->prepare_message = controller_prepare_message;
+	spi_device->controller->unprepare_message = controller_unprepare_message;
+	spi_device->controller->set_cs = controller_set_cs;
+	spi_device->controller->set_cs_timing = controller_set_cs_timing;		// CS delays are clocked by the controller
+	spi_device->controller->transfer_one = controller_transfer_one;
+	spi_device->controller->handle_err = controller_handle_err;
+	if (spi_device->flash_base) {
+		spi_device->controller->mem_ops = &controller_mem_ops;		// spi-nor reads through the flash window
+	}
+	ret = devm_spi_register_controller(&pdev->dev, spi_device->controller);
+	if (ret) {
+		printk("SPI device: unable to register spi controller.\n");
+		goto err_destroy_files;
+	}
 
     printk("SPI probe: Device connected.\n");
 	return NO_ERROR;
+
+err_destroy_files:
+	spi_destroy_files(spi_device);
+	cdev_del(&(spi_device->cdev));
+err_unregister_region:
+	unregister_chrdev_region(spi_device->major_no, spi_device->num_cs);
+err_remove_proc:
+	proc_remove(spi_device->proc_node);
+err_free_id:
+	ida_free(&spi_instance_ida, spi_device->id);
+err_free_rings:
+	spi_free_rings(spi_device);
+	return ret;
 }
 
 static int spi_remove(struct platform_device *pdev)
 {	
 	/*
 		Called when device is disconnected.
-		Deletes device files.
+		Deletes device files. The interrupt is masked here and freed by the kernel afterwards.
 	*/
-	device_destroy(spi_device->dev_class, spi_device->major_no);
-	class_destroy(spi_device->dev_class);
-	unregister_chrdev_region(spi_device->major_no, 2);
+	struct spi_device_state *spi_device = platform_get_drvdata(pdev);
+
+	write_to_reg(BASEADDRESS+SPI_IE_R, 0);
+
+	// In the reverse order of spi_probe
+	spi_destroy_files(spi_device);
 	cdev_del(&(spi_device->cdev));
+	unregister_chrdev_region(spi_device->major_no, spi_device->num_cs);
+	proc_remove(spi_device->proc_node);
+	ida_free(&spi_instance_ida, spi_device->id);
+	spi_free_rings(spi_device);
 
     printk("SPI device removed.\n");
 	return NO_ERROR;
 }
 
+static void spi_destroy_files(struct spi_device_state *spi_device)
+{
+	/*
+		Deletes the /dev/spiN files of the CS lines that have one.
+	*/
+	for (uint cs = 0; cs < spi_device->num_cs; cs++) {
+		if (spi_device->cs_states[cs].file_no >= 0) {
+			device_destroy(spi_class, MKDEV(MAJOR(spi_device->major_no), MINOR(spi_device->major_no) + cs));
+			ida_free(&spi_file_ida, spi_device->cs_states[cs].file_no);
+			spi_device->cs_states[cs].file_no = -1;
+		}
+	}
+}
+
+static void spi_free_rings(struct spi_device_state *spi_device)
+{
+	/*
+		Frees the rx_ring and mmap rings of the CS lines. Those not allocated are empty, which is allowed.
+	*/
+	for (uint cs = 0; cs < spi_device->num_cs; cs++) {
+		kfifo_free(&spi_device->cs_states[cs].rx_ring);
+		vfree(spi_device->cs_states[cs].mmap_ring.shared);
+	}
+}
+
 inline void write_to_reg(void __iomem *address,
 						 unsigned long data)
 {
@@ -252,17 +870,51 @@ static int driver_open(struct inode *inode,
 {
 	/*
 		Called when /dev spi files are accessed (opened)
-		Selects one of the two CS lines according to the file:
-			spi0: CS 0
-			spi1: CS 1
+		Attaches the context of the file's CS line: minors are numbered by CS line from the first minor of the controller.
+		The controller is switched to the line by the file's transfers.
 	*/
-	uint minor_no = iminor(inode);
-	if (minor_no == 0) {
-		write_to_reg(BASEADDRESS+SPI_CS_ID_R, 1);
+	struct spi_device_state *spi_device = container_of(inode->i_cdev, struct spi_device_state, cdev);
+	uint minor_no = iminor(inode) - MINOR(spi_device->major_no);
+
+	if (minor_no >= spi_device->num_cs) {
+		return -ENODEV;
 	}
-	else if (minor_no == 1) {
-		write_to_reg(BASEADDRESS+SPI_CS_ID_R, 2);
+	return driver_file_alloc(file_ptr, &spi_device->cs_states[minor_no]);
+}
+
+static int driver_proc_open(struct inode *inode,
+							struct file *file_ptr)
+{
+	/*
+		Called when /proc/stz_spidriver files are opened. They use CS 0 of their controller.
+	*/
+	struct spi_device_state *spi_device = pde_data(inode);
+
+	return driver_file_alloc(file_ptr, &spi_device->cs_states[0]);
+}
+
+static int driver_file_alloc(struct file *file_ptr,
+							 struct spi_cs_state *cs_state)
+{
+	/*
+		Gives an opened file its driver_file: its buffers and its client of the bus scheduler,
+		so that files prepare their transfers independently and are served in turn.
+		Only the writes of a file opened for reading store what they receive in rx_ring: a write-only file
+		never fills it, so it never waits for a reader.
+	*/
+	struct driver_file *file = kzalloc(sizeof(*file), GFP_KERNEL);
+
+	if (file == NULL) {
+		return -ENOMEM;
 	}
+	file->cs_state = cs_state;
+	file->rx_cs = (file_ptr->f_mode & FMODE_READ) ? cs_state : NULL;
+	mutex_init(&file->io_lock);
+	INIT_LIST_HEAD(&file->client.sched);
+	INIT_LIST_HEAD(&file->client.requests);
+	hrtimer_init(&file->txn_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	file->txn_timer.function = driver_txn_timeout;
+	file_ptr->private_data = file;
 	return NO_ERROR;
 }
 
@@ -270,9 +922,19 @@ static int driver_close(struct inode *inode,
 						struct file *file_ptr)
 {
 	/*
-		Called when /dev files are accessed (closed)
+		Called when /dev and /proc files are accessed (closed)
+		The controller is left as it is: other files may be using the bus.
+		The file has no requests left: asynchronous writes keep it open until they complete.
+		A transaction left open is ended, releasing CS and the bus, and sampling is stopped.
 	*/
-	write_to_reg(BASEADDRESS+SPI_CS_ID_R, 1);
+	struct driver_file *file = file_ptr->private_data;
+
+	driver_txn_end(file);
+	if (file->sampler) {
+		driver_sampler_stop(file);
+		driver_sampler_free(file->sampler);
+	}
+	kfree(file);
 	return 0;
 }
 
@@ -283,22 +945,141 @@ static ssize_t driver_read (struct file *file_pointer,
 {
 	/*
 		Called when /proc/stz_spidriver file is read.
-		Transfers data from rx_data_buffer to file.
+		Transfers up to count bytes received by writes from rx_ring to file.
 	*/
-	printk("SPI driver_read\n");
-
-	char *msg_buffer = (spi_device->rx_data_buffer + spi_device->user_rx_index);
-	size_t len = strlen(msg_buffer);
-    if (*offset >= len){
-        return 0;
-    }
-    *offset += len;
-	spi_device->user_rx_index += len;
+	struct iovec iov;
+	struct iov_iter iter;
+	ssize_t len;
 
-    int result = copy_to_user(user_space_buffer, msg_buffer, len);
+	if (import_single_range(READ, user_space_buffer, count, &iov, &iter)) {
+		return -EFAULT;
+	}
+	len = driver_read_ring(file_pointer, &iter, (file_pointer->f_flags & O_NONBLOCK) != 0);
+	if (len > 0) {
+		*offset += len;
+	}
     return len;
 }
 
+static ssize_t driver_read_iter(struct kiocb *iocb,
+								struct iov_iter *to)
+{
+	/*
+		Called for readv and for aio/io_uring reads of /dev spi files.
+		Asynchronous reads are not queued: they complete when they are submitted, and never wait for data.
+		Those of an empty rx_ring return -EAGAIN, and io_uring then waits for the file to become readable with driver_poll.
+	*/
+	return driver_read_ring(iocb->ki_filp, to, (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)
+							|| !is_sync_kiocb(iocb));
+}
+
+static ssize_t driver_read_ring(struct file *file_pointer,
+								struct iov_iter *to,
+								char nowait)
+{
+	/*
+		Transfers received bytes from the rx_ring of the file's CS line to user space through rx_read_buffer.
+		If rx_ring is empty, waits until data is received, or returns -EAGAIN with nowait.
+		A read is part of the file's transaction: it restarts the idle timeout.
+		A file that samples returns its sample records instead, see driver_sampler_read,
+		and a file in receive-only streaming mode clocks the data it returns, see driver_read_stream.
+	*/
+	struct spi_cs_state *cs_state = driver_cs(file_pointer);
+	struct driver_file *file = driver_file(file_pointer);
+	size_t len = 0;
+	uint chunk;
+
+	if (iov_iter_count(to) == 0) {
+		return 0;
+	}
+	if (file->sampler) {
+		return driver_sampler_read(file->sampler, to, nowait);
+	}
+	if (file->rx_stream & STZ_SPI_RX_STREAM) {
+		return driver_read_stream(file, to);
+	}
+
+	while (len == 0) {
+		if (kfifo_is_empty(&cs_state->rx_ring)) {
+			if (nowait) {
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(cs_state->rx_wait, !kfifo_is_empty(&cs_state->rx_ring))) {
+				return -ERESTARTSYS;
+			}
+		}
+
+		// Another reader may have emptied the ring first, then wait again
+		mutex_lock(&cs_state->rx_lock);
+		while (iov_iter_count(to)) {
+			chunk = kfifo_out(&cs_state->rx_ring, cs_state->rx_read_buffer, min_t(size_t, iov_iter_count(to), MSG_BUFFER_SIZE));
+			if (chunk == 0) {
+				break;
+			}
+			if (copy_to_iter(cs_state->rx_read_buffer, chunk, to) != chunk) {
+				printk("SPI device: error while writing data to user buffer.\n");
+				mutex_unlock(&cs_state->rx_lock);
+				return -EFAULT;
+			}
+			len += chunk;
+		}
+		mutex_unlock(&cs_state->rx_lock);
+	}
+	// Writes waiting for room in the ring may take the bus
+	wake_up_interruptible(&cs_state->rx_room_wait);
+	driver_txn_touch(file);
+	return len;
+}
+
+static ssize_t driver_read_stream(struct driver_file *file,
+								  struct iov_iter *to)
+{
+	/*
+		Receive-only read: clocks the file's fill byte to receive up to STZ_SPI_MAX_STREAM_READ bytes,
+		as one transfer with CS held. The whole length is appended at once, so the polling loop or the
+		interrupt handler refills the tx fifo with the fill byte as it drains the rx fifo, and the fifo does not idle.
+		The received bytes go to rx_buffer, or a buffer allocated for them if there are more, not to rx_ring.
+		io_lock is held until they have been copied to user space, so threads sharing the file get their own data.
+	*/
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	uint len = min_t(size_t, iov_iter_count(to), STZ_SPI_MAX_STREAM_READ);
+	u8 *rx = file->rx_buffer;
+	ssize_t ret = len;
+
+	if (len > MSG_BUFFER_SIZE) {
+		rx = kmalloc(len, GFP_KERNEL);
+		if (rx == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	mutex_lock(&file->io_lock);
+	driver_bus_get(file);
+	device_select_cs(cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+	device_transfer_start(spi_device, rx, NULL, len, 1, XFER_CDEV);
+	spi_device->xfer_tx_fill = (u8) file->rx_stream;			// nothing is in flight yet
+	spi_device->xfer_stream = 1;
+	device_transfer_append(spi_device, NULL, len);
+	device_transfer_finish(spi_device);
+	wait_for_completion(&spi_device->xfer_done);
+	if (spi_device->xfer_error) {
+		ret = spi_device->xfer_error;
+	}
+	driver_bus_put(file);
+
+	if (ret >= 0 && copy_to_iter(rx, len, to) != len) {
+		printk("SPI device: error while writing data to user buffer.\n");
+		ret = -EFAULT;
+	}
+	mutex_unlock(&file->io_lock);
+	if (rx != file->rx_buffer) {
+		kfree(rx);
+	}
+	return ret;
+}
+
 static ssize_t driver_write(struct file *file_pointer, 
 						const char *user_space_buffer, 
 						size_t count, 
@@ -306,111 +1087,2191 @@ static ssize_t driver_write(struct file *file_pointer,
 {
 	/*
 		Called when /proc/stz_spidriver file is written.
-		Transfers data from file to tx_data_buffer.
+		Sends the message and returns once the whole message has been sent and received.
 	*/
-	printk("SPI driver_write\n");
-
-	char *msg_buffer = (spi_device->tx_data_buffer + spi_device->user_tx_index);
-	int result = copy_from_user(msg_buffer, user_space_buffer, count);
+	struct iovec iov;
+	struct iov_iter iter;
+	ssize_t done;
 
-	size_t len = strlen(msg_buffer);
-    if (*offset >= len){
-        return 0;
-    }
-    *offset += len;
-	spi_device->user_tx_index += len;
+	if (import_single_range(WRITE, (char __user *) user_space_buffer, count, &iov, &iter)) {
+		return -EFAULT;
+	}
+	done = driver_write_stream(file_pointer, &iter);
+	if (done > 0) {
+		*offset += done;
+	}
+    return done;	// return num of chars sent
+}
 
-	// Mark data as available
-	spi_device->data_tx_available = 1;
-	// Enable tx interrupts
-	// (If device is available to recieve more data, an interrupt will come and data will be sent.)
-	write_to_reg(BASEADDRESS+SPI_IE_R, INTERRUPT_TX | INTERRUPT_RX);
-    return count;
+static ssize_t driver_write_iter(struct kiocb *iocb,
+								 struct iov_iter *from)
+{
+	/*
+		Called for writev and for aio/io_uring writes of /dev spi files.
+		Asynchronous writes are queued and completed from the interrupt handler,
+		so a process can keep several of them in flight. Without an interrupt line they are sent synchronously.
+	*/
+	if (iov_iter_count(from) == 0) {
+		return 0;
+	}
+	if (is_sync_kiocb(iocb) || driver_cs(iocb->ki_filp)->spi_device->irq < 0) {
+		return driver_write_stream(iocb->ki_filp, from);
+	}
+	return driver_write_async(iocb, from);
 }
 
-static void device_write(void)
+static ssize_t driver_write_stream(struct file *file_pointer,
+								   struct iov_iter *from)
 {
 	/*
-		Writes data from tx_data_buffer into spi txdata fifo.
+		Streams a message to the device through the file's tx_buffer, MSG_BUFFER_SIZE bytes at a time,
+		so messages of any length can be sent. Every byte is sent, binary data included.
+		Received bytes are stored in the rx_ring of the file's CS line if the file was opened for reading.
+		The message is one transfer: CS and the bus are held from its first byte to its last, and other clients
+		get the bus once it has been sent. The first chunk is copied before the bus is taken, under io_lock,
+		which is held for the whole call so that threads sharing the file do not overwrite each other's chunks.
+		With rx_backpressure, a file that reads only sends what rx_ring has room for (driver_bus_get_room):
+		a message larger than the free room is cut short, as one transfer, and the caller writes the rest
+		once the ring has been read. Nothing it receives is dropped.
+		Returns once the message has been sent and received, with the number of bytes sent.
 	*/
-	printk("SPI device_write\n");
+	struct driver_file *file = driver_file(file_pointer);
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	size_t count = iov_iter_count(from);
+	size_t done = 0;
+	size_t chunk;
+	char nowait = (file_pointer->f_flags & O_NONBLOCK) != 0;
+	ssize_t len;
+	ulong flags;
+	int err;
+
+	if (count == 0) {
+		return 0;
+	}
 
-	uint *i = &(spi_device->tx_index);
+	mutex_lock(&file->io_lock);
+	chunk = min_t(size_t, count, MSG_BUFFER_SIZE);
+	if (copy_from_iter(file->tx_buffer, chunk, from) != chunk) {
+		printk("SPI device: error while getting data from user.\n");
+		mutex_unlock(&file->io_lock);
+		return -EFAULT;
+	}
+	len = driver_bus_get_room(file, count, nowait);
+	if (len < 0) {
+		mutex_unlock(&file->io_lock);
+		return len;
+	}
+	count = len;
+	chunk = min(chunk, count);
+	device_select_cs(cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+	device_transfer_start(spi_device, NULL, file->rx_cs, count, 1, XFER_CDEV);
 
-	// Loop until fifo is full, or end of message.
-	while ( !(read_from_reg(BASEADDRESS + SPI_TXDATA_R) & TX_FIFO_FULL) && (spi_device->tx_data_buffer[*i] != '\0') ) {
+	for (;;) {
+		// The chunk is sent while the next one is copied, once it is in the fifo
+		device_transfer_append(spi_device, file->tx_buffer, chunk);
+		wait_for_completion(&spi_device->xfer_tx_done);
+		done += chunk;
+		if (done == count) {
+			break;
+		}
 
-		// Write character to TXDATA register
-		write_to_reg(BASEADDRESS + SPI_TXDATA_R, spi_device->tx_data_buffer[*i]);
-		printk("\ntx_data_buffer: %c\n",spi_device->tx_data_buffer[*i]);
-		(*i)++;
+		chunk = min_t(size_t, count - done, MSG_BUFFER_SIZE);
+		if (copy_from_iter(file->tx_buffer, chunk, from) != chunk) {
+			printk("SPI device: error while getting data from user.\n");
+			break;
+		}
+	}
+
+	// Keep the bus until the whole message has been received
+	device_transfer_finish(spi_device);
+	wait_for_completion(&spi_device->xfer_done);
+	err = spi_device->xfer_error;
+	if (file->rx_cs) {
+		spin_lock_irqsave(&spi_device->xfer_lock, flags);
+		cs_state->rx_reserved -= count;
+		spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+		wake_up_interruptible(&cs_state->rx_room_wait);
+	}
+	driver_bus_put(file);
+	mutex_unlock(&file->io_lock);
+	return err ? err : done;
+}
+
+static ssize_t driver_write_async(struct kiocb *iocb,
+								  struct iov_iter *from)
+{
+	/*
+		Copies an asynchronous write into a driver_request and queues it on the file's client of the bus scheduler.
+		Returns -EIOCBQUEUED: the request is completed with ki_complete once it has been sent and received.
+		If the file was opened for reading, its received bytes are stored in rx_ring. With rx_backpressure,
+		room for them is reserved when the request is queued, as it is sent by the interrupt handler and cannot wait.
+		Returns -EAGAIN if async_queue_depth requests of the file are already queued or the ring has no room
+		for the write yet, -EMSGSIZE if the write is longer than async_max_write or than the ring.
+	*/
+	struct driver_file *file = driver_file(iocb->ki_filp);
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	size_t count = iov_iter_count(from);
+	struct driver_request *request;
+	ulong flags;
+	char queued = 0;
+
+	if (count > async_max_write || count > UINT_MAX - sizeof(*request)) {
+		return -EMSGSIZE;
 	}
+	if (rx_backpressure && file->rx_cs && count > kfifo_size(&cs_state->rx_ring)) {
+		return -EMSGSIZE;
+	}
+	request = kmalloc(sizeof(*request) + count, GFP_KERNEL);
+	if (request == NULL) {
+		return -ENOMEM;
+	}
+	request->tx_buf = (u8 *) (request + 1);
+	if (copy_from_iter(request->tx_buf, count, from) != count) {
+		kfree(request);
+		return -EFAULT;
+	}
+	request->client = &file->client;
+	request->iocb = iocb;
+	request->sampler = NULL;
+	request->cs_state = cs_state;
+	request->rx_cs = file->rx_cs;
+	request->len = count;
 
-	// If no more data available, unset data_tx_available
-	if (spi_device->tx_data_buffer[*i] == '\0') {
-		spi_device->data_tx_available = 0;
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (rx_backpressure && file->rx_cs && driver_rx_room(cs_state) < count) {
+		// Retried once a reader has made room
+		cs_state->stats.rx_stalls++;
+		spi_device->stats.rx_stalls++;
+	}
+	else if (file->client.async_queued < async_queue_depth) {
+		if (file->rx_cs) {
+			cs_state->rx_reserved += count;
+		}
+		file->client.async_queued++;
+		device_bus_queue(spi_device, request);
+		queued = 1;
 	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
 
-	// Enable tx interrupts
-	write_to_reg(BASEADDRESS+SPI_IE_R, INTERRUPT_TX | INTERRUPT_RX);
+	if (!queued) {
+		kfree(request);
+		return -EAGAIN;
+	}
+	return -EIOCBQUEUED;
 }
 
-static void device_read(void) 
+static ssize_t driver_bus_get_room(struct driver_file *file,
+								   size_t len,
+								   char nowait)
 {
 	/*
-		Reads data from spi rxdata fifo into rx_data_buffer.
+		Takes the bus for a write of len bytes and reserves room for what it receives in the rx_ring of the
+		file's CS line. The write waits until the ring has room for all of it, or is empty if that is more than
+		the ring holds, and is cut short to the room it then has. Readers make room.
+		The bus is never kept while waiting: other clients and CS lines use it meanwhile, and the room is checked
+		again once it is taken, as a client served before the write may have filled the ring.
+		A non-blocking write, or one in a transaction, whose file keeps the bus between its calls, does not wait:
+		it is cut short to the room there is, or gets -EAGAIN if there is none.
+		Returns the number of bytes to send with the bus taken, -EAGAIN, or -ERESTARTSYS if interrupted.
+		Without rx_backpressure, the write is not cut short and what the full ring cannot take is dropped.
+		A file that does not read only takes the bus.
 	*/
-	printk("SPI device_read\n");
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	uint wanted = min_t(size_t, len, kfifo_size(&cs_state->rx_ring));
+	uint room;
+	ulong flags;
+	char held;
 
-	uint *i = &(spi_device->rx_index);
-	char empty_flag=0;
-	ulong data;
+	for (;;) {
+		driver_bus_get(file);
+		if (file->rx_cs == NULL) {
+			return len;
+		}
+		spin_lock_irqsave(&spi_device->xfer_lock, flags);
+		room = driver_rx_room(cs_state);
+		held = file->txn_held;
+		if (!rx_backpressure || room >= wanted || (room && (nowait || held))) {
+			if (rx_backpressure) {
+				len = min_t(size_t, len, room);
+			}
+			cs_state->rx_reserved += len;
+			spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+			return len;
+		}
+		cs_state->stats.rx_stalls++;
+		spi_device->stats.rx_stalls++;
+		spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+		driver_bus_put(file);
 
-	// Read data, loop until fifo is empty.
-	data = read_from_reg(BASEADDRESS + SPI_RXDATA_R);
-	empty_flag = (data & RX_FIFO_EMPTY) ? 1 : 0;
-	while (!empty_flag) {
-		// Read character from RXDATA register	
-		spi_device->rx_data_buffer[*i] = (char) (data & SPI_DATA);
-		printk("\nrx_data_buffer: %c\n",spi_device->rx_data_buffer[*i]);
-		data = read_from_reg(BASEADDRESS + SPI_RXDATA_R);
-		empty_flag = (data & RX_FIFO_EMPTY) ? 1 : 0;
-		(*i)++;
+		if (nowait || held) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(cs_state->rx_room_wait, driver_rx_room(cs_state) >= wanted)) {
+			return -ERESTARTSYS;
+		}
 	}
+}
+
+static uint driver_rx_room(struct spi_cs_state *cs_state)
+{
+	/*
+		Returns the room of the CS line's rx_ring that no write queued or being sent has reserved.
+		Readers only add room, so it is read without rx_lock.
+	*/
+	uint avail = kfifo_avail(&cs_state->rx_ring);
+	uint reserved = cs_state->rx_reserved;
 
-	// Enable rx interrupts
-	//write_to_reg(BASEADDRESS+SPI_IE_R, INTERRUPT_RX);
+	return avail > reserved ? avail - reserved : 0;
 }
 
-static irqreturn_t spi_interrupt_handler(int irq, void* dev) 
+static __poll_t driver_poll(struct file *file_pointer,
+							poll_table *wait)
 {
 	/*
-		Interrupt handler.
-		Calls device_read when data is available to be read.
-		Calls device_write when device can accept more data, and there is more data to write.
+		Called by poll/select/epoll on /dev spi files.
+		The file is readable when rx_ring holds data, or while it samples, when a record is ready or sampling
+		has stopped. In receive-only streaming mode, a read clocks its own data, so the file is always readable.
+		It is writable when a write can send something: a file that reads needs room in rx_ring (rx_backpressure),
+		otherwise a write waits for the bus itself.
 	*/
-	printk("SPI interrupt\n");
+	struct spi_cs_state *cs_state = driver_cs(file_pointer);
+	struct driver_file *file = driver_file(file_pointer);
+	struct driver_sampler *sampler = file->sampler;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
 
-	// Get interrupt status
-	ulong interrupts_status, interrupts_enables;
-	interrupts_status = read_from_reg(BASEADDRESS+SPI_IP_R);
-	interrupts_enables = read_from_reg(BASEADDRESS+SPI_IE_R);
+	if (rx_backpressure && file->rx_cs) {
+		poll_wait(file_pointer, &cs_state->rx_room_wait, wait);
+		if (driver_rx_room(cs_state) == 0) {
+			mask = 0;
+		}
+	}
+	if (sampler) {
+		poll_wait(file_pointer, &sampler->wait, wait);
+		if (kfifo_len(&sampler->ring) >= sampler->record_size || !sampler->running) {
+			mask |= EPOLLIN | EPOLLRDNORM;
+		}
+		return mask;
+	}
+	if (file->rx_stream & STZ_SPI_RX_STREAM) {
+		return mask | EPOLLIN | EPOLLRDNORM;
+	}
+	poll_wait(file_pointer, &cs_state->rx_wait, wait);
+	if (!kfifo_is_empty(&cs_state->rx_ring)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	return mask;
+}
 
-	write_to_reg(BASEADDRESS+SPI_IE_R, 0);								// disable interrupts
+static long driver_ioctl(struct file *file_pointer,
+						 unsigned int cmd,
+						 unsigned long arg)
+{
+	/*
+		Called when ioctl is used on /dev spi files.
+		STZ_SPI_IOC_TRANSFER runs an array of segments back-to-back in one system call, on the CS line
+		selected when the file was opened. CS is held between segments unless a segment sets cs_change:
+		CS is then deasserted (CS_MODE_OFF) after the segment's delay_usecs, which sleeps, kept inactive for
+		the intercs delay of the line, and reasserted by the next one.
+		Returns the number of bytes transferred.
+		STZ_SPI_IOC_STATS copies the transfer counters to user space.
+		STZ_SPI_IOC_MMAP_SIZE returns the length to mmap, STZ_SPI_IOC_MMAP_KICK sends the data of the mmapped rings.
+		STZ_SPI_IOC_WR_CONFIG and STZ_SPI_IOC_RD_CONFIG set and get the configuration of the file's CS line.
+		STZ_SPI_IOC_TXN_BEGIN and STZ_SPI_IOC_TXN_END start and end a transaction of the file.
+		STZ_SPI_IOC_WRITE_READ sends a command and returns the response, see driver_write_read.
+		STZ_SPI_IOC_SAMPLER_START and STZ_SPI_IOC_SAMPLER_STOP start and stop periodic sampling of the file.
+		STZ_SPI_IOC_RX_STREAM turns the receive-only streaming reads of the file on, with a fill byte, or off.
+		The calls that move data through the file's tx_buffer and rx_buffer, or program the controller, hold its io_lock:
+		in a transaction, the file keeps the bus between its calls, and io_lock is what keeps them from overlapping.
+	*/
+	struct driver_file *file = driver_file(file_pointer);
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	struct stz_spi_transfer transfer;
+	struct stz_spi_segment *segments;
+	struct stz_spi_config config;
+	struct stz_spi_write_read write_read;
+	struct stz_spi_sampler sampler;
+	struct driver_mmap_ring *ring;
+	u32 idle_us;
+	u32 rx_stream;
+	uint n;
+	long ret = 0;
+	int err;
 
-	// Transmit actions
-	if (interrupts_status & INTERRUPT_TX) {								// when device is available to transmit
-		if (spi_device->data_tx_available) {							// if there is more data to send
-			device_write();												// call write function
+	if (cmd == STZ_SPI_IOC_STATS) {
+		if (copy_to_user((void __user *) arg, &spi_device->stats, sizeof(spi_device->stats))) {
+			return -EFAULT;
+		}
+		return NO_ERROR;
+	}
+	if (cmd == STZ_SPI_IOC_MMAP_SIZE) {
+		ring = driver_mmap_alloc(file_pointer);
+		if (IS_ERR(ring)) {
+			return PTR_ERR(ring);
+		}
+		return put_user((__u32) ring->map_size, (__u32 __user *) arg);
+	}
+	if (cmd == STZ_SPI_IOC_MMAP_KICK) {
+		return driver_mmap_kick(file_pointer);
+	}
+	if (cmd == STZ_SPI_IOC_WRITE_READ) {
+		if (copy_from_user(&write_read, (void __user *) arg, sizeof(write_read))) {
+			return -EFAULT;
+		}
+		mutex_lock(&file->io_lock);
+		ret = driver_write_read(file, &write_read);
+		mutex_unlock(&file->io_lock);
+		return ret;
+	}
+	if (cmd == STZ_SPI_IOC_TXN_BEGIN) {
+		if (get_user(idle_us, (__u32 __user *) arg)) {
+			return -EFAULT;
+		}
+		return driver_txn_begin(file, idle_us);
+	}
+	if (cmd == STZ_SPI_IOC_TXN_END) {
+		return driver_txn_end(file);
+	}
+	if (cmd == STZ_SPI_IOC_SAMPLER_START) {
+		if (copy_from_user(&sampler, (void __user *) arg, sizeof(sampler))) {
+			return -EFAULT;
+		}
+		return driver_sampler_start(file, &sampler);
+	}
+	if (cmd == STZ_SPI_IOC_SAMPLER_STOP) {
+		return driver_sampler_stop(file);
+	}
+	if (cmd == STZ_SPI_IOC_RX_STREAM) {
+		if (get_user(rx_stream, (__u32 __user *) arg)) {
+			return -EFAULT;
+		}
+		if (rx_stream & ~(STZ_SPI_RX_STREAM | 0xFF)) {
+			return -EINVAL;
+		}
+		file->rx_stream = rx_stream;
+		return NO_ERROR;
+	}
+	if (cmd == STZ_SPI_IOC_WR_CONFIG) {
+		if (copy_from_user(&config, (void __user *) arg, sizeof(config))) {
+			return -EFAULT;
+		}
+		mutex_lock(&file->io_lock);
+		driver_bus_get(file);
+		ret = driver_set_config(cs_state, &config);
+		driver_bus_put(file);
+		mutex_unlock(&file->io_lock);
+		return ret;
+	}
+	if (cmd == STZ_SPI_IOC_RD_CONFIG) {
+		driver_get_config(cs_state, &config);
+		if (copy_to_user((void __user *) arg, &config, sizeof(config))) {
+			return -EFAULT;
+		}
+		return NO_ERROR;
+	}
+	if (cmd != STZ_SPI_IOC_TRANSFER) {
+		return -ENOTTY;
+	}
+	if (copy_from_user(&transfer, (void __user *) arg, sizeof(transfer))) {
+		return -EFAULT;
+	}
+	if (transfer.num_segments == 0) {
+		return 0;
+	}
+	if (transfer.num_segments > STZ_SPI_MAX_SEGMENTS) {
+		return -EINVAL;
+	}
+
+	// Get segment list from user
+	segments = kmalloc_array(transfer.num_segments, sizeof(*segments), GFP_KERNEL);
+	if (segments == NULL) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(segments, u64_to_user_ptr(transfer.segments), transfer.num_segments * sizeof(*segments))) {
+		kfree(segments);
+		return -EFAULT;
+	}
+
+	mutex_lock(&file->io_lock);
+	driver_bus_get(file);
+	device_select_cs(cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+
+	for (n = 0; n < transfer.num_segments; n++) {
+		if (segments[n].speed_hz) {
+			device_set_speed(spi_device, segments[n].speed_hz);
+		}
+		if (segments[n].flags & STZ_SPI_SEG_WORD_DELAY) {
+			device_set_delays(spi_device, spi_device->delay0,
+							  (spi_device->delay1 & ~(DELAY_MASK << DELAY1_INTERXFR_SHIFT)) | (uint) segments[n].word_delay << DELAY1_INTERXFR_SHIFT);
+		}
+		err = driver_transfer_segment(file, &segments[n]);
+		if (err) {
+			ret = err;
+			break;
+		}
+		ret += segments[n].len;
+
+		if (segments[n].delay_usecs) {
+			fsleep(segments[n].delay_usecs);
+		}
+		if (segments[n].cs_change && n + 1 < transfer.num_segments) {
+			// The fifo is empty: CS goes inactive for the line's intercs delay (one SCK cycle at least),
+			// and the next segment's first frame asserts it again
+			device_set_cs_mode(spi_device, CS_MODE_OFF);
+			ndelay(max_t(uint, spi_device->delay1 & DELAY_MASK, 1) * spi_device->sck_period_ns);
+			device_set_cs_mode(spi_device, CS_MODE_HOLD);
 		}
 	}
 
-	// Recieve actions
-	if (interrupts_status & INTERRUPT_RX) {								// when device has data available to read
-		device_read();													// call read function
+	// Restore the clock rate and delays of the CS line, and release CS unless in a transaction
+	device_set_sck_div(spi_device, cs_state->sck_div);
+	device_set_delays(spi_device, cs_state->delay0, cs_state->delay1);
+	driver_bus_put(file);
+	mutex_unlock(&file->io_lock);
+
+	kfree(segments);
+	return ret;
+}
+
+static int driver_mmap(struct file *file_pointer,
+					   struct vm_area_struct *vma)
+{
+	/*
+		Called when /dev spi files are mmapped.
+		Maps the shared rings of the file's CS line (see struct stz_spi_mmap_ring), allocating them on first use.
+	*/
+	struct driver_mmap_ring *ring = driver_mmap_alloc(file_pointer);
+
+	if (IS_ERR(ring)) {
+		return PTR_ERR(ring);
 	}
-	
-	return IRQ_HANDLED;
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->map_size) {
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, ring->shared, 0);
+}
+
+static struct driver_mmap_ring *driver_mmap_alloc(struct file *file_pointer)
+{
+	/*
+		Returns the shared rings of the file's CS line, allocating them if needed:
+		a header page followed by the tx and rx data areas.
+	*/
+	struct spi_cs_state *cs_state = driver_cs(file_pointer);
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	struct driver_mmap_ring *ring = &cs_state->mmap_ring;
+	ulong size;
+
+	mutex_lock(&spi_device->mmap_lock);
+	if (ring->shared == NULL) {
+		size = roundup_pow_of_two(max_t(ulong, mmap_ring_size, PAGE_SIZE));
+		ring->shared = vmalloc_user(PAGE_SIZE + 2 * size);
+		if (ring->shared == NULL) {
+			mutex_unlock(&spi_device->mmap_lock);
+			return ERR_PTR(-ENOMEM);
+		}
+		ring->size = size;
+		ring->map_size = PAGE_SIZE + 2 * size;
+		ring->tx_data = (u8 *) ring->shared + PAGE_SIZE;
+		ring->rx_data = ring->tx_data + size;
+		ring->tx_tail = 0;
+		ring->rx_head = 0;
+		ring->shared->size = size;
+		ring->shared->tx_offset = PAGE_SIZE;
+		ring->shared->rx_offset = PAGE_SIZE + size;
+	}
+	mutex_unlock(&spi_device->mmap_lock);
+	return ring;
+}
+
+static long driver_mmap_kick(struct file *file_pointer)
+{
+	/*
+		Doorbell of the mmapped rings: sends the tx data between tx_tail and tx_head, as far as the rx area
+		has room, with CS held. The fifos are fed from the tx area and drained into the rx area directly,
+		one transfer per contiguous piece of the rings. Holds the file's io_lock, like its other calls that use the bus.
+		Returns the number of bytes sent.
+	*/
+	struct spi_cs_state *cs_state = driver_cs(file_pointer);
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	struct driver_mmap_ring *ring = &cs_state->mmap_ring;
+	u32 pending, used, len, mask;
+	long ret = 0;
+
+	if (ring->shared == NULL) {
+		return -EINVAL;
+	}
+	mask = ring->size - 1;
+
+	mutex_lock(&driver_file(file_pointer)->io_lock);
+	driver_bus_get(driver_file(file_pointer));
+	device_select_cs(cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+
+	for (;;) {
+		pending = smp_load_acquire(&ring->shared->tx_head) - ring->tx_tail;
+		used = ring->rx_head - smp_load_acquire(&ring->shared->rx_tail);
+		if (pending > ring->size || used > ring->size) {
+			ret = -EINVAL;				// indexes corrupted by user space
+			break;
+		}
+
+		// Contiguous piece of both areas
+		len = min(pending, ring->size - used);
+		len = min(len, ring->size - (ring->tx_tail & mask));
+		len = min(len, ring->size - (ring->rx_head & mask));
+		if (len == 0) {
+			break;
+		}
+
+		device_transfer_start(spi_device, ring->rx_data + (ring->rx_head & mask), NULL, len, 1, XFER_CDEV);
+		device_transfer_append(spi_device, ring->tx_data + (ring->tx_tail & mask), len);
+		device_transfer_finish(spi_device);
+		wait_for_completion(&spi_device->xfer_done);
+		if (spi_device->xfer_error) {
+			ret = ret ? ret : spi_device->xfer_error;
+			break;
+		}
+
+		ring->tx_tail += len;
+		ring->rx_head += len;
+		smp_store_release(&ring->shared->tx_tail, ring->tx_tail);
+		smp_store_release(&ring->shared->rx_head, ring->rx_head);
+		ret += len;
+	}
+
+	driver_bus_put(driver_file(file_pointer));
+	mutex_unlock(&driver_file(file_pointer)->io_lock);
+	return ret;
+}
+
+static struct spi_cs_state *driver_cs(struct file *file_pointer)
+{
+	/*
+		Returns the context of the file's CS line.
+	*/
+	return driver_file(file_pointer)->cs_state;
+}
+
+static struct driver_file *driver_file(struct file *file_pointer)
+{
+	/*
+		Returns the driver_file of an open /dev/spiN or /proc file, see driver_file_alloc.
+	*/
+	return file_pointer->private_data;
+}
+
+static int driver_set_config(struct spi_cs_state *cs_state,
+							 const struct stz_spi_config *config)
+{
+	/*
+		Sets the configuration of a CS line. It is programmed into the controller by the next
+		transfer on the line, except CS polarity, which sets the inactive level of the line right away.
+		Called with the bus held.
+	*/
+	struct spi_device_state *spi_device = cs_state->spi_device;
+
+	if (config->mode & ~STZ_SPI_MODE_MASK) {
+		return -EINVAL;
+	}
+
+	cs_state->mode = config->mode;
+	device_mode_regs(config->mode, &cs_state->sck_mode, &cs_state->fmt);
+	if (config->speed_hz) {
+		cs_state->sck_div = device_sck_div(spi_device, config->speed_hz);
+	}
+	cs_state->delay0 = config->delay0;
+	cs_state->delay1 = config->delay1;
+	device_set_cs_polarity(spi_device, cs_state->cs, config->mode & STZ_SPI_CS_HIGH);
+
+	// Reprogram the controller if this line is the current one
+	if (spi_device->cs_current == cs_state) {
+		spi_device->cs_current = NULL;
+	}
+	return NO_ERROR;
+}
+
+static void driver_get_config(struct spi_cs_state *cs_state,
+							  struct stz_spi_config *config)
+{
+	/*
+		Gets the configuration of a CS line, with the SCK rate its divisor gives.
+	*/
+	config->speed_hz = cs_state->spi_device->clk_rate / (2 * (cs_state->sck_div + 1));
+	config->mode = cs_state->mode;
+	config->delay0 = cs_state->delay0;
+	config->delay1 = cs_state->delay1;
+}
+
+static void driver_cs_stats_get(struct device *dev,
+								struct driver_cs_stats *stats)
+{
+	/*
+		Copies the counters of the CS line of a /dev/spiN device, consistent with each other.
+	*/
+	struct spi_cs_state *cs_state = dev_get_drvdata(dev);
+	ulong flags;
+
+	spin_lock_irqsave(&cs_state->spi_device->xfer_lock, flags);
+	*stats = cs_state->stats;
+	spin_unlock_irqrestore(&cs_state->spi_device->xfer_lock, flags);
+}
+
+static int driver_transfer_segment(struct driver_file *file,
+								   const struct stz_spi_segment *segment)
+{
+	/*
+		Runs one ioctl segment, moving its data from/to user space MSG_BUFFER_SIZE bytes at a time.
+		Called with the bus and the file's io_lock held.
+		Dual and quad segments are half duplex: they receive if they have an rx_buf, otherwise they transmit.
+		Returns -EINVAL for an invalid number of data lines, -EFAULT if the user buffers could not be accessed.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	const u8 __user *tx = u64_to_user_ptr(segment->tx_buf);
+	u8 __user *rx = u64_to_user_ptr(segment->rx_buf);
+	uint lanes = rx ? segment->rx_nbits : segment->tx_nbits;
+	uint done = 0;
+	uint chunk;
+
+	lanes = lanes ? lanes : 1;
+	if (device_lanes_proto(lanes) == UINT_MAX || (tx && rx && max(segment->tx_nbits, segment->rx_nbits) > 1)) {
+		return -EINVAL;
+	}
+
+	while (done < segment->len) {
+		chunk = min_t(uint, segment->len - done, MSG_BUFFER_SIZE);
+		if (tx && copy_from_user(file->tx_buffer, tx + done, chunk)) {
+			return -EFAULT;
+		}
+
+		device_transfer_start(spi_device, rx ? file->rx_buffer : NULL, NULL, chunk, lanes, XFER_CDEV);
+		device_transfer_append(spi_device, tx ? file->tx_buffer : NULL, chunk);
+		device_transfer_finish(spi_device);
+		wait_for_completion(&spi_device->xfer_done);
+		if (spi_device->xfer_error) {
+			return spi_device->xfer_error;
+		}
+		if (rx && copy_to_user(rx + done, file->rx_buffer, chunk)) {
+			return -EFAULT;
+		}
+		done += chunk;
+	}
+	return NO_ERROR;
+}
+
+static long driver_write_read(struct driver_file *file,
+							  const struct stz_spi_write_read *write_read)
+{
+	/*
+		Runs a command/response exchange as one transfer with CS held: sends the command from tx_buffer,
+		followed by zeros while the response is received. The frames received during the command are
+		not stored (xfer_rx_skip), so the response is copied to user space as it is.
+		The response goes through rx_buffer, or a buffer allocated for it if it is longer.
+		Called with the file's io_lock held.
+		Returns rx_len, -EINVAL if the command or the response is too long, -EFAULT if the user buffers
+		could not be accessed.
+	*/
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	uint len = write_read->tx_len + write_read->rx_len;
+	uint head = min_t(uint, len, MSG_BUFFER_SIZE);
+	u8 *rx = file->rx_buffer;
+	long ret = write_read->rx_len;
+
+	if (write_read->tx_len > min(STZ_SPI_MAX_COMMAND, MSG_BUFFER_SIZE) || write_read->rx_len > STZ_SPI_MAX_RESPONSE) {
+		return -EINVAL;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	if (copy_from_user(file->tx_buffer, u64_to_user_ptr(write_read->tx_buf), write_read->tx_len)) {
+		return -EFAULT;
+	}
+	if (write_read->rx_len > MSG_BUFFER_SIZE) {
+		rx = kmalloc(write_read->rx_len, GFP_KERNEL);
+		if (rx == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	// The zeros of the response follow the command in tx_buffer, so the fifo is fed without a break
+	memset(file->tx_buffer + write_read->tx_len, 0, head - write_read->tx_len);
+
+	driver_bus_get(file);
+	device_select_cs(cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+	device_transfer_start(spi_device, rx, NULL, len, 1, XFER_CDEV);
+	spi_device->xfer_rx_skip = write_read->tx_len;				// nothing is in flight yet
+	device_transfer_append(spi_device, file->tx_buffer, head);
+	if (head < len) {
+		wait_for_completion(&spi_device->xfer_tx_done);
+		device_transfer_append(spi_device, NULL, len - head);
+	}
+	device_transfer_finish(spi_device);
+	wait_for_completion(&spi_device->xfer_done);
+	if (spi_device->xfer_error) {
+		ret = spi_device->xfer_error;
+	}
+	driver_bus_put(file);
+
+	if (ret >= 0 && copy_to_user(u64_to_user_ptr(write_read->rx_buf), rx, write_read->rx_len)) {
+		ret = -EFAULT;
+	}
+	if (rx != file->rx_buffer) {
+		kfree(rx);
+	}
+	return ret;
+}
+
+static void driver_bus_get(struct driver_file *file)
+{
+	/*
+		Takes the bus for a call of the file. In a transaction that already has it, the call continues
+		the transaction, with CS still asserted, and holds off the idle timeout until driver_bus_put.
+		Otherwise waits for the bus; in a transaction, the file then keeps it beyond the call.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+	char held;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	held = file->txn_held;
+	file->txn_busy++;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	if (held) {
+		return;
+	}
+
+	device_bus_lock(spi_device, &file->client);
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	file->txn_held = file->txn_open;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static void driver_bus_put(struct driver_file *file)
+{
+	/*
+		Ends a call of the file that took the bus with driver_bus_get. In a transaction, the file keeps
+		the bus with CS asserted and the idle timeout starts once no other call of the file uses it.
+		Otherwise CS is released and the bus goes to the next client.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+	char held;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	file->txn_busy--;
+	held = file->txn_held;
+	if (held && file->txn_busy == 0) {
+		hrtimer_start(&file->txn_timer, ns_to_ktime(file->txn_idle_ns), HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	if (held) {
+		return;
+	}
+
+	device_set_cs_mode(spi_device, CS_MODE_AUTO);
+	device_bus_unlock(spi_device);
+}
+
+static long driver_txn_begin(struct driver_file *file,
+							 u32 idle_us)
+{
+	/*
+		Starts a transaction of the file, ended after idle_us without bus use (txn_idle_us if 0).
+		The bus is taken by the first transfer of the transaction.
+		Returns -EBUSY if the file is already in a transaction.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+	long ret = NO_ERROR;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (file->txn_open) {
+		ret = -EBUSY;
+	}
+	else {
+		file->txn_open = 1;
+		file->txn_timed_out = 0;
+		file->txn_idle_ns = (u64) (idle_us ? idle_us : txn_idle_us) * NSEC_PER_USEC;
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	return ret;
+}
+
+static long driver_txn_end(struct driver_file *file)
+{
+	/*
+		Ends the transaction of the file, releasing CS and the bus if the file has them.
+		Returns -ETIMEDOUT if the idle timeout ended it first, -EINVAL if none was started,
+		-EBUSY if another call of the file is using the bus.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+	long ret = NO_ERROR;
+	char held;
+
+	hrtimer_cancel(&file->txn_timer);
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (file->txn_busy) {
+		ret = -EBUSY;
+	}
+	else if (!file->txn_open) {
+		ret = file->txn_timed_out ? -ETIMEDOUT : -EINVAL;
+	}
+	if (ret) {
+		spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+		return ret;
+	}
+	held = file->txn_held;
+	file->txn_open = 0;
+	file->txn_held = 0;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+
+	if (held) {
+		device_set_cs_mode(spi_device, CS_MODE_AUTO);
+		device_bus_unlock(spi_device);
+	}
+	return NO_ERROR;
+}
+
+static void driver_txn_touch(struct driver_file *file)
+{
+	/*
+		Restarts the idle timeout of the file's transaction, for calls that do not use the bus.
+	*/
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (file->txn_held && !file->txn_busy) {
+		hrtimer_start(&file->txn_timer, ns_to_ktime(file->txn_idle_ns), HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static enum hrtimer_restart driver_txn_timeout(struct hrtimer *timer)
+{
+	/*
+		Idle timeout of a transaction: the file has not used the bus for txn_idle_ns.
+		Ends the transaction, releasing CS and granting the bus to the next client.
+		A call of the file that took the bus meanwhile restarts the timeout when it is done.
+	*/
+	struct driver_file *file = container_of(timer, struct driver_file, txn_timer);
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (file->txn_held && !file->txn_busy) {
+		file->txn_open = 0;
+		file->txn_held = 0;
+		file->txn_timed_out = 1;
+		device_set_cs_mode(spi_device, CS_MODE_AUTO);
+		spi_device->bus_owner = NULL;
+		device_bus_schedule(spi_device);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	return HRTIMER_NORESTART;
+}
+
+static long driver_sampler_start(struct driver_file *file,
+								 const struct stz_spi_sampler *config)
+{
+	/*
+		Starts periodic sampling on the file's CS line: builds the canned transfer from the template
+		followed by zeros, allocates its response buffer and the record ring, and starts the timer.
+		The first sample is taken one period later. Sampling needs the interrupt line: the transfers
+		are started by the timer and moved by the interrupt handler, without process context.
+		Returns -EINVAL if the transfer or the ring is too large or the period is 0,
+		-EBUSY if the file already sampled, -EOPNOTSUPP without an interrupt line.
+	*/
+	struct spi_cs_state *cs_state = file->cs_state;
+	struct spi_device_state *spi_device = cs_state->spi_device;
+	uint records = config->ring_records ? config->ring_records : 256;
+	struct driver_sampler *sampler;
+	struct driver_request *request;
+	ulong flags;
+	char busy;
+	uint len;
+
+	if (spi_device->irq < 0) {
+		return -EOPNOTSUPP;
+	}
+	if (config->tx_len > STZ_SPI_MAX_SAMPLE || config->rx_skip > STZ_SPI_MAX_SAMPLE || config->rx_len > STZ_SPI_MAX_SAMPLE
+		|| config->period_us == 0 || records > STZ_SPI_MAX_SAMPLE_RECORDS) {
+		return -EINVAL;
+	}
+	len = max(config->tx_len, config->rx_skip + config->rx_len);
+	if (len == 0 || len > STZ_SPI_MAX_SAMPLE) {
+		return -EINVAL;
+	}
+
+	sampler = kzalloc(sizeof(*sampler), GFP_KERNEL);
+	if (sampler == NULL) {
+		return -ENOMEM;
+	}
+	request = kzalloc(sizeof(*request) + len, GFP_KERNEL);
+	sampler->request = request;
+	sampler->rx_buf = kmalloc(len, GFP_KERNEL);
+	sampler->record_size = STZ_SPI_SAMPLE_SIZE(config->rx_len);
+	if (request == NULL || sampler->rx_buf == NULL || kfifo_alloc(&sampler->ring, records * sampler->record_size, GFP_KERNEL)) {
+		driver_sampler_free(sampler);
+		return -ENOMEM;
+	}
+	request->tx_buf = (u8 *) (request + 1);
+	if (copy_from_user(request->tx_buf, u64_to_user_ptr(config->tx_buf), config->tx_len)) {
+		driver_sampler_free(sampler);
+		return -EFAULT;
+	}
+	INIT_LIST_HEAD(&sampler->client.sched);
+	INIT_LIST_HEAD(&sampler->client.requests);
+	request->client = &sampler->client;
+	request->sampler = sampler;
+	request->cs_state = cs_state;
+	request->len = len;
+	sampler->period_ns = (u64) config->period_us * NSEC_PER_USEC;
+	sampler->rx_skip = config->rx_skip;
+	sampler->rx_len = config->rx_len;
+	sampler->running = 1;
+	mutex_init(&sampler->read_lock);
+	init_waitqueue_head(&sampler->wait);
+	hrtimer_init(&sampler->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sampler->timer.function = driver_sampler_timer;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	busy = file->sampler != NULL;
+	if (!busy) {
+		file->sampler = sampler;
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	if (busy) {
+		driver_sampler_free(sampler);
+		return -EBUSY;
+	}
+
+	hrtimer_start(&sampler->timer, ns_to_ktime(sampler->period_ns), HRTIMER_MODE_REL);
+	return NO_ERROR;
+}
+
+static long driver_sampler_stop(struct driver_file *file)
+{
+	/*
+		Stops the sampling of the file: cancels the timer, then takes the last transfer off the bus queue
+		if it is still waiting, or waits for it to complete. The records left in the ring can still be read.
+		Returns -EINVAL if the file is not sampling.
+	*/
+	struct driver_sampler *sampler = file->sampler;
+	struct spi_device_state *spi_device = file->cs_state->spi_device;
+	ulong flags;
+	char running;
+
+	if (sampler == NULL) {
+		return -EINVAL;
+	}
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	running = sampler->running;
+	sampler->running = 0;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	if (!running) {
+		return -EINVAL;
+	}
+
+	hrtimer_cancel(&sampler->timer);
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (sampler->pending && spi_device->bus_owner != sampler->request) {
+		list_del(&sampler->request->list);
+		list_del_init(&sampler->client.sched);
+		sampler->pending = 0;
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	wait_event(sampler->wait, !sampler->pending);
+
+	// Readers waiting for the next record get the end of the records instead
+	wake_up(&sampler->wait);
+	return NO_ERROR;
+}
+
+static void driver_sampler_free(struct driver_sampler *sampler)
+{
+	/*
+		Frees a sampler that is not running.
+	*/
+	kfifo_free(&sampler->ring);
+	kfree(sampler->rx_buf);
+	kfree(sampler->request);
+	kfree(sampler);
+}
+
+static enum hrtimer_restart driver_sampler_timer(struct hrtimer *timer)
+{
+	/*
+		Timer of a sampler, fires every period: queues the canned transfer on the bus, where the scheduler
+		starts it as an asynchronous transfer. If the previous transfer is still queued or in flight,
+		the period is lost, as are the periods the timer fired too late for.
+	*/
+	struct driver_sampler *sampler = container_of(timer, struct driver_sampler, timer);
+	struct spi_device_state *spi_device = sampler->request->cs_state->spi_device;
+	ulong flags;
+	u64 late;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (sampler->pending) {
+		sampler->overruns++;
+	}
+	else {
+		sampler->pending = 1;
+		sampler->request_seq = sampler->seq;
+		device_bus_queue(spi_device, sampler->request);
+	}
+	late = hrtimer_forward_now(timer, ns_to_ktime(sampler->period_ns)) - 1;
+	sampler->seq += 1 + late;
+	sampler->overruns += late;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	return HRTIMER_RESTART;
+}
+
+static void driver_sampler_store(struct driver_sampler *sampler,
+								 u64 start_ns)
+{
+	/*
+		Stores the response of a completed sampling transfer as a record of the ring, or counts it as lost
+		if the ring is full. Records are written whole, so readers never see part of one.
+		Called from the interrupt thread with xfer_lock held.
+	*/
+	static const u8 padding[8];
+	struct stz_spi_sample sample = {
+		.timestamp_ns = start_ns,
+		.seq = sampler->request_seq,
+		.overruns = sampler->overruns,
+	};
+
+	if (kfifo_avail(&sampler->ring) < sampler->record_size) {
+		sampler->overruns++;
+	}
+	else {
+		kfifo_in(&sampler->ring, &sample, sizeof(sample));
+		kfifo_in(&sampler->ring, sampler->rx_buf, sampler->rx_len);
+		kfifo_in(&sampler->ring, padding, sampler->record_size - sizeof(sample) - sampler->rx_len);
+	}
+	sampler->pending = 0;
+	wake_up(&sampler->wait);
+}
+
+static ssize_t driver_sampler_read(struct driver_sampler *sampler,
+								   struct iov_iter *to,
+								   char nowait)
+{
+	/*
+		Transfers whole records from the ring of the sampler to user space through read_buffer, as many as fit.
+		If the ring is empty, waits for the next record, or returns -EAGAIN with nowait.
+		Returns 0 once sampling has stopped and every record has been read, -EINVAL if no record fits.
+	*/
+	size_t len = 0;
+	size_t done;
+	uint chunk;
+
+	if (iov_iter_count(to) < sampler->record_size) {
+		return -EINVAL;
+	}
+
+	while (len == 0) {
+		if (kfifo_len(&sampler->ring) < sampler->record_size) {
+			if (!sampler->running) {
+				return 0;
+			}
+			if (nowait) {
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(sampler->wait, kfifo_len(&sampler->ring) >= sampler->record_size || !sampler->running)) {
+				return -ERESTARTSYS;
+			}
+		}
+
+		// Another reader may have emptied the ring first, then wait again
+		mutex_lock(&sampler->read_lock);
+		len = min_t(size_t, iov_iter_count(to) / sampler->record_size, kfifo_len(&sampler->ring) / sampler->record_size) * sampler->record_size;
+		for (done = 0; done < len; done += chunk) {
+			chunk = kfifo_out(&sampler->ring, sampler->read_buffer, min_t(size_t, len - done, MSG_BUFFER_SIZE));
+			if (copy_to_iter(sampler->read_buffer, chunk, to) != chunk) {
+				printk("SPI device: error while writing data to user buffer.\n");
+				mutex_unlock(&sampler->read_lock);
+				return -EFAULT;
+			}
+		}
+		mutex_unlock(&sampler->read_lock);
+	}
+	return len;
+}
+
+static void device_bus_lock(struct spi_device_state *spi_device,
+							struct driver_client *client)
+{
+	/*
+		Takes the bus for transfers from process context, for a client of the bus scheduler:
+		queues a request of the client and waits until the scheduler grants it the bus.
+		Only the xfer_lock spinlock is taken, so clients prepare their data and queue
+		without waiting for each other; they only wait for their turn on the bus.
+		The request is the client's lock_request, which stays the bus owner until device_bus_unlock:
+		a client takes the bus from one call at a time (the io_lock of a file, the io_mutex of the SPI core).
+	*/
+	struct driver_request *request = &client->lock_request;
+	ulong flags;
+
+	request->client = client;
+	request->iocb = NULL;
+	request->sampler = NULL;
+	init_completion(&request->granted);
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	device_bus_queue(spi_device, request);
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+	wait_for_completion(&request->granted);
+}
+
+static void device_bus_unlock(struct spi_device_state *spi_device)
+{
+	/*
+		Releases the bus taken with device_bus_lock and grants it to the next client.
+	*/
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	spi_device->bus_owner = NULL;
+	device_bus_schedule(spi_device);
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static void device_bus_queue(struct spi_device_state *spi_device,
+							 struct driver_request *request)
+{
+	/*
+		Queues a request for the bus behind the other requests of its client.
+		A client that had no requests joins the end of the round of clients.
+		Called with xfer_lock held.
+	*/
+	struct driver_client *client = request->client;
+
+	list_add_tail(&request->list, &client->requests);
+	if (list_empty(&client->sched)) {
+		list_add_tail(&client->sched, &spi_device->bus_clients);
+	}
+	device_bus_schedule(spi_device);
+}
+
+static void device_bus_schedule(struct spi_device_state *spi_device)
+{
+	/*
+		Bus scheduler: if the bus is free, grants it to the first request of the next client in turn,
+		which then goes to the end of the round if it has more requests. Every client with requests
+		is served once per round, whatever its CS line and however many requests it has queued.
+		An asynchronous write or a sampler transfer is started right away, a waiting process is woken up.
+		Called with xfer_lock held, from process context or from the interrupt thread.
+	*/
+	struct driver_client *client;
+	struct driver_request *request;
+
+	if (spi_device->bus_owner || list_empty(&spi_device->bus_clients)) {
+		return;
+	}
+	client = list_first_entry(&spi_device->bus_clients, struct driver_client, sched);
+	request = list_first_entry(&client->requests, struct driver_request, list);
+	list_del(&request->list);
+	list_del_init(&client->sched);
+	if (!list_empty(&client->requests)) {
+		list_add_tail(&client->sched, &spi_device->bus_clients);
+	}
+
+	spi_device->bus_owner = request;
+	if (request->iocb || request->sampler) {
+		device_async_start(spi_device, request);
+	}
+	else {
+		complete(&request->granted);
+	}
+}
+
+static void device_async_start(struct spi_device_state *spi_device,
+							   struct driver_request *request)
+{
+	/*
+		Starts sending an asynchronous write the bus was granted to, as an interrupt driven transfer.
+		The response of a sampler transfer goes to its rx_buf, without the first rx_skip frames.
+		Called with xfer_lock held.
+	*/
+	struct driver_sampler *sampler = request->sampler;
+
+	device_select_cs(request->cs_state);
+	device_set_cs_mode(spi_device, CS_MODE_HOLD);
+	if (sampler) {
+		device_transfer_init(spi_device, sampler->rx_buf, NULL, request->len, 1, XFER_ASYNC);
+		spi_device->xfer_rx_skip = sampler->rx_skip;
+	}
+	else {
+		device_transfer_init(spi_device, NULL, request->rx_cs, request->len, 1, XFER_ASYNC);
+	}
+	spi_device->xfer_tx_buf = request->tx_buf;
+	spi_device->xfer_tx_len = request->len;
+	spi_device->xfer_end = 1;
+	device_write(spi_device);
+	device_set_rx_mark(spi_device);
+}
+
+static void device_async_complete(struct spi_device_state *spi_device)
+{
+	/*
+		Completes the asynchronous write that was sent, releasing CS and the room it reserved in rx_ring,
+		and grants the bus to the next client, so queued writes are sent back-to-back from the interrupt thread.
+		Called with xfer_lock held.
+		The request of a sampler is kept for its next period, its response is stored.
+	*/
+	struct driver_request *request = spi_device->bus_owner;
+
+	device_set_cs_mode(spi_device, CS_MODE_AUTO);
+	if (request->sampler) {
+		driver_sampler_store(request->sampler, spi_device->xfer_start_ns);
+	}
+	else {
+		request->client->async_queued--;
+		if (request->rx_cs) {
+			request->rx_cs->rx_reserved -= request->len;
+			wake_up_interruptible(&request->rx_cs->rx_room_wait);
+		}
+		request->iocb->ki_complete(request->iocb, request->len);
+		kfree(request);
+	}
+
+	spi_device->bus_owner = NULL;
+	device_bus_schedule(spi_device);
+}
+
+static void device_set_speed(struct spi_device_state *spi_device,
+							 u32 speed_hz)
+{
+	/*
+		Sets the SCK rate to at most speed_hz.
+	*/
+	device_set_sck_div(spi_device, device_sck_div(spi_device, speed_hz));
+}
+
+static uint device_sck_div(struct spi_device_state *spi_device,
+						   u32 speed_hz)
+{
+	/*
+		Returns the SCK divisor for a rate of at most speed_hz: f_sck = f_in / (2 * (div + 1)).
+	*/
+	ulong div = DIV_ROUND_UP(spi_device->clk_rate, 2 * (ulong) speed_hz);
+
+	div = div ? div - 1 : 0;
+	return min_t(ulong, div, SCK_DIV_MASK);
+}
+
+static void device_mode_regs(u32 mode,
+							 uint *sck_mode,
+							 uint *fmt)
+{
+	/*
+		Returns the SCK_MODE and FMT values of a mode (SPI_CPHA, SPI_CPOL and SPI_LSB_FIRST bits).
+	*/
+	*sck_mode = (mode & SPI_CPHA) ? CLK_PHASE_SAMPLE_TRAIL_EDGE : CLK_PHASE_SAMPLE_LEAD_EDGE;
+	*sck_mode |= ((mode & SPI_CPOL) ? CLK_POLARITY_HIGH : CLK_POLARITY_LOW) << SCK_POLARITY_SHIFT;
+	*fmt = PROTOCOL_SINGLE
+		| (((mode & SPI_LSB_FIRST) ? LSB_ENDIANNESS : MSB_ENDIANNESS) << FMT_ENDIANNESS_SHIFT)
+		| (FRAME_LENGTH << FMT_LENGTH_SHIFT);
+}
+
+static void device_set_cs_polarity(struct spi_device_state *spi_device,
+								   uint cs,
+								   char cs_high)
+{
+	/*
+		Sets the inactive level of a CS line in CS_DEF.
+	*/
+	if (cs_high) {
+		spi_device->cs_inactive &= ~(1U << cs);
+	}
+	else {
+		spi_device->cs_inactive |= (1U << cs);
+	}
+	write_to_reg(BASEADDRESS+SPI_CS_DEF_R, spi_device->cs_inactive);
+}
+
+static void device_select_cs(struct spi_cs_state *cs_state)
+{
+	/*
+		Switches the bus to a CS line, programming the controller with the line's configuration.
+		Nothing is written if the line's configuration is already programmed.
+		Called with the bus held.
+	*/
+	struct spi_device_state *spi_device = cs_state->spi_device;
+
+	if (spi_device->cs_current == cs_state) {
+		return;
+	}
+	write_to_reg(BASEADDRESS+SPI_CS_ID_R, cs_state->cs);
+	spi_device->cs_id = cs_state->cs;
+	write_to_reg(BASEADDRESS+SPI_SCK_MODE_R, cs_state->sck_mode);
+	device_set_fmt(spi_device, cs_state->fmt);
+	device_set_delays(spi_device, cs_state->delay0, cs_state->delay1);
+	device_set_sck_div(spi_device, cs_state->sck_div);
+	spi_device->cs_current = cs_state;
+}
+
+static uint device_lanes_proto(uint lanes)
+{
+	/*
+		Returns the FMT/FFMT protocol field for a number of data lines, or UINT_MAX if the controller has no such mode.
+	*/
+	switch (lanes) {
+	case 1:
+		return PROTOCOL_SINGLE;
+	case 2:
+		return PROTOCOL_DUAL;
+	case 4:
+		return PROTOCOL_QUAD;
+	default:
+		return UINT_MAX;
+	}
+}
+
+static void device_set_fmt(struct spi_device_state *spi_device,
+						   uint fmt)
+{
+	/*
+		Writes the frame format, if it changed.
+	*/
+	if (spi_device->fmt != fmt) {
+		spi_device->fmt = fmt;
+		write_to_reg(BASEADDRESS+SPI_FMT_R, fmt);
+	}
+}
+
+static void device_set_ie(struct spi_device_state *spi_device,
+						  uint ie)
+{
+	/*
+		Writes the interrupt enable register, if it changed.
+	*/
+	if (spi_device->xfer_ie != ie) {
+		spi_device->xfer_ie = ie;
+		write_to_reg(BASEADDRESS+SPI_IE_R, ie);
+	}
+}
+
+static void device_set_delays(struct spi_device_state *spi_device,
+							  uint delay0,
+							  uint delay1)
+{
+	/*
+		Writes DELAY_0 and DELAY_1, each only if its value changes.
+	*/
+	if (spi_device->delay0 != delay0) {
+		spi_device->delay0 = delay0;
+		write_to_reg(BASEADDRESS+SPI_DELAY_0_R, delay0);
+	}
+	if (spi_device->delay1 != delay1) {
+		spi_device->delay1 = delay1;
+		write_to_reg(BASEADDRESS+SPI_DELAY_1_R, delay1);
+	}
+}
+
+static void device_set_cs_mode(struct spi_device_state *spi_device,
+							   uint cs_mode)
+{
+	/*
+		Writes the CS mode, if it changed: CS_MODE_HOLD keeps CS asserted between frames
+		until CS_MODE_AUTO, which releases it after every frame, is set again.
+	*/
+	if (spi_device->cs_mode != cs_mode) {
+		spi_device->cs_mode = cs_mode;
+		write_to_reg(BASEADDRESS+SPI_CS_MODE_R, cs_mode);
+	}
+}
+
+static void device_set_sck_div(struct spi_device_state *spi_device,
+							   uint sck_div)
+{
+	/*
+		Writes the SCK divisor and keeps the SCK period, used to estimate transfer times.
+		Nothing is written if the divisor is already programmed.
+	*/
+	if (spi_device->sck_div == sck_div) {
+		return;
+	}
+	spi_device->sck_div = sck_div;
+	spi_device->sck_period_ns = DIV_ROUND_UP_ULL(2 * (sck_div + 1) * (u64) NSEC_PER_SEC, spi_device->clk_rate);
+	write_to_reg(BASEADDRESS+SPI_SCK_DIV_R, sck_div);
+}
+
+static void device_write(struct spi_device_state *spi_device)
+{
+	/*
+		Writes data from the transfer's tx buffer into spi txdata fifo.
+		At most fifo_depth frames are kept in flight, so the rx fifo can never overrun
+		and the tx fifo never needs to be checked for space.
+		Completes xfer_tx_done once the tx buffer has been written to the fifo.
+	*/
+	uint *i = &(spi_device->xfer_tx_index);
+	uint frames = 0;
+	u8 data;
+
+	// Loop until fifo holds fifo_depth frames, or end of tx buffer.
+	while (*i < spi_device->xfer_tx_len
+		   && spi_device->xfer_tx_count - spi_device->xfer_rx_count < spi_device->fifo_depth) {
+		data = spi_device->xfer_tx_buf ? spi_device->xfer_tx_buf[*i] : spi_device->xfer_tx_fill;
+
+		// Write character to TXDATA register
+		write_to_reg(BASEADDRESS + SPI_TXDATA_R, data);
+		(*i)++;
+		spi_device->xfer_tx_count++;
+		frames++;
+	}
+
+	// Count a stall when tx data is left and the fifo has no room, once until it takes data again
+	if (frames) {
+		trace_stz_spi_fifo_refill(spi_device->id, frames, spi_device->xfer_tx_count - spi_device->xfer_rx_count);
+		spi_device->xfer_tx_stalled = 0;
+	}
+	else if (*i < spi_device->xfer_tx_len && !spi_device->xfer_tx_stalled) {
+		spi_device->xfer_tx_stalled = 1;
+		spi_device->xfer_tx_stalls++;
+	}
+
+	// If the tx buffer is in the fifo, the caller may reuse it
+	if (spi_device->xfer_tx_busy && *i == spi_device->xfer_tx_len) {
+		spi_device->xfer_tx_busy = 0;
+		complete(&spi_device->xfer_tx_done);
+	}
+}
+
+static void device_read(struct spi_device_state *spi_device,
+						uint ready)
+{
+	/*
+		Reads data from spi rxdata fifo into the transfer's rx buffer or ring.
+		ready frames are known to be in the fifo (the rx watermark said so): exactly these are read,
+		without checking the fifo for each one. With ready 0, reads until the fifo is empty.
+		Readers waiting for the ring are woken once the fifo is drained.
+	*/
+	ulong data;
+	uint rx_count = spi_device->xfer_rx_count;
+
+	// Nothing in flight
+	if (spi_device->xfer_rx_count == spi_device->xfer_tx_count) {
+		return;
+	}
+
+	// Transmit only: nothing is received, but below the tx watermark at most tx_mark - 1 frames are left in the fifo
+	if (spi_device->xfer_dir_tx) {
+		if (read_from_reg(BASEADDRESS+SPI_IP_R) & INTERRUPT_TX) {
+			spi_device->xfer_rx_count = max(rx_count, spi_device->xfer_tx_count - min(spi_device->xfer_tx_count, spi_device->tx_mark - 1));
+		}
+		return;
+	}
+
+	// Read data, loop until fifo is empty or the ready frames are read.
+	while (spi_device->xfer_rx_count != spi_device->xfer_tx_count) {
+		// Read character from RXDATA register
+		data = read_from_reg(BASEADDRESS + SPI_RXDATA_R);
+		if (!ready && (data & RX_FIFO_EMPTY)) {
+			break;
+		}
+		if (spi_device->xfer_rx_buf) {
+			if (spi_device->xfer_rx_count >= spi_device->xfer_rx_skip) {
+				spi_device->xfer_rx_buf[spi_device->xfer_rx_count - spi_device->xfer_rx_skip] = (u8) (data & SPI_DATA);
+			}
+		}
+		else if (spi_device->xfer_rx_cs) {
+			if (!kfifo_put(&spi_device->xfer_rx_cs->rx_ring, (u8) (data & SPI_DATA))) {
+				spi_device->xfer_rx_overruns++;
+			}
+		}
+		spi_device->xfer_rx_count++;
+		if (ready && --ready == 0) {
+			break;
+		}
+	}
+
+	if (spi_device->xfer_rx_cs && spi_device->xfer_rx_count != rx_count) {
+		wake_up_interruptible(&spi_device->xfer_rx_cs->rx_wait);
+	}
+}
+
+static irqreturn_t spi_interrupt_handler(int irq, void* dev_id) 
+{
+	/*
+		Hard interrupt handler. dev_id is the state of the controller that owns the line.
+		Acknowledges an rx watermark interrupt (or a tx watermark interrupt for transmit-only transfers)
+		and wakes spi_interrupt_thread. The watermark interrupt stays pending until the fifo is drained
+		or refilled, so the line is kept masked (IRQF_ONESHOT) until then.
+	*/
+	struct spi_device_state *spi_device = dev_id;
+	u32 ip = read_from_reg(BASEADDRESS+SPI_IP_R);
+
+	trace_stz_spi_irq(spi_device->id, ip, spi_device->xfer_ie);
+	if (!(ip & spi_device->xfer_ie)) {
+		return IRQ_NONE;
+	}
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t spi_interrupt_thread(int irq, void* dev_id) 
+{
+	/*
+		Threaded interrupt handler.
+		Calls device_read to drain a batch of received frames, then device_write to refill the fifo,
+		and moves the rx watermark to the end of the next batch.
+		Ends the transfer once every frame sent has been received.
+	*/
+	struct spi_device_state *spi_device = dev_id;
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (!spi_device->xfer_active || spi_device->xfer_poll) {
+		spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+		return IRQ_NONE;
+	}
+	spi_device->xfer_irqs++;
+
+	// Recieve actions
+	device_read(spi_device, 0);
+
+	// Transmit actions
+	if (device_transfer_done(spi_device)) {
+		device_transfer_complete(spi_device);
+	}
+	else {
+		device_write(spi_device);
+		device_set_rx_mark(spi_device);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+
+	return IRQ_HANDLED;
+}
+
+static void device_transfer_start(struct spi_device_state *spi_device,
+								  u8 *rx_buf,
+								  struct spi_cs_state *rx_cs,
+								  uint len,
+								  uint lanes,
+								  char owner)
+{
+	/*
+		Starts a full-duplex transfer of len bytes. Tx data is supplied with device_transfer_append
+		and the transfer is ended with device_transfer_finish.
+		Received bytes go to rx_buf, or to the rx_ring of rx_cs (dropped when the ring is full),
+		or are discarded if both are NULL.
+		With 2 or 4 lanes the transfer is half duplex on that many data lines: it receives if it has
+		rx_buf or rx_cs (the tx data is then not sent), otherwise it transmits.
+		Transfers expected to take less than poll_threshold_us are polled, longer ones are moved
+		by the interrupt handler.
+		An interrupt driven transfer from the SPI core is finalized with spi_finalize_current_transfer,
+		otherwise xfer_done is completed.
+	*/
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	device_transfer_init(spi_device, rx_buf, rx_cs, len, lanes, owner);
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static void device_transfer_init(struct spi_device_state *spi_device,
+								 u8 *rx_buf,
+								 struct spi_cs_state *rx_cs,
+								 uint len,
+								 uint lanes,
+								 char owner)
+{
+	/*
+		Sets up the transfer state for device_transfer_start and programs its data lines and direction.
+		Asynchronous writes are always interrupt driven.
+		Called with xfer_lock held.
+	*/
+	u64 time_ns = div_u64((u64) len * FRAME_LENGTH, lanes) * spi_device->sck_period_ns;
+
+	spi_device->xfer_start_ns = ktime_get_ns();
+	spi_device->xfer_rx_ready_ns = spi_device->xfer_start_ns;
+	spi_device->xfer_error = 0;
+	spi_device->xfer_lanes = lanes;
+	spi_device->xfer_dir_tx = lanes > 1 && rx_buf == NULL && rx_cs == NULL;
+	device_set_fmt(spi_device, (spi_device->fmt & ~(FMT_PROTO_MASK | FMT_DIR_TX))
+		| device_lanes_proto(lanes) | (spi_device->xfer_dir_tx ? FMT_DIR_TX : 0));
+
+	spi_device->xfer_poll = spi_device->irq < 0
+		|| (owner != XFER_ASYNC && time_ns < (u64) poll_threshold_us * NSEC_PER_USEC);
+	trace_stz_spi_transfer_start(spi_device->id, spi_device->cs_id, len, lanes, spi_device->xfer_poll);
+	spi_device->xfer_tx_buf = NULL;
+	spi_device->xfer_tx_fill = 0;
+	spi_device->xfer_stream = 0;
+	spi_device->xfer_tx_len = 0;
+	spi_device->xfer_tx_index = 0;
+	spi_device->xfer_tx_busy = 0;
+	spi_device->xfer_rx_buf = rx_buf;
+	spi_device->xfer_rx_cs = rx_cs;
+	spi_device->xfer_rx_skip = 0;
+	spi_device->xfer_tx_count = 0;
+	spi_device->xfer_rx_count = 0;
+	spi_device->xfer_irqs = 0;
+	spi_device->xfer_tx_stalled = 0;
+	spi_device->xfer_tx_stalls = 0;
+	spi_device->xfer_rx_overruns = 0;
+	spi_device->xfer_end = 0;
+	spi_device->xfer_owner = owner;
+	spi_device->xfer_active = 1;
+	reinit_completion(&spi_device->xfer_tx_done);
+	reinit_completion(&spi_device->xfer_done);
+	if (spi_device->xfer_dir_tx && spi_device->tx_mark != 1) {
+		spi_device->tx_mark = 1;													// refill once the fifo is empty, see device_set_rx_mark
+		write_to_reg(BASEADDRESS+SPI_TX_MARK_R, spi_device->tx_mark);
+	}
+	if (!spi_device->xfer_poll && !spi_device->xfer_dir_tx) {
+		device_set_ie(spi_device, INTERRUPT_RX);
+	}
+}
+
+static void device_transfer_append(struct spi_device_state *spi_device,
+								   const u8 *tx_buf,
+								   uint len)
+{
+	/*
+		Gives the next len bytes to send. A NULL tx_buf sends zeros, or the transfer's xfer_tx_fill.
+		xfer_tx_done is completed once they are all in the fifo, the interrupt handler sends the rest.
+		A polled transfer returns once they are all in the fifo.
+	*/
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	spi_device->xfer_tx_buf = tx_buf;
+	spi_device->xfer_tx_len = len;
+	spi_device->xfer_tx_index = 0;
+	spi_device->xfer_tx_busy = 1;
+	if (!spi_device->xfer_poll) {
+		device_write(spi_device);
+		device_set_rx_mark(spi_device);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+
+	// Polled transfers are moved here, without holding xfer_lock
+	if (spi_device->xfer_poll) {
+		device_transfer_poll(spi_device, 0);
+	}
+}
+
+static void device_transfer_finish(struct spi_device_state *spi_device)
+{
+	/*
+		Marks the last tx data as appended: the transfer ends once all of it has been received.
+		A polled transfer is complete when this returns.
+	*/
+	ulong flags;
+
+	if (spi_device->xfer_poll) {
+		device_transfer_poll(spi_device, 1);
+	}
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	spi_device->xfer_end = 1;
+	if (spi_device->xfer_active && device_transfer_done(spi_device)) {
+		device_transfer_complete(spi_device);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static int device_transfer_poll(struct spi_device_state *spi_device,
+								char until_done)
+{
+	/*
+		Moves data between the buffers and the fifos until the tx buffer has been written
+		to the fifo, or with until_done, until every frame sent has also been received.
+		Frames are received a batch at a time, as by the interrupt handler: the rx watermark is set
+		to the batch, and SPI_IP_R is checked once the batch can have been clocked (xfer_rx_ready_ns),
+		then every quarter of a frame, as frames take longer with the CS delays. So the bus is not
+		flooded with reads, and the batch is read without checking the fifo for each frame.
+		If the fifo stops moving for longer than its frames can take with the largest delays, plus POLL_TIMEOUT_NS,
+		the transfer is ended (device_transfer_abort) and -ETIMEDOUT returned, as for the rest of the transfer.
+	*/
+	ulong frame_ns = DIV_ROUND_UP(FRAME_LENGTH, spi_device->xfer_lanes) * spi_device->sck_period_ns;
+	ulong frame_max_ns = frame_ns + 4 * DELAY_MASK * spi_device->sck_period_ns;	// with the four CS and frame delays
+	uint in_flight, batch, rx_count;
+	u64 now, deadline;
+
+	if (spi_device->xfer_error) {
+		return device_transfer_abort(spi_device);
+	}
+	deadline = ktime_get_ns() + spi_device->fifo_depth * frame_max_ns + POLL_TIMEOUT_NS;
+
+	for (;;) {
+		device_write(spi_device);
+		in_flight = spi_device->xfer_tx_count - spi_device->xfer_rx_count;
+
+		if (spi_device->xfer_tx_index == spi_device->xfer_tx_len && (!until_done || in_flight == 0)) {
+			break;
+		}
+
+		// Transmit only: nothing is received, device_read follows the tx watermark
+		if (spi_device->xfer_dir_tx) {
+			rx_count = spi_device->xfer_rx_count;
+			device_read(spi_device, 0);
+			now = ktime_get_ns();
+			if (spi_device->xfer_rx_count != rx_count) {
+				deadline = now + spi_device->fifo_depth * frame_max_ns + POLL_TIMEOUT_NS;
+			}
+			else if (now > deadline) {
+				return device_transfer_abort(spi_device);
+			}
+			cpu_relax();
+			continue;
+		}
+
+		batch = min(device_batch(spi_device), in_flight);
+		device_set_rx_mark(spi_device);
+
+		// Frames are not clocked faster than frame_ns, so the batch is not received before this
+		spi_device->xfer_rx_ready_ns += batch * frame_ns;
+		now = ktime_get_ns();
+		if (spi_device->xfer_rx_ready_ns > now) {
+			ndelay(spi_device->xfer_rx_ready_ns - now);
+		}
+		deadline = max(now, spi_device->xfer_rx_ready_ns) + batch * frame_max_ns + POLL_TIMEOUT_NS;
+		while (!(read_from_reg(BASEADDRESS+SPI_IP_R) & INTERRUPT_RX)) {
+			// Slower than that, the estimate starts again from when the batch is received
+			ndelay(frame_ns / 4);
+			spi_device->xfer_rx_ready_ns = ktime_get_ns();
+			if (spi_device->xfer_rx_ready_ns > deadline) {
+				return device_transfer_abort(spi_device);
+			}
+			cpu_relax();
+		}
+		device_read(spi_device, batch);
+	}
+	return NO_ERROR;
+}
+
+static int device_transfer_abort(struct spi_device_state *spi_device)
+{
+	/*
+		Ends a polled transfer that timed out: its tx data is dropped and the frames in flight are given up,
+		so xfer_tx_done and xfer_done are completed and the owner finds -ETIMEDOUT in xfer_error.
+		Data appended afterwards is dropped the same way.
+	*/
+	if (!spi_device->xfer_error) {
+		printk("SPI device: polled transfer timed out.\n");
+		spi_device->xfer_error = -ETIMEDOUT;
+	}
+	spi_device->xfer_tx_index = spi_device->xfer_tx_len;
+	spi_device->xfer_rx_count = spi_device->xfer_tx_count;
+	device_write(spi_device);
+	return spi_device->xfer_error;
+}
+
+static char device_transfer_done(struct spi_device_state *spi_device)
+{
+	/*
+		Returns 1 when the transfer has ended and every frame sent has been received.
+	*/
+	return spi_device->xfer_end
+		&& spi_device->xfer_tx_index == spi_device->xfer_tx_len
+		&& spi_device->xfer_rx_count == spi_device->xfer_tx_count;
+}
+
+static void device_transfer_complete(struct spi_device_state *spi_device)
+{
+	/*
+		Stops the interrupt handler, updates the counters of the controller and of the CS line
+		and wakes the transfer's owner.
+		A transmit-only transfer first waits for its last frame to leave the shift register,
+		so that the next transfer can change the direction of the data lines.
+	*/
+	struct driver_cs_stats *cs_stats = &spi_device->cs_states[spi_device->cs_id].stats;
+	u64 ns = ktime_get_ns() - spi_device->xfer_start_ns;
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	uint rx = spi_device->xfer_dir_tx ? 0 : spi_device->xfer_rx_count;
+
+	if (!spi_device->xfer_poll) {
+		device_set_ie(spi_device, 0);
+	}
+	if (spi_device->xfer_dir_tx) {
+		ndelay((DIV_ROUND_UP(FRAME_LENGTH, spi_device->xfer_lanes) + (spi_device->delay0 & DELAY_MASK))
+			   * spi_device->sck_period_ns);
+	}
+	spi_device->xfer_active = 0;
+	trace_stz_spi_transfer_end(spi_device->id, spi_device->cs_id, spi_device->xfer_tx_count, rx, spi_device->xfer_irqs, ns);
+
+	cs_stats->tx_bytes += spi_device->xfer_tx_count;
+	cs_stats->rx_bytes += rx;
+	cs_stats->transfers++;
+	cs_stats->irqs += spi_device->xfer_irqs;
+	cs_stats->tx_stalls += spi_device->xfer_tx_stalls;
+	cs_stats->rx_overruns += spi_device->xfer_rx_overruns;
+	cs_stats->latency[us ? min_t(uint, ilog2(us) + 1, LATENCY_BUCKETS - 1) : 0]++;
+
+	if (spi_device->xfer_poll) {
+		spi_device->stats.polled_transfers++;
+	}
+	else {
+		spi_device->stats.irq_transfers++;
+	}
+	spi_device->stats.transfers++;
+	spi_device->stats.bytes += spi_device->xfer_tx_count;
+	spi_device->stats.irqs += spi_device->xfer_irqs;
+	spi_device->stats.last_bytes = spi_device->xfer_tx_count;
+	spi_device->stats.last_irqs = spi_device->xfer_irqs;
+	spi_device->stats.busy_ns += ns;
+	spi_device->stats.clocked_ns += div_u64((u64) spi_device->xfer_tx_count * FRAME_LENGTH, spi_device->xfer_lanes) * spi_device->sck_period_ns;
+	spi_device->stats.rx_overruns += spi_device->xfer_rx_overruns;
+	if (spi_device->xfer_stream) {
+		spi_device->stats.stream_bytes += rx;
+		spi_device->stats.stream_ns += ns;
+	}
+
+	if (spi_device->xfer_owner == XFER_CDEV) {
+		complete(&spi_device->xfer_done);
+	}
+	else if (spi_device->xfer_owner == XFER_ASYNC) {
+		device_async_complete(spi_device);
+	}
+	else if (!spi_device->xfer_poll) {
+		spi_finalize_current_transfer(spi_device->controller);
+	}
+}
+
+static uint device_fifo_depth(struct spi_device_state *spi_device,
+							  struct device *dev)
+{
+	/*
+		Returns the depth of the fifos: the sifive,fifo-depth property of the device tree node,
+		or else the width of the watermark fields, which hold 0 to depth - 1 (found by writing
+		all ones to TX_MARK and reading it back). Called at probe, TX_MARK is programmed afterwards.
+	*/
+	u32 depth;
+
+	if (!device_property_read_u32(dev, "sifive,fifo-depth", &depth) && depth >= 1 && depth <= MAX_FIFO_DEPTH) {
+		return depth;
+	}
+	write_to_reg(BASEADDRESS+SPI_TX_MARK_R, MAX_FIFO_DEPTH - 1);
+	depth = read_from_reg(BASEADDRESS+SPI_TX_MARK_R) + 1;
+	return (depth > 1 && depth <= MAX_FIFO_DEPTH) ? depth : FIFO_DEPTH;
+}
+
+static uint device_batch(struct spi_device_state *spi_device)
+{
+	/*
+		Returns the frames received per interrupt or polled batch: irq_batch, or half the fifo.
+	*/
+	return irq_batch ? min(irq_batch, spi_device->fifo_depth) : max(spi_device->fifo_depth / 2, 1U);
+}
+
+static void device_set_rx_mark(struct spi_device_state *spi_device)
+{
+	/*
+		Sets the rx watermark so that the next interrupt comes when a batch of irq_batch frames,
+		or the rest of the frames in flight, has been received.
+		Nothing is written if the watermark is unchanged or no frame is in flight.
+		Transmit-only transfers use the tx watermark instead: the interrupt comes when irq_batch frames
+		of room are free in the fifo, or once it is empty if all the tx data is in it.
+		Their interrupt is disabled while no frame is in flight, the tx watermark would stay pending.
+	*/
+	uint in_flight = spi_device->xfer_tx_count - spi_device->xfer_rx_count;
+	uint batch = device_batch(spi_device);
+	uint mark;
+
+	if (spi_device->xfer_dir_tx) {
+		if (in_flight == 0) {
+			device_set_ie(spi_device, 0);
+			return;
+		}
+		mark = (spi_device->xfer_tx_index < spi_device->xfer_tx_len) ? min(spi_device->fifo_depth - batch + 1, in_flight) : 1;
+		if (spi_device->tx_mark != mark) {
+			spi_device->tx_mark = mark;
+			write_to_reg(BASEADDRESS+SPI_TX_MARK_R, spi_device->tx_mark);	// interrupt when tx fifo holds less than tx_mark frames
+		}
+		device_set_ie(spi_device, INTERRUPT_TX);
+		return;
+	}
+
+	if (in_flight == 0) {
+		return;
+	}
+	batch = min(batch, in_flight);
+	if (spi_device->rx_mark != batch - 1) {
+		spi_device->rx_mark = batch - 1;
+		write_to_reg(BASEADDRESS+SPI_RX_MARK_R, spi_device->rx_mark);		// interrupt when rx fifo holds more than rx_mark frames
+	}
+}
+
+// SPI core interface
+
+static int controller_setup(struct spi_device *device)
+{
+	/*
+		Called by the SPI core when a slave device is added or its mode changes.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(device->controller);
+
+	if (device->chip_select >= spi_device->num_cs) {
+		return -EINVAL;
+	}
+	if (device->bits_per_word != FRAME_LENGTH) {
+		return -EINVAL;
+	}
+	return NO_ERROR;
+}
+
+static int controller_prepare_message(struct spi_controller *controller,
+									  struct spi_message *message)
+{
+	/*
+		Called by the SPI core's message pump before the first transfer of a message.
+		Takes the bus from /dev/spiN users and configures it for the message's slave.
+		The bus is released in controller_unprepare_message.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(controller);
+
+	device_bus_lock(spi_device, &spi_device->core_client);
+	controller_select_slave(spi_device, message->spi);
+
+	// Discard stale data left in rx fifo
+	while (!(read_from_reg(BASEADDRESS + SPI_RXDATA_R) & RX_FIFO_EMPTY));
+
+	return NO_ERROR;
+}
+
+static void controller_select_slave(struct spi_device_state *spi_device,
+									struct spi_device *device)
+{
+	/*
+		Configures the bus for a slave of the SPI core: CS line and polarity, clock mode and frame format.
+		Called with the bus held. The SCK rate and the delays are set by each transfer.
+	*/
+	uint sck_mode, fmt;
+
+	// Chip select polarity and line
+	device_set_cs_polarity(spi_device, device->chip_select, device->mode & SPI_CS_HIGH);
+	write_to_reg(BASEADDRESS+SPI_CS_ID_R, device->chip_select);
+	spi_device->cs_id = device->chip_select;
+
+	// Clock mode and frame format
+	device_mode_regs(device->mode, &sck_mode, &fmt);
+	write_to_reg(BASEADDRESS+SPI_SCK_MODE_R, sck_mode);
+	device_set_fmt(spi_device, fmt);
+	spi_device->cs_current = NULL;				// /dev/spiN transfers reprogram their context
+}
+
+static int controller_set_cs_timing(struct spi_device *device)
+{
+	/*
+		Called by the SPI core when the CS delays of a slave change. The delays are programmed
+		into DELAY_0 and DELAY_1 by each transfer, so the core does not wait for them itself.
+	*/
+	return NO_ERROR;
+}
+
+static uint controller_delay_cycles(struct spi_device_state *spi_device,
+									struct spi_delay *delay,
+									uint cycles)
+{
+	/*
+		Returns a delay of the SPI core in SCK cycles at the current rate, at most DELAY_MASK,
+		or cycles if the delay is not set.
+	*/
+	int ns;
+
+	if (!delay->value) {
+		return cycles;
+	}
+	if (delay->unit == SPI_DELAY_UNIT_SCK) {
+		return min_t(uint, delay->value, DELAY_MASK);
+	}
+	ns = spi_delay_to_ns(delay, NULL);
+	if (ns < 0) {
+		return cycles;
+	}
+	return min_t(ulong, DIV_ROUND_UP(ns, spi_device->sck_period_ns), DELAY_MASK);
+}
+
+static int controller_unprepare_message(struct spi_controller *controller,
+										struct spi_message *message)
+{
+	/*
+		Called by the SPI core's message pump after the last transfer of a message.
+	*/
+	device_bus_unlock(spi_controller_get_devdata(controller));
+	return NO_ERROR;
+}
+
+static void controller_set_cs(struct spi_device *device,
+							  bool is_high)
+{
+	/*
+		Called by the SPI core to change the CS line level.
+		The hardware drives CS itself: hold mode keeps it asserted between frames,
+		auto mode releases it. Polarity is already handled by CS_DEF.
+		Only applied while the SPI core has the bus: spi_setup also calls it outside the messages, when another
+		client may be transferring. CS is released whenever the bus changes hands, so a message starts with it inactive.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(device->controller);
+	ulong flags;
+
+	if (device->mode & SPI_CS_HIGH) {
+		is_high = !is_high;
+	}
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	if (spi_device->bus_owner == &spi_device->core_client.lock_request) {
+		device_set_cs_mode(spi_device, is_high ? CS_MODE_AUTO : CS_MODE_HOLD);
+	}
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static int controller_transfer_one(struct spi_controller *controller,
+								   struct spi_device *device,
+								   struct spi_transfer *transfer)
+{
+	/*
+		Called by the SPI core's message pump for each spi_transfer of a message.
+		Short transfers are polled to the end, for the others
+		the interrupt handler calls spi_finalize_current_transfer when it is done.
+		Dual and quad transfers (tx_nbits, rx_nbits) must be half duplex.
+		The delays are the slave's cs_setup, cs_hold, cs_inactive and word_delay (the transfer's if it has one),
+		converted to SCK cycles at the transfer's rate; the ones the slave leaves unset come from its CS line's context.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(controller);
+	struct spi_cs_state *cs_state = &spi_device->cs_states[device->chip_select];
+	uint lanes = transfer->rx_buf ? transfer->rx_nbits : transfer->tx_nbits;
+	struct spi_delay *word_delay = transfer->word_delay.value ? &transfer->word_delay : &device->word_delay;
+
+	lanes = lanes ? lanes : 1;
+	if (transfer->tx_buf && transfer->rx_buf && max(transfer->tx_nbits, transfer->rx_nbits) > 1) {
+		return -EINVAL;
+	}
+	if (transfer->speed_hz) {
+		device_set_speed(spi_device, transfer->speed_hz);		// the core gives each transfer its rate, at most max_speed_hz
+	}
+	device_set_delays(spi_device,
+					  controller_delay_cycles(spi_device, &device->cs_setup, cs_state->delay0 & DELAY_MASK)
+					  | controller_delay_cycles(spi_device, &device->cs_hold, (cs_state->delay0 >> DELAY0_SCKCS_SHIFT) & DELAY_MASK) << DELAY0_SCKCS_SHIFT,
+					  controller_delay_cycles(spi_device, &device->cs_inactive, cs_state->delay1 & DELAY_MASK)
+					  | controller_delay_cycles(spi_device, word_delay, (cs_state->delay1 >> DELAY1_INTERXFR_SHIFT) & DELAY_MASK) << DELAY1_INTERXFR_SHIFT);
+	device_transfer_start(spi_device, transfer->rx_buf, NULL, transfer->len, lanes, XFER_CORE);
+	device_transfer_append(spi_device, transfer->tx_buf, transfer->len);
+	device_transfer_finish(spi_device);
+	if (spi_device->xfer_poll) {
+		return spi_device->xfer_error;		// polled transfers are complete, others in progress
+	}
+	return 1;
+}
+
+static void controller_handle_err(struct spi_controller *controller,
+								  struct spi_message *message)
+{
+	/*
+		Called by the SPI core when a transfer failed or timed out: stops the interrupt handler.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(controller);
+	ulong flags;
+
+	spin_lock_irqsave(&spi_device->xfer_lock, flags);
+	device_set_ie(spi_device, 0);
+	spi_device->xfer_active = 0;
+	spin_unlock_irqrestore(&spi_device->xfer_lock, flags);
+}
+
+static int controller_dirmap_create(struct spi_mem_dirmap_desc *desc)
+{
+	/*
+		Called by spi-mem when a flash driver (spi-nor) sets up a direct mapping.
+		Read mappings whose operation fits the flash instruction format (FFMT) and whose range lies
+		inside the flash window are served in flash mode. Anything else returns -EOPNOTSUPP,
+		and spi-mem then sends the operations as spi_messages through controller_transfer_one.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(desc->mem->spi->controller);
+	u32 ffmt;
+
+	if (desc->info.op_tmpl.data.dir != SPI_MEM_DATA_IN) {
+		return -EOPNOTSUPP;
+	}
+	if (desc->info.offset + desc->info.length > spi_device->flash_size
+		|| desc->info.offset + desc->info.length < desc->info.offset) {
+		return -EOPNOTSUPP;
+	}
+	if (!spi_mem_default_supports_op(desc->mem, &desc->info.op_tmpl)) {
+		return -EOPNOTSUPP;
+	}
+	return controller_flash_format(&desc->info.op_tmpl, &ffmt);
+}
+
+static ssize_t controller_dirmap_read(struct spi_mem_dirmap_desc *desc,
+									  u64 offs,
+									  size_t len,
+									  void *buf)
+{
+	/*
+		Called by spi-mem to read len bytes at offs of a direct mapping.
+		Programs the mapping's read operation into FFMT and switches the controller to flash mode,
+		in which it runs the operation itself for reads of the flash window, then copies the data
+		out of the window. The fifos are unusable in flash mode, so the bus is held throughout.
+		Returns the number of bytes read, which stops at the end of the window.
+	*/
+	struct spi_device_state *spi_device = spi_controller_get_devdata(desc->mem->spi->controller);
+	struct spi_device *device = desc->mem->spi;
+	u64 addr = desc->info.offset + offs;
+	u32 ffmt;
+
+	if (addr >= spi_device->flash_size || controller_flash_format(&desc->info.op_tmpl, &ffmt)) {
+		return -EINVAL;
+	}
+	len = min_t(u64, len, spi_device->flash_size - addr);
+
+	device_bus_lock(spi_device, &spi_device->core_client);
+	controller_select_slave(spi_device, device);
+	if (device->max_speed_hz) {
+		device_set_speed(spi_device, device->max_speed_hz);
+	}
+
+	write_to_reg(BASEADDRESS+SPI_FFMT_R, ffmt);
+	write_to_reg(BASEADDRESS+SPI_FCTRL_R, FCTRL_FLASH_MODE);
+	memcpy_fromio(buf, spi_device->flash_base + addr, len);
+	write_to_reg(BASEADDRESS+SPI_FCTRL_R, 0);
+	device_bus_unlock(spi_device);
+	return len;
+}
+
+static int controller_flash_format(const struct spi_mem_op *op,
+								   u32 *ffmt)
+{
+	/*
+		Returns in ffmt the FFMT value that runs a spi-mem read operation:
+		an optional 8 bit command, up to FFMT_MAX_ADDR_LEN address bytes, up to FFMT_MAX_PAD_CNT dummy cycles
+		and the data, each phase on 1, 2 or 4 lines. Returns -EOPNOTSUPP if the operation does not fit.
+	*/
+	uint pad_cnt = 0;
+
+	if (op->cmd.nbytes > 1 || op->addr.nbytes > FFMT_MAX_ADDR_LEN
+		|| op->cmd.dtr || op->addr.dtr || op->dummy.dtr || op->data.dtr) {
+		return -EOPNOTSUPP;
+	}
+	if (op->dummy.nbytes) {
+		pad_cnt = op->dummy.nbytes * BITS_PER_BYTE / op->dummy.buswidth;
+		if (pad_cnt > FFMT_MAX_PAD_CNT) {
+			return -EOPNOTSUPP;
+		}
+	}
+	if ((op->cmd.nbytes && device_lanes_proto(op->cmd.buswidth) == UINT_MAX)
+		|| (op->addr.nbytes && device_lanes_proto(op->addr.buswidth) == UINT_MAX)
+		|| device_lanes_proto(op->data.buswidth) == UINT_MAX) {
+		return -EOPNOTSUPP;
+	}
+
+	*ffmt = (op->cmd.nbytes ? FFMT_CMD_EN : 0)
+		| (op->addr.nbytes << FFMT_ADDR_LEN_SHIFT)
+		| (pad_cnt << FFMT_PAD_CNT_SHIFT)
+		| ((op->cmd.nbytes ? device_lanes_proto(op->cmd.buswidth) : PROTOCOL_SINGLE) << FFMT_CMD_PROTO_SHIFT)
+		| ((op->addr.nbytes ? device_lanes_proto(op->addr.buswidth) : PROTOCOL_SINGLE) << FFMT_ADDR_PROTO_SHIFT)
+		| (device_lanes_proto(op->data.buswidth) << FFMT_DATA_PROTO_SHIFT)
+		| ((op->cmd.opcode & 0xFF) << FFMT_CMD_CODE_SHIFT);
+	return NO_ERROR;
 }
 
 // kernel interface
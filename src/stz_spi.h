@@ -0,0 +1,181 @@
+/*
+	File: stz_spi.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: User space interface of the SPI driver (ioctls on /dev/spiN).
+		Included by the driver and by user programs.
+*/
+
+#ifndef STZ_SPI_H
+#define STZ_SPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define STZ_SPI_IOC_MAGIC				's'
+#define STZ_SPI_MAX_SEGMENTS			64			// segments in one STZ_SPI_IOC_TRANSFER
+
+/*
+	One full-duplex segment of a transfer: len bytes are sent from tx_buf while len bytes
+	are received into rx_buf. A zero tx_buf sends zeros, a zero rx_buf discards the received bytes.
+	With tx_nbits or rx_nbits of 2 or 4, the segment is half duplex on that many data lines (dual, quad):
+	it receives into rx_buf on rx_nbits lines if rx_buf is set, otherwise it sends tx_buf on tx_nbits lines.
+	With STZ_SPI_SEG_WORD_DELAY in flags, the frames of the segment are word_delay SCK cycles apart
+	(SPI_DELAY_1_R interxfr) instead of the delay of the CS line's configuration.
+	After the segment, the driver waits delay_usecs and, if cs_change is set and more segments follow,
+	releases and re-asserts CS. CS is held between the other segments and released after the last.
+*/
+struct stz_spi_segment {
+	__u64 tx_buf;						// user space pointer
+	__u64 rx_buf;						// user space pointer
+	__u32 len;
+	__u32 speed_hz;						// SCK rate for this segment, 0 keeps the current rate
+	__u16 delay_usecs;
+	__u8 cs_change;
+	__u8 tx_nbits;						// data lines: 0 or 1 (single), 2 (dual) or 4 (quad)
+	__u8 rx_nbits;
+	__u8 word_delay;					// SCK cycles between frames, with STZ_SPI_SEG_WORD_DELAY
+	__u8 flags;							// STZ_SPI_SEG_* flags
+	__u8 pad;
+};
+
+#define STZ_SPI_SEG_WORD_DELAY			0x01		// word_delay is set
+
+/*
+	Command/response exchange, run as one transfer with CS held throughout: the tx_len command bytes
+	of tx_buf are sent, then rx_len zeros are clocked while the response is received into rx_buf.
+	The bytes received while the command is sent are discarded, so rx_buf gets exactly the response.
+*/
+struct stz_spi_write_read {
+	__u64 tx_buf;						// user space pointer
+	__u64 rx_buf;						// user space pointer
+	__u32 tx_len;						// at most STZ_SPI_MAX_COMMAND
+	__u32 rx_len;						// at most STZ_SPI_MAX_RESPONSE
+};
+
+#define STZ_SPI_MAX_COMMAND				256
+#define STZ_SPI_MAX_RESPONSE			65536
+
+/*
+	Periodic sampling: every period_us, the driver runs a transfer of tx_buf on the file's CS line,
+	max(tx_len, rx_skip + rx_len) bytes long (zeros are sent after tx_len), timed by a kernel timer.
+	The rx_len bytes received after the first rx_skip are stored, after a struct stz_spi_sample header,
+	as a record of STZ_SPI_SAMPLE_SIZE(rx_len) bytes in a ring of ring_records records (0: 256).
+	While sampling, read() on the file returns whole records, as many as fit.
+*/
+struct stz_spi_sampler {
+	__u64 tx_buf;						// user space pointer
+	__u32 tx_len;
+	__u32 rx_skip;
+	__u32 rx_len;
+	__u32 period_us;
+	__u32 ring_records;
+	__u32 pad;
+};
+
+#define STZ_SPI_MAX_SAMPLE				256			// bytes in a sampling transfer
+#define STZ_SPI_MAX_SAMPLE_RECORDS		4096
+#define STZ_SPI_SAMPLE_SIZE(rx_len)		((sizeof(struct stz_spi_sample) + (rx_len) + 7) & ~7UL)
+
+/*
+	Header of a sample record. seq numbers the periods since sampling started: a gap in seq means that
+	samples were lost, either because the bus was still busy with the previous one or because the ring was full.
+	overruns counts the samples lost since sampling started.
+*/
+struct stz_spi_sample {
+	__u64 timestamp_ns;					// CLOCK_MONOTONIC time the transfer started
+	__u32 seq;
+	__u32 overruns;
+};
+
+// Segments run back-to-back, on the CS line of the device file, in one system call
+struct stz_spi_transfer {
+	__u64 segments;						// user space pointer to an array of struct stz_spi_segment
+	__u32 num_segments;
+	__u32 pad;
+};
+
+// Mode bits of struct stz_spi_config, same values as the SPI core's SPI_CPHA, SPI_CPOL, SPI_CS_HIGH and SPI_LSB_FIRST
+#define STZ_SPI_CPHA					0x01		// sample on the trailing SCK edge
+#define STZ_SPI_CPOL					0x02		// SCK idles high
+#define STZ_SPI_CS_HIGH					0x04		// CS is active high
+#define STZ_SPI_LSB_FIRST				0x08
+#define STZ_SPI_MODE_MASK				(STZ_SPI_CPHA | STZ_SPI_CPOL | STZ_SPI_CS_HIGH | STZ_SPI_LSB_FIRST)
+
+/*
+	Configuration of the CS line of a /dev/spiN file. Each CS line keeps its own configuration,
+	which is programmed into the controller when a transfer switches to that line.
+*/
+struct stz_spi_config {
+	__u32 speed_hz;						// SCK rate, at most. 0 keeps the current rate
+	__u32 mode;							// STZ_SPI_* mode bits
+	__u32 delay0;						// SPI_DELAY_0_R value: cssck (bits 7:0) and sckcs (bits 23:16), in SCK cycles
+	__u32 delay1;						// SPI_DELAY_1_R value: intercs (bits 7:0) and interxfr (bits 23:16), in SCK cycles
+};
+
+// Transfer counters of the controller, since the driver was loaded
+struct stz_spi_stats {
+	__u64 transfers;					// transfers completed
+	__u64 bytes;						// bytes transferred
+	__u64 irqs;							// interrupts taken by transfers
+	__u64 polled_transfers;				// transfers moved by polling
+	__u64 irq_transfers;				// transfers moved by the interrupt handler
+	__u32 last_bytes;					// bytes in the last transfer
+	__u32 last_irqs;					// interrupts taken by the last transfer
+	__u64 busy_ns;						// time from the start to the end of the transfers
+	__u64 clocked_ns;					// time the transfers' bits take at their SCK rate: clocked_ns / busy_ns is the bus utilization
+	__u64 stream_bytes;					// bytes received by receive-only streaming reads
+	__u64 stream_ns;					// time of their transfers: stream_bytes / stream_ns is their sustained throughput
+	__u64 rx_overruns;					// received bytes dropped because a receive ring was full
+	__u64 rx_stalls;					// times writes waited for room in a receive ring, or were refused for lack of it (rx_backpressure)
+};
+
+/*
+	Header of the rings shared with user space by mmap on /dev/spiN: the header is followed by
+	a tx data area and an rx data area of size bytes each, at tx_offset and rx_offset in the mapping.
+	Indexes run freely and wrap at 2^32, byte i of an area is at area[i & (size - 1)].
+	User space writes tx data at tx_head and then advances tx_head, and consumes rx data up to rx_head,
+	then advances rx_tail. STZ_SPI_IOC_MMAP_KICK sends the tx data from tx_tail to tx_head,
+	as far as the rx area has room, storing the received bytes at rx_head.
+*/
+struct stz_spi_mmap_ring {
+	__u32 tx_head;						// written by user space
+	__u32 tx_tail;						// written by the driver
+	__u32 rx_head;						// written by the driver
+	__u32 rx_tail;						// written by user space
+	__u32 size;							// bytes in each data area, a power of two
+	__u32 tx_offset;
+	__u32 rx_offset;
+	__u32 pad;
+};
+
+#define STZ_SPI_IOC_TRANSFER			_IOW(STZ_SPI_IOC_MAGIC, 0, struct stz_spi_transfer)
+#define STZ_SPI_IOC_STATS				_IOR(STZ_SPI_IOC_MAGIC, 1, struct stz_spi_stats)
+#define STZ_SPI_IOC_MMAP_SIZE			_IOR(STZ_SPI_IOC_MAGIC, 2, __u32)		// length to mmap
+#define STZ_SPI_IOC_MMAP_KICK			_IO(STZ_SPI_IOC_MAGIC, 3)				// returns the bytes sent
+#define STZ_SPI_IOC_WR_CONFIG			_IOW(STZ_SPI_IOC_MAGIC, 4, struct stz_spi_config)
+#define STZ_SPI_IOC_RD_CONFIG			_IOR(STZ_SPI_IOC_MAGIC, 5, struct stz_spi_config)
+#define STZ_SPI_IOC_WRITE_READ			_IOW(STZ_SPI_IOC_MAGIC, 8, struct stz_spi_write_read)	// returns rx_len
+#define STZ_SPI_IOC_SAMPLER_START		_IOW(STZ_SPI_IOC_MAGIC, 9, struct stz_spi_sampler)
+#define STZ_SPI_IOC_SAMPLER_STOP		_IO(STZ_SPI_IOC_MAGIC, 10)			// records left can still be read
+#define STZ_SPI_IOC_RX_STREAM			_IOW(STZ_SPI_IOC_MAGIC, 11, __u32)		// STZ_SPI_RX_STREAM | fill byte, or 0
+
+/*
+	Receive-only streaming: once STZ_SPI_IOC_RX_STREAM is given STZ_SPI_RX_STREAM and a fill byte (bits 7:0),
+	read() on the file clocks its own data, sending the fill byte while it receives up to STZ_SPI_MAX_STREAM_READ
+	bytes per call, as one transfer with CS held. Given 0, read() returns the bytes received by writes again.
+*/
+#define STZ_SPI_RX_STREAM				0x100
+#define STZ_SPI_MAX_STREAM_READ			65536
+
+/*
+	Transactions: STZ_SPI_IOC_TXN_BEGIN starts one on a /dev/spiN file, STZ_SPI_IOC_TXN_END ends it.
+	From its first transfer on, the file keeps the bus with its CS line asserted, so the write()s, STZ_SPI_IOC_TRANSFER
+	calls and mmap kicks that follow on the file run as one transaction on the bus, with CS held between them.
+	The argument of STZ_SPI_IOC_TXN_BEGIN is the idle timeout in microseconds (0: the txn_idle_us module parameter):
+	if no call of the file uses the bus for that long, the driver ends the transaction itself, releasing CS
+	and the bus, and STZ_SPI_IOC_TXN_END then returns -ETIMEDOUT.
+*/
+#define STZ_SPI_IOC_TXN_BEGIN			_IOW(STZ_SPI_IOC_MAGIC, 6, __u32)		// idle timeout in us
+#define STZ_SPI_IOC_TXN_END				_IO(STZ_SPI_IOC_MAGIC, 7)
+
+#endif
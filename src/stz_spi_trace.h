@@ -0,0 +1,102 @@
+/*
+	File: stz_spi_trace.h
+	Authors: Salman, Tayyab, Zawaher
+	Description: Tracepoints of the SPI driver, in the stz_spi trace system
+		(/sys/kernel/tracing/events/stz_spi). Included by spi.c, which defines CREATE_TRACE_POINTS.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stz_spi
+
+#if !defined(STZ_SPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define STZ_SPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A transfer starts on a CS line of controller id: len bytes on lanes data lines, polled or interrupt driven
+TRACE_EVENT(stz_spi_transfer_start,
+	TP_PROTO(int id, uint cs, uint len, uint lanes, bool poll),
+	TP_ARGS(id, cs, len, lanes, poll),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(uint, cs)
+		__field(uint, len)
+		__field(uint, lanes)
+		__field(bool, poll)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cs = cs;
+		__entry->len = len;
+		__entry->lanes = lanes;
+		__entry->poll = poll;
+	),
+	TP_printk("controller %d cs %u len %u lanes %u %s", __entry->id, __entry->cs, __entry->len,
+			  __entry->lanes, __entry->poll ? "polled" : "irq")
+);
+
+// A transfer ends: frames sent and received, interrupts taken and time from its start
+TRACE_EVENT(stz_spi_transfer_end,
+	TP_PROTO(int id, uint cs, uint tx, uint rx, uint irqs, u64 ns),
+	TP_ARGS(id, cs, tx, rx, irqs, ns),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(uint, cs)
+		__field(uint, tx)
+		__field(uint, rx)
+		__field(uint, irqs)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->cs = cs;
+		__entry->tx = tx;
+		__entry->rx = rx;
+		__entry->irqs = irqs;
+		__entry->ns = ns;
+	),
+	TP_printk("controller %d cs %u tx %u rx %u irqs %u %llu ns", __entry->id, __entry->cs, __entry->tx,
+			  __entry->rx, __entry->irqs, __entry->ns)
+);
+
+// The tx fifo is refilled with frames, leaving in_flight frames sent but not yet received
+TRACE_EVENT(stz_spi_fifo_refill,
+	TP_PROTO(int id, uint frames, uint in_flight),
+	TP_ARGS(id, frames, in_flight),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(uint, frames)
+		__field(uint, in_flight)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->frames = frames;
+		__entry->in_flight = in_flight;
+	),
+	TP_printk("controller %d frames %u in flight %u", __entry->id, __entry->frames, __entry->in_flight)
+);
+
+// The hard interrupt handler runs, with the IP register and the interrupts enabled for the transfer
+TRACE_EVENT(stz_spi_irq,
+	TP_PROTO(int id, u32 ip, u32 ie),
+	TP_ARGS(id, ip, ie),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u32, ip)
+		__field(u32, ie)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->ip = ip;
+		__entry->ie = ie;
+	),
+	TP_printk("controller %d ip 0x%x ie 0x%x", __entry->id, __entry->ip, __entry->ie)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE stz_spi_trace
+#include <trace/define_trace.h>